@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+#include "admission.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+AdmissionLimits limits = { 0, 0, 0 };
+const char* refusal_reply = "";
+size_t refusal_length = 0;
+
+alignas(64) atomic<int64_t> open_sessions(0);
+
+//Open sessions per source address, as a count-min sketch: each address is counted in one bucket of each
+//row and its count is the smaller of the two, so two addresses only share a limit if they collide in both
+const size_t SOURCE_BUCKETS = 1 << 16;
+atomic<uint32_t> source_counts[2][SOURCE_BUCKETS];
+
+//Token bucket kept as the time the bucket is next full (GCRA), so taking a token is one compare-and-swap
+alignas(64) atomic<int64_t> bucket_full_ns(0);
+int64_t token_ns = 0;       //Time it takes one token to come back
+int64_t burst_ns = 0;       //Time it takes the whole bucket to refill
+
+alignas(64) atomic<uint64_t> admitted(0);
+atomic<uint64_t> refused_sessions(0);
+atomic<uint64_t> refused_source(0);
+atomic<uint64_t> refused_rate(0);
+
+//Source address each admitted socket was counted under, indexed by fd. A socket is only handled by one
+//thread at a time, and handing it over orders these accesses, so plain slots are enough
+const uint64_t COUNTED = 1ull << 32;
+vector<uint64_t> counted_fds;
+
+size_t source_bucket(uint32_t source, int row) {
+    const uint32_t multipliers[2] = { 0x9e3779b1u, 0x85ebca6bu };
+    return (source * multipliers[row]) >> 16;
+}
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool take_token() {
+    int64_t now = now_ns();
+    int64_t full = bucket_full_ns.load(memory_order_relaxed);
+    while (true) {
+        int64_t next = max(full, now) + token_ns;
+        if (next - now > burst_ns) {
+            return false;
+        }
+        if (bucket_full_ns.compare_exchange_weak(full, next, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+void release_source(uint32_t source) {
+    source_counts[0][source_bucket(source, 0)].fetch_sub(1, memory_order_relaxed);
+    source_counts[1][source_bucket(source, 1)].fetch_sub(1, memory_order_relaxed);
+}
+
+bool refuse(int client_fd, uint32_t source, atomic<uint64_t>& counter, const char* reason) {
+    counter.fetch_add(1, memory_order_relaxed);
+    //The reply must not hold up the accept loop, so it is dropped if the socket cannot take it at once
+    send(client_fd, refusal_reply, refusal_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    const unsigned char* ip = (const unsigned char*)&source;
+    LOG(LEVEL_INFO, "[%d] Refused connection from %u.%u.%u.%u (%s)\n", client_fd, ip[0], ip[1], ip[2], ip[3], reason);
+    close(client_fd);
+    return false;
+}
+
+}
+
+void start_admission(const AdmissionLimits& new_limits, const char* refusal) {
+    limits = new_limits;
+    refusal_reply = refusal;
+    refusal_length = strlen(refusal);
+    if (limits.rate > 0) {
+        token_ns = 1000000000LL / limits.rate;
+        burst_ns = token_ns * limits.rate;
+    }
+
+    //No descriptor can be numbered past the open file limit
+    struct rlimit rl;
+    size_t max_fds = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        max_fds = min((size_t)rl.rlim_cur, (size_t)1 << 20);
+    }
+    counted_fds.assign(max_fds, 0);
+}
+
+bool admit_connection(int client_fd, const struct sockaddr_in& addr) {
+    uint32_t source = addr.sin_addr.s_addr;
+    if (client_fd < 0 || (size_t)client_fd >= counted_fds.size()) {
+        //Only possible if the file limit was raised after startup; such sockets are not counted
+        admitted.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    if (limits.rate > 0 && !take_token()) {
+        return refuse(client_fd, source, refused_rate, "connection rate");
+    }
+
+    int64_t sessions = open_sessions.fetch_add(1, memory_order_relaxed);
+    if (limits.max_sessions > 0 && sessions >= limits.max_sessions) {
+        open_sessions.fetch_sub(1, memory_order_relaxed);
+        return refuse(client_fd, source, refused_sessions, "session cap");
+    }
+
+    if (limits.max_per_source > 0) {
+        uint32_t first = source_counts[0][source_bucket(source, 0)].fetch_add(1, memory_order_relaxed);
+        uint32_t second = source_counts[1][source_bucket(source, 1)].fetch_add(1, memory_order_relaxed);
+        if (min(first, second) >= (uint32_t)limits.max_per_source) {
+            release_source(source);
+            open_sessions.fetch_sub(1, memory_order_relaxed);
+            return refuse(client_fd, source, refused_source, "per-source cap");
+        }
+    }
+
+    counted_fds[client_fd] = COUNTED | source;
+    admitted.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool admit_connection(int client_fd) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(client_fd, (struct sockaddr*)&addr, &addrlen) < 0 || addr.sin_family != AF_INET) {
+        memset(&addr, 0, sizeof(addr));
+    }
+    return admit_connection(client_fd, addr);
+}
+
+void release_connection(int client_fd) {
+    if (client_fd < 0 || (size_t)client_fd >= counted_fds.size() || counted_fds[client_fd] == 0) {
+        return;
+    }
+    uint32_t source = (uint32_t)counted_fds[client_fd];
+    counted_fds[client_fd] = 0;
+    if (limits.max_per_source > 0) {
+        release_source(source);
+    }
+    open_sessions.fetch_sub(1, memory_order_relaxed);
+}
+
+AdmissionStats admission_stats() {
+    AdmissionStats stats;
+    stats.admitted = admitted.load(memory_order_relaxed);
+    stats.refused_sessions = refused_sessions.load(memory_order_relaxed);
+    stats.refused_source = refused_source.load(memory_order_relaxed);
+    stats.refused_rate = refused_rate.load(memory_order_relaxed);
+    stats.open = open_sessions.load(memory_order_relaxed);
+    return stats;
+}
+
+void print_admission_stats(FILE* out) {
+    AdmissionStats stats = admission_stats();
+    fprintf(out, "Admission: %llu admitted, %lld open; refused %llu at the session cap, %llu at the per-source cap, "
+            "%llu over the connection rate\n", (unsigned long long)stats.admitted, (long long)stats.open,
+            (unsigned long long)stats.refused_sessions, (unsigned long long)stats.refused_source,
+            (unsigned long long)stats.refused_rate);
+}
@@ -0,0 +1,42 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+//Admission control for accepted connections, shared by both servers and every I/O backend: a cap on open
+//sessions, a cap on open sessions per source address and a token bucket on the rate of new connections.
+//Deciding takes a few atomic operations and no locks, so it can run on the accept loop itself
+
+struct AdmissionLimits {
+    int max_sessions;       //0 for no cap
+    int max_per_source;     //0 for no cap
+    int rate;               //New connections per second, with a burst of as many; 0 for no limit
+};
+
+struct AdmissionStats {
+    uint64_t admitted;
+    uint64_t refused_sessions;
+    uint64_t refused_source;
+    uint64_t refused_rate;
+    int64_t open;           //Sessions admitted and not released yet
+};
+
+//Sets the limits and the reply sent to refused clients before they are closed
+void start_admission(const AdmissionLimits& limits, const char* refusal);
+
+//Decides whether a newly accepted client may be served. A refused client gets the refusal reply and its
+//socket is closed, so the caller must not touch client_fd after false
+bool admit_connection(int client_fd, const struct sockaddr_in& addr);
+
+//Same, for sockets accepted without their peer address
+bool admit_connection(int client_fd);
+
+//Gives back an admitted client's share of the limits; called before its socket is closed
+void release_connection(int client_fd);
+
+AdmissionStats admission_stats();
+void print_admission_stats(FILE* out);
+
+#endif
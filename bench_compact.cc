@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "mboxcompact.h"
+#include "expunger.h"
+#include "mboxindex.h"
+
+using namespace std;
+
+//Benchmark for QUIT deleting one message from a large mailbox: the old getline/ofstream rewrite, which
+//rehashes every message to find the deleted one, against compact_mailbox with the deleted message at a
+//few positions, and against only recording the deletion as a tombstone, which is all QUIT does with -x.
+//Each run starts from a fresh copy of the same mbox
+
+bool verbose = false;
+string mail_dir = ".";
+size_t mbox_size = 1024 << 20;
+size_t message_size = 64 << 10;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void copy_file(const string& from, const string& to) {
+    int in = open(from.c_str(), O_RDONLY);
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    fstat(in, &st);
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    while (in_offset < st.st_size && copy_file_range(in, &in_offset, out, &out_offset, st.st_size - in_offset, 0) > 0) {
+    }
+    fsync(out);
+    close(in);
+    close(out);
+}
+
+//process_QUIT before the index: every message is read line by line, hashed and copied unless deleted
+void rewrite_with_getline(const string& mbox_path, const string& deleted_uid) {
+    string temp_path = mail_dir + "/bench_compact.temp";
+    ofstream temp_file(temp_path);
+    ifstream old_file(mbox_path);
+    string line;
+    string message;
+    string copy_msg;
+    auto keep_message = [&]() {
+        MessageDigest digest;
+        IndexRecord record;
+        digest.update(message.data(), message.size());
+        digest.finish(record);
+        if (uid_string(record.uid) != deleted_uid) {
+            temp_file << copy_msg;
+        }
+    };
+    while (getline(old_file, line)) {
+        if (line.rfind("From ", 0) == 0) {
+            keep_message();
+            message.clear();
+            copy_msg.clear();
+        } else {
+            message += line + "\n";
+        }
+        copy_msg += line + "\n";
+    }
+    if (!message.empty()) {
+        keep_message();
+    }
+    temp_file.close();
+    rename(temp_path.c_str(), mbox_path.c_str());
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "d:m:s:")) != -1) {
+        switch (c) {
+            case 'd': mail_dir = optarg; break;
+            case 'm': mbox_size = atol(optarg) << 20; break;
+            case 's': message_size = atol(optarg) << 10; break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-m MB] [-s message KB]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    string master_path = mail_dir + "/bench_master.mbox";
+    string mbox_path = mail_dir + "/bench_compact.mbox";
+    FILE* out = fopen(master_path.c_str(), "w");
+    if (out == nullptr) {
+        perror(master_path.c_str());
+        return 1;
+    }
+    string line(98, 'x');
+    line += "\r\n";
+    for (size_t written = 0, i = 0; written < mbox_size; i++) {
+        written += fprintf(out, "From <bench@localhost> Sat Oct 17 12:00:00 2026\nSubject: message %zu\r\n\r\n", i);
+        for (size_t body = 0; body < message_size; body += line.size()) {
+            fputs(line.c_str(), out);
+        }
+        written += message_size;
+    }
+    fclose(out);
+
+    int master_fd = open(master_path.c_str(), O_RDONLY);
+    vector<IndexRecord> records;
+    load_index(master_path, master_fd, records);
+    close(master_fd);
+    printf("%zu messages, %.0f MB\n", records.size(), mbox_size / 1e6);
+    printf("%-24s %12s\n", "delete one message", "QUIT ms");
+
+    size_t middle = records.size() / 2;
+    copy_file(master_path, mbox_path);
+    double start = now();
+    rewrite_with_getline(mbox_path, uid_string(records[middle].uid));
+    printf("%-24s %12.1f\n", "getline, middle", (now() - start) * 1000);
+
+    struct Case {
+        const char* name;
+        size_t deleted;
+    };
+    Case cases[] = {
+        { "compact, last", records.size() - 1 },
+        { "compact, at 90%", records.size() * 9 / 10 },
+        { "compact, middle", middle },
+        { "compact, first", 0 },
+    };
+    for (const Case& each : cases) {
+        copy_file(master_path, mbox_path);
+        copy_file(index_path(master_path), index_path(mbox_path));
+        vector<bool> keep(records.size(), true);
+        keep[each.deleted] = false;
+        start = now();
+        int fd = open(mbox_path.c_str(), O_RDWR);
+        compact_mailbox(mbox_path, fd, records, keep, true);
+        close(fd);
+        printf("%-24s %12.1f\n", each.name, (now() - start) * 1000);
+    }
+
+    vector<bool> keep(records.size(), true);
+    keep[middle] = false;
+    start = now();
+    int fd = open(mbox_path.c_str(), O_RDONLY);
+    add_tombstones(mbox_path, fd, records, keep);
+    close(fd);
+    printf("%-24s %12.1f\n", "tombstone, middle", (now() - start) * 1000);
+    unlink(sibling_path(mbox_path, ".dead").c_str());
+
+    unlink(mbox_path.c_str());
+    unlink(index_path(mbox_path).c_str());
+    unlink(master_path.c_str());
+    unlink(index_path(master_path).c_str());
+    return 0;
+}
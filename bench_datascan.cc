@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include "datascanner.h"
+
+using namespace std;
+
+//Microbenchmark for the DATA terminator search: the previous append-and-find-from-the-start loop against
+//DataScanner, fed the same body in 1024-byte reads as the server used to receive it
+
+const size_t CHUNK = 1024;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Builds a body of about size bytes: 78-character lines, every tenth one dot-stuffed, then the terminator
+string make_body(size_t size) {
+    string body;
+    body.reserve(size + 128);
+    for (int line = 0; body.size() < size; line++) {
+        if (line % 10 == 0) {
+            body += "..";
+        }
+        body.append(76, 'a' + line % 26);
+        body += "\r\n";
+    }
+    body += ".\r\n";
+    return body;
+}
+
+//The loop process_DATA used to run: every read is appended and the whole message is searched again
+size_t scan_rescan(const string& body) {
+    string pending;
+    for (size_t offset = 0; offset < body.size(); offset += CHUNK) {
+        pending.append(body, offset, CHUNK);
+        size_t term_pos = pending.find("\r\n.\r\n");
+        if (term_pos != string::npos) {
+            return term_pos;
+        }
+    }
+    return 0;
+}
+
+size_t scan_incremental(const string& body) {
+    DataScanner scanner;
+    string pending;
+    for (size_t offset = 0; offset < body.size() && !scanner.isDone(); offset += CHUNK) {
+        size_t length = min(CHUNK, body.size() - offset);
+        scanner.scan(body.data() + offset, length, pending);
+    }
+    return pending.size();
+}
+
+//Runs scan repeatedly for about a quarter of a second and returns MB/s
+double measure(size_t (*scan)(const string&), const string& body) {
+    volatile size_t sink = 0;
+    int runs = 0;
+    double start = now(), elapsed;
+    do {
+        sink += scan(body);
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < 0.25);
+    (void)sink;
+    return body.size() * (double)runs / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    //The old loop is quadratic, so by default it is only timed up to 4 MB
+    size_t rescan_limit = 4 << 20;
+    int c;
+    while ((c = getopt(argc, argv, "l:")) != -1) {
+        switch (c) {
+            case 'l':
+                rescan_limit = (size_t)atol(optarg) << 20;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l max MB for the old loop]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    const size_t sizes[] = { 1 << 10, 16 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20, 50 << 20 };
+    printf("%10s %16s %16s\n", "body", "rescan MB/s", "scanner MB/s");
+    for (size_t size : sizes) {
+        string body = make_body(size);
+        char label[32];
+        snprintf(label, sizeof(label), size >= (1 << 20) ? "%zu MB" : "%zu KB", size >= (1 << 20) ? size >> 20 : size >> 10);
+        if (size <= rescan_limit) {
+            printf("%10s %16.1f %16.1f\n", label, measure(scan_rescan, body), measure(scan_incremental, body));
+        } else {
+            printf("%10s %16s %16.1f\n", label, "-", measure(scan_incremental, body));
+        }
+    }
+    return 0;
+}
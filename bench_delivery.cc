@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "mailwriter.h"
+#include "mboxindex.h"
+
+using namespace std;
+
+//Benchmark for mailbox appends under each fsync policy: concurrent sessions deliver to a few shared
+//mailboxes, and the run reports messages/sec against the p99 latency of a single append
+
+FsyncPolicy fsync_policy = FSYNC_NONE;
+int group_commit_window_us = 200;
+
+string mail_dir = ".";
+int num_threads = 16;
+int messages_per_thread = 200;
+int num_mailboxes = 4;
+size_t message_size = 4096;
+
+struct ThreadResult {
+    int id;
+    vector<double> latencies;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string mbox_path(int mailbox) {
+    return mail_dir + "/bench" + to_string(mailbox) + ".mbox";
+}
+
+void *session(void *arg) {
+    ThreadResult* result = (ThreadResult*)arg;
+    string header = "From <bench@localhost> Sat Oct 17 12:00:00 2026\n";
+    string body(message_size, 'x');
+    MailboxAppend message = { &header, -1, &body };
+
+    for (int i = 0; i < messages_per_thread; i++) {
+        double start = now();
+        if (!append_to_mailbox(mbox_path((result->id + i) % num_mailboxes), message)) {
+            fprintf(stderr, "Append failed\n");
+            exit(1);
+        }
+        result->latencies.push_back(now() - start);
+    }
+    return NULL;
+}
+
+void run(const char* name) {
+    for (int i = 0; i < num_mailboxes; i++) {
+        close(open(mbox_path(i).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    }
+
+    vector<ThreadResult> results(num_threads);
+    vector<pthread_t> threads(num_threads);
+    double start = now();
+    for (int i = 0; i < num_threads; i++) {
+        results[i].id = i;
+        pthread_create(&threads[i], NULL, session, &results[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    vector<double> latencies;
+    for (const ThreadResult& result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    sort(latencies.begin(), latencies.end());
+    double p99 = latencies[(size_t)(latencies.size() * 0.99)];
+    printf("%-8s %12.0f %12.3f\n", name, latencies.size() / elapsed, p99 * 1000);
+
+    for (int i = 0; i < num_mailboxes; i++) {
+        unlink(mbox_path(i).c_str());
+        unlink(index_path(mbox_path(i)).c_str());
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "d:m:n:s:t:w:")) != -1) {
+        switch (c) {
+            case 'd': mail_dir = optarg; break;
+            case 'm': messages_per_thread = atoi(optarg); break;
+            case 'n': num_mailboxes = atoi(optarg); break;
+            case 's': message_size = atol(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'w': group_commit_window_us = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-t threads] [-m messages per thread] [-n mailboxes] [-s bytes] [-w window us]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%d threads x %d messages of %zu bytes into %d mailboxes in %s\n", num_threads, messages_per_thread,
+           message_size, num_mailboxes, mail_dir.c_str());
+    printf("%-8s %12s %12s\n", "policy", "msgs/sec", "p99 ms");
+    const char* policies[] = { "none", "message", "group" };
+    for (const char* name : policies) {
+        parse_fsync_policy(name, fsync_policy);
+        run(name);
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <vector>
+#include "commandtable.h"
+
+using namespace std;
+
+//Benchmark for command dispatch: the old trim/transform(::toupper)/if-chain of string compares against
+//command_code() and a CommandTable lookup, over a mix of POP3 command lines as a mail client sends them
+
+int rounds = 2000000;
+
+const char* const lines[] = {
+    "USER linhphan", "PASS cis505", "STAT", "LIST", "uidl", "RETR 1", "LIST 2", "RETR 2", "dele 1",
+    "NOOP", "  RSET  ", "STAT", "RETR 3", "XTND foo", "CAPABILITIES", "QUIT",
+};
+const size_t NUM_LINES = sizeof(lines) / sizeof(lines[0]);
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string_view trim(string_view str) {
+    while (!str.empty() && isspace((unsigned char)str.front())) {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && isspace((unsigned char)str.back())) {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+//Every handler adds its own weight so neither dispatcher can be optimised away
+size_t counter;
+
+void handle(size_t weight, string_view argument) {
+    counter += weight + argument.size();
+}
+
+void dispatch_chain(string_view command) {
+    command = trim(command);
+    size_t space_pos = command.find(' ');
+    string_view word = (space_pos != string_view::npos) ? command.substr(0, space_pos) : command;
+    string_view argument = (space_pos != string_view::npos) ? command.substr(space_pos + 1) : string_view();
+
+    char upper[8];
+    string_view cmd = word;
+    if (word.size() <= sizeof(upper)) {
+        transform(word.begin(), word.end(), upper, ::toupper);
+        cmd = string_view(upper, word.size());
+    }
+
+    if (cmd == "USER") {
+        handle(1, argument);
+    } else if (cmd == "PASS") {
+        handle(2, argument);
+    } else if (cmd == "STAT") {
+        handle(3, argument);
+    } else if (cmd == "LIST") {
+        handle(4, argument);
+    } else if (cmd == "UIDL") {
+        handle(5, argument);
+    } else if (cmd == "RETR") {
+        handle(6, argument);
+    } else if (cmd == "DELE") {
+        handle(7, argument);
+    } else if (cmd == "RSET") {
+        handle(8, argument);
+    } else if (cmd == "NOOP") {
+        handle(9, argument);
+    } else if (cmd == "QUIT") {
+        handle(10, argument);
+    } else {
+        handle(11, argument);
+    }
+}
+
+struct BenchCommand {
+    uint32_t code;
+    size_t weight;
+    void (*handler)(size_t weight, string_view argument);
+};
+
+constexpr BenchCommand bench_commands[] = {
+    { command_code("USER"), 1, handle }, { command_code("PASS"), 2, handle }, { command_code("STAT"), 3, handle },
+    { command_code("LIST"), 4, handle }, { command_code("UIDL"), 5, handle }, { command_code("RETR"), 6, handle },
+    { command_code("DELE"), 7, handle }, { command_code("RSET"), 8, handle }, { command_code("NOOP"), 9, handle },
+    { command_code("QUIT"), 10, handle },
+};
+
+constexpr CommandTable<BenchCommand> bench_table = make_command_table(bench_commands);
+
+void dispatch_table(string_view command) {
+    string_view word;
+    string_view argument;
+    split_command(command, word, argument);
+    const BenchCommand* entry = bench_table.find(command_code(word));
+    if (entry == nullptr) {
+        handle(11, argument);
+    } else {
+        entry->handler(entry->weight, argument);
+    }
+}
+
+//Returns nanoseconds per command and the handlers' total
+double run(void (*dispatch)(string_view), const vector<string_view>& commands, size_t& total) {
+    counter = 0;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (string_view command : commands) {
+            dispatch(command);
+        }
+    }
+    double elapsed = now() - start;
+    total = counter;
+    return elapsed * 1e9 / ((double)rounds * commands.size());
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+            case 'n': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    vector<string_view> commands(lines, lines + NUM_LINES);
+    size_t chain_total;
+    size_t table_total;
+    double chain_ns = run(dispatch_chain, commands, chain_total);
+    double table_ns = run(dispatch_table, commands, table_total);
+
+    printf("%d rounds of %zu command lines; ns per command\n", rounds, NUM_LINES);
+    printf("%-12s %10.2f\n", "if-chain", chain_ns);
+    printf("%-12s %10.2f\n", "table", table_ns);
+    if (chain_total != table_total) {
+        fprintf(stderr, "Dispatchers disagree (%zu vs %zu)\n", chain_total, table_total);
+        return 1;
+    }
+    return 0;
+}
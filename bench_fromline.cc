@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include "fromline.h"
+
+using namespace std;
+
+//Benchmark for building the mbox From line: the old time/localtime/stringstream/put_time code against
+//build_from_line, with many threads building lines at once as concurrent deliveries would
+
+int lines_per_thread = 200000;
+const string sender = "linhphan@localhost";
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *build_with_stringstream(void *arg) {
+    size_t* total = (size_t*)arg;
+    for (int i = 0; i < lines_per_thread; i++) {
+        time_t now = time(0);
+        struct tm* now_tm = localtime(&now);
+        stringstream ss;
+        ss << put_time(now_tm, "%a %b %d %H:%M:%S %Y");
+        string formatted_time = ss.str();
+        string header = "From <" + sender + "> " + formatted_time;
+        header += "\n";
+        *total += header.size();
+    }
+    return NULL;
+}
+
+void *build_cached(void *arg) {
+    size_t* total = (size_t*)arg;
+    string header;
+    for (int i = 0; i < lines_per_thread; i++) {
+        build_from_line(header, sender);
+        header += '\n';
+        *total += header.size();
+    }
+    return NULL;
+}
+
+//Returns nanoseconds per line, measured across all threads
+double run(void *(*builder)(void *), int num_threads) {
+    vector<pthread_t> threads(num_threads);
+    vector<size_t> totals(num_threads * 8, 0);
+    double start = now();
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, builder, &totals[i * 8]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    return elapsed * 1e9 / ((double)lines_per_thread * num_threads);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+            case 'n': lines_per_thread = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n lines per thread]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("%d From lines per thread; ns per line across all threads\n", lines_per_thread);
+    printf("%-8s %14s %14s\n", "threads", "stringstream", "cached");
+    const int thread_counts[] = { 1, 4, 16, 64 };
+    for (int num_threads : thread_counts) {
+        double old_ns = run(build_with_stringstream, num_threads);
+        double new_ns = run(build_cached, num_threads);
+        printf("%-8d %14.1f %14.1f\n", num_threads, old_ns, new_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "mboxparser.h"
+
+using namespace std;
+
+//Benchmark for splitting an mbox into messages: the fgets loop PASS and RETR used and the getline loop
+//QUIT used, each building a string per line, against the mapped parser with memchr and with AVX2.
+//The mbox is read once first so every run parses from the page cache
+
+string mail_dir = ".";
+size_t mbox_size = 256 << 20;
+int rounds = 3;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t parse_fgets(const string& path) {
+    FILE* fp = fopen(path.c_str(), "r");
+    string line;
+    string message;
+    size_t messages = 0;
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        line = string(buffer);
+        if (line.rfind("From ", 0) == 0) {
+            messages++;
+            message.clear();
+        } else {
+            message += line;
+        }
+    }
+    fclose(fp);
+    return messages;
+}
+
+size_t parse_getline(const string& path) {
+    ifstream file(path);
+    string line;
+    string message;
+    size_t messages = 0;
+    while (getline(file, line)) {
+        if (line.rfind("From ", 0) == 0) {
+            messages++;
+            message.clear();
+        } else {
+            message += line + "\n";
+        }
+    }
+    return messages;
+}
+
+size_t parse_mapped(const string& path, size_t (*search)(const char*, size_t, size_t)) {
+    int fd = open(path.c_str(), O_RDONLY);
+    MappedMbox mbox;
+    mbox.map(fd);
+    size_t messages = (mbox.size() >= 5 && memcmp(mbox.data(), "From ", 5) == 0) ? 1 : 0;
+    size_t position = 0;
+    while ((position = search(mbox.data(), mbox.size(), position)) < mbox.size()) {
+        messages++;
+        position++;
+    }
+    close(fd);
+    return messages;
+}
+
+size_t parse_spans(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    MappedMbox mbox;
+    mbox.map(fd);
+    vector<MboxSpan> spans;
+    find_messages(mbox.data(), mbox.size(), spans);
+    close(fd);
+    return spans.size();
+}
+
+size_t run_memchr(const string& path) {
+    return parse_mapped(path, find_boundary_memchr);
+}
+
+size_t run_simd(const string& path) {
+    return parse_mapped(path, find_boundary);
+}
+
+void run(const char* name, size_t (*parse)(const string&), const string& path, size_t expected) {
+    double best = 1e9;
+    for (int i = 0; i < rounds; i++) {
+        double start = now();
+        size_t messages = parse(path);
+        best = min(best, now() - start);
+        if (messages != expected) {
+            fprintf(stderr, "%s found %zu messages instead of %zu\n", name, messages, expected);
+            exit(1);
+        }
+    }
+    printf("%-10s %10.3f\n", name, mbox_size / best / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "d:m:r:")) != -1) {
+        switch (c) {
+            case 'd': mail_dir = optarg; break;
+            case 'm': mbox_size = atol(optarg) << 20; break;
+            case 'r': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-m MB] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    //Messages of 1 to 8 KB of ordinary 20 to 100 character lines
+    string path = mail_dir + "/bench_mboxscan.mbox";
+    FILE* out = fopen(path.c_str(), "w");
+    if (out == nullptr) {
+        perror(path.c_str());
+        return 1;
+    }
+    srand(1);
+    size_t written = 0;
+    size_t messages = 0;
+    while (written < mbox_size) {
+        written += fprintf(out, "From <bench@localhost> Sat Oct 17 12:00:00 2026\nSubject: message %zu\r\n\r\n", messages++);
+        size_t body = 1024 + rand() % 7168;
+        size_t length = 0;
+        while (length < body) {
+            string line(20 + rand() % 80, 'a' + rand() % 26);
+            line += "\r\n";
+            fputs(line.c_str(), out);
+            length += line.size();
+        }
+        written += length;
+    }
+    fclose(out);
+    mbox_size = written;
+    parse_spans(path);
+
+    printf("%zu messages, %.0f MB\n", messages, mbox_size / 1e6);
+    printf("%-10s %10s\n", "parser", "GB/s");
+    run("fgets", parse_fgets, path, messages);
+    run("getline", parse_getline, path, messages);
+    run("memchr", run_memchr, path, messages);
+    run("simd", run_simd, path, messages);
+    run("spans", parse_spans, path, messages);
+    unlink(path.c_str());
+    return 0;
+}
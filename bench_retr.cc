@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include "mboxindex.h"
+#include "netio.h"
+
+using namespace std;
+
+//Benchmark for downloading a whole mailbox with RETR: the old lookup, which rescans the mbox from the
+//top and hashes every message until one matches, against serving each message's byte range from the
+//index with sendfile. The old lookup is quadratic, so it is timed on every 100th message and scaled up
+
+string mail_dir = ".";
+int num_messages = 10000;
+size_t message_size = 2048;
+int sample_every = 100;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string uid_of(const string& message) {
+    MessageDigest digest;
+    IndexRecord record;
+    digest.update(message.data(), message.size());
+    digest.finish(record);
+    return uid_string(record.uid);
+}
+
+//process_RETR before the index: fgets through the mbox, one string per line, until a message hashes to uid
+bool retr_by_rescan(const string& mbox_path, const string& uid, int out_fd) {
+    FILE* fp = fopen(mbox_path.c_str(), "r");
+    if (fp == nullptr) {
+        return false;
+    }
+    string line;
+    string message;
+    bool message_found = false;
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        line = string(buffer);
+        if (line.rfind("From ", 0) == 0) {
+            if (uid_of(message) == uid) {
+                message_found = true;
+                break;
+            }
+            message.clear();
+        } else {
+            message += line;
+        }
+    }
+    if (!message_found && !message.empty() && uid_of(message) == uid) {
+        message_found = true;
+    }
+    fclose(fp);
+    if (message_found) {
+        send_reply(out_fd, message.data(), message.size());
+    }
+    return message_found;
+}
+
+bool retr_by_range(int mbox_fd, const IndexRecord& record, int out_fd) {
+    return send_file_range(out_fd, mbox_fd, record.offset + record.header_length,
+                           record.length - record.header_length) >= 0;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "d:n:s:")) != -1) {
+        switch (c) {
+            case 'd': mail_dir = optarg; break;
+            case 'n': num_messages = atoi(optarg); break;
+            case 's': message_size = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-n messages] [-s bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    //Messages differ in their first line, so every one has its own UID
+    string mbox_path = mail_dir + "/bench_retr.mbox";
+    FILE* out = fopen(mbox_path.c_str(), "w");
+    if (out == nullptr) {
+        perror(mbox_path.c_str());
+        return 1;
+    }
+    string filler(78, 'x');
+    filler += "\r\n";
+    for (int i = 0; i < num_messages; i++) {
+        fprintf(out, "From <bench@localhost> Sat Oct 17 12:00:00 2026\nSubject: message %d\r\n\r\n", i);
+        for (size_t written = 0; written < message_size; written += filler.size()) {
+            fputs(filler.c_str(), out);
+        }
+    }
+    fclose(out);
+
+    int mbox_fd = open(mbox_path.c_str(), O_RDONLY);
+    int null_fd = open("/dev/null", O_WRONLY);
+    unlink(index_path(mbox_path).c_str());
+    vector<IndexRecord> records;
+    double start = now();
+    load_index(mbox_path, mbox_fd, records);
+    double rebuild = now() - start;
+    start = now();
+    load_index(mbox_path, mbox_fd, records);
+    double load = now() - start;
+    printf("%d messages of about %zu bytes; index rebuilt in %.3f s, loaded in %.3f ms\n", num_messages, message_size,
+           rebuild, load * 1000);
+
+    start = now();
+    int sampled = 0;
+    for (size_t i = 0; i < records.size(); i += sample_every) {
+        if (!retr_by_rescan(mbox_path, uid_string(records[i].uid), null_fd)) {
+            fprintf(stderr, "Message %zu not found\n", i + 1);
+            return 1;
+        }
+        sampled++;
+    }
+    double rescan = (now() - start) / sampled * records.size();
+
+    start = now();
+    for (const IndexRecord& record : records) {
+        if (!retr_by_range(mbox_fd, record, null_fd)) {
+            fprintf(stderr, "sendfile failed\n");
+            return 1;
+        }
+    }
+    double ranged = now() - start;
+
+    printf("%-8s %14s\n", "RETR", "download s");
+    printf("%-8s %14.3f  (estimated from %d messages)\n", "rescan", rescan, sampled);
+    printf("%-8s %14.3f\n", "range", ranged);
+
+    close(mbox_fd);
+    close(null_fd);
+    unlink(index_path(mbox_path).c_str());
+    unlink(mbox_path.c_str());
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "blobstore.h"
+#include "mboxcompact.h"
+#include "lockmanager.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+const time_t BLOB_GRACE = 3600;         //Seconds a new or reused blob is kept whether or not it is referred to
+const time_t SWEEP_INTERVAL = 300;      //Minimum seconds between two sweeps
+
+string sweep_dir;
+pthread_mutex_t sweep_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sweep_wanted = PTHREAD_COND_INITIALIZER;
+bool sweep_requested = false;
+uint64_t sweep_count = 0;
+uint64_t removed_count = 0;
+uint64_t reclaimed_bytes = 0;
+
+//Takes the flock on blobs/.lock, shared to reuse a blob and exclusive to remove some, so a blob is never
+//removed between SMTP finding it and refreshing its time. Returns the descriptor to close, or -1
+int lock_store(const string& blob_dir, int operation) {
+    int fd = open((blob_dir + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, operation) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+//Adds the blobs the messages of one mbox refer to. A compaction cut short is finished first, since the
+//messages it was moving are only in its journal
+bool collect_mailbox(const string& mbox_path, unordered_set<string>& referenced) {
+    lock_mailbox(mbox_path, LOCK_EXCLUSIVE);
+    recover_compaction(mbox_path);
+    unlock_mailbox(mbox_path);
+
+    lock_mailbox(mbox_path, LOCK_SHARED);
+    int mbox_fd = open(mbox_path.c_str(), O_RDONLY);
+    vector<IndexRecord> records;
+    bool ok = mbox_fd < 0 ? errno == ENOENT : load_index(mbox_path, mbox_fd, records);
+    string from_line;
+    for (size_t i = 0; ok && i < records.size(); i++) {
+        if (!(records[i].flags & INDEX_BLOB)) {
+            continue;
+        }
+        from_line.resize(records[i].header_length);
+        ok = pread(mbox_fd, &from_line[0], from_line.size(), records[i].offset) == (ssize_t)from_line.size();
+        string_view name = blob_name(from_line);
+        if (ok && !name.empty()) {
+            referenced.insert(string(name));
+        }
+    }
+    if (mbox_fd >= 0) {
+        close(mbox_fd);
+    }
+    unlock_mailbox(mbox_path);
+    return ok;
+}
+
+//Adds the blobs the messages still in the delivery queue refer to, from the From line each envelope
+//starts with
+bool collect_queue(const string& mail_dir, unordered_set<string>& referenced) {
+    string queue_dir = mail_dir + "/queue";
+    DIR* dir = opendir(queue_dir.c_str());
+    if (dir == nullptr) {
+        return errno == ENOENT;
+    }
+    char* line = nullptr;
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        string name = entry->d_name;
+        if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".env") != 0) {
+            continue;
+        }
+        FILE* fp = fopen((queue_dir + "/" + name).c_str(), "r");
+        if (fp == nullptr) {
+            continue;
+        }
+        ssize_t length = getline(&line, &capacity, fp);
+        if (length > 0) {
+            string_view blob = blob_name(string_view(line, length));
+            if (!blob.empty()) {
+                referenced.insert(string(blob));
+            }
+        }
+        fclose(fp);
+    }
+    free(line);
+    closedir(dir);
+    return true;
+}
+
+void* sweeper(void* arg) {
+    (void)arg;
+    time_t last_sweep = 0;
+    pthread_mutex_lock(&sweep_mutex);
+    while (true) {
+        while (!sweep_requested) {
+            pthread_cond_wait(&sweep_wanted, &sweep_mutex);
+        }
+        //Requests that come in while it waits are served by the same sweep
+        time_t wait = last_sweep + SWEEP_INTERVAL - time(nullptr);
+        pthread_mutex_unlock(&sweep_mutex);
+        if (wait > 0) {
+            sleep(wait);
+        }
+        pthread_mutex_lock(&sweep_mutex);
+        sweep_requested = false;
+        pthread_mutex_unlock(&sweep_mutex);
+
+        sweep_blobs(sweep_dir);
+        last_sweep = time(nullptr);
+        pthread_mutex_lock(&sweep_mutex);
+    }
+    return NULL;
+}
+
+}
+
+bool reuse_blob(const string& blob_path) {
+    size_t slash = blob_path.rfind('/');
+    string blob_dir = (slash == string::npos) ? string(".") : blob_path.substr(0, slash);
+    int lock_fd = lock_store(blob_dir, LOCK_SH);
+    if (lock_fd < 0) {
+        return false;
+    }
+    bool ok = utimensat(AT_FDCWD, blob_path.c_str(), nullptr, 0) == 0;
+    close(lock_fd);
+    return ok;
+}
+
+bool start_blob_sweeper(const string& mail_dir) {
+    sweep_dir = mail_dir;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sweeper, NULL) != 0) {
+        LOG(LEVEL_ERROR, "Cannot start blob sweeper\n");
+        return false;
+    }
+    pthread_detach(thread);
+    //Blobs freed before a restart are still owed a sweep
+    request_blob_sweep();
+    return true;
+}
+
+bool drops_blob(const vector<IndexRecord>& records, const vector<bool>& keep) {
+    for (size_t i = 0; i < records.size(); i++) {
+        if (!keep[i] && (records[i].flags & INDEX_BLOB)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void request_blob_sweep() {
+    pthread_mutex_lock(&sweep_mutex);
+    sweep_requested = true;
+    pthread_cond_signal(&sweep_wanted);
+    pthread_mutex_unlock(&sweep_mutex);
+}
+
+bool sweep_blobs(const string& mail_dir) {
+    string blob_dir = mail_dir + "/blobs";
+    if (access(blob_dir.c_str(), F_OK) < 0) {
+        return true;
+    }
+    //A blob changed after this is new enough to keep, however the mailboxes looked when they were read
+    time_t started = time(nullptr);
+
+    unordered_set<string> referenced;
+    DIR* dir = opendir(mail_dir.c_str());
+    if (dir == nullptr) {
+        LOG(LEVEL_ERROR, "Cannot read %s (%s)\n", mail_dir.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != nullptr) {
+        string name = entry->d_name;
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".mbox") == 0) {
+            string mbox_path = mailbox_key(mail_dir, name.substr(0, name.size() - 5));
+            ok = collect_mailbox(mbox_path, referenced);
+            if (!ok) {
+                LOG(LEVEL_ERROR, "Cannot read %s, blobs are not swept (%s)\n", mbox_path.c_str(), strerror(errno));
+            }
+        }
+    }
+    closedir(dir);
+    ok = ok && collect_queue(mail_dir, referenced);
+    if (!ok) {
+        return false;
+    }
+
+    int lock_fd = lock_store(blob_dir, LOCK_EX);
+    dir = (lock_fd >= 0) ? opendir(blob_dir.c_str()) : nullptr;
+    if (dir == nullptr) {
+        LOG(LEVEL_ERROR, "Cannot read %s (%s)\n", blob_dir.c_str(), strerror(errno));
+        if (lock_fd >= 0) {
+            close(lock_fd);
+        }
+        return false;
+    }
+    uint64_t removed = 0;
+    uint64_t bytes = 0;
+    while ((entry = readdir(dir)) != nullptr) {
+        //Left alone: the lock file, blobs still referred to and recent ones. Temp files a crashed delivery
+        //left behind are removed once they are old enough
+        string name = entry->d_name;
+        if (name == "." || name == ".." || name == ".lock" || referenced.count(name) > 0) {
+            continue;
+        }
+        string path = blob_dir + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || st.st_mtime >= started - BLOB_GRACE) {
+            continue;
+        }
+        if (unlink(path.c_str()) == 0) {
+            removed++;
+            bytes += st.st_size;
+        }
+    }
+    closedir(dir);
+    close(lock_fd);
+
+    pthread_mutex_lock(&sweep_mutex);
+    sweep_count++;
+    removed_count += removed;
+    reclaimed_bytes += bytes;
+    pthread_mutex_unlock(&sweep_mutex);
+    if (removed > 0) {
+        LOG(LEVEL_INFO, "Removed %llu unreferenced blobs, %.1f MB\n", (unsigned long long)removed, bytes / 1e6);
+    }
+    return true;
+}
+
+BlobStats blob_stats() {
+    pthread_mutex_lock(&sweep_mutex);
+    BlobStats stats = { sweep_count, removed_count, reclaimed_bytes };
+    pthread_mutex_unlock(&sweep_mutex);
+    return stats;
+}
+
+void print_blob_stats(FILE* out) {
+    BlobStats stats = blob_stats();
+    fprintf(out, "Blobs: %llu sweeps, %llu removed, %.1f MB reclaimed\n", (unsigned long long)stats.sweeps,
+            (unsigned long long)stats.removed, stats.bytes_reclaimed / 1e6);
+}
@@ -0,0 +1,44 @@
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "mboxindex.h"
+
+//Reclaiming the single-instance message store (see smtp -b). A blob in mail_dir/blobs is shared by every
+//mailbox its message was delivered to, so it can only be removed once no mbox and no queued message
+//refers to it. The POP3 server asks for a sweep whenever it removes a blob message from an mbox; a
+//thread of its own then reads the blob references of every mailbox index and queued envelope and
+//removes the blobs nothing refers to. A blob changed within the last hour is always kept, since the
+//message that refers to it may still be on its way into the mailboxes; SMTP refreshes the time of a
+//blob it reuses for that reason
+
+struct BlobStats {
+    uint64_t sweeps;
+    uint64_t removed;
+    uint64_t bytes_reclaimed;
+};
+
+//Refreshes the time of the blob at blob_path so no sweep removes it while the message that reuses it is
+//delivered. Returns false if there is no such blob
+bool reuse_blob(const std::string& blob_path);
+
+//Starts the thread that sweeps mail_dir's blobs when asked, and asks for a first sweep
+bool start_blob_sweeper(const std::string& mail_dir);
+
+//True if a record whose keep flag is false is a blob message, i.e. removing them may free a blob
+bool drops_blob(const std::vector<IndexRecord>& records, const std::vector<bool>& keep);
+
+//Asks for a sweep. Sweeps run at most every few minutes, so many removals in a row cost one
+void request_blob_sweep();
+
+//Removes the blobs under mail_dir that no mailbox or queued message refers to. False if some mailbox
+//could not be read, in which case nothing is removed
+bool sweep_blobs(const std::string& mail_dir);
+
+BlobStats blob_stats();
+void print_blob_stats(FILE* out);
+
+#endif
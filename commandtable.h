@@ -0,0 +1,85 @@
+#ifndef COMMANDTABLE_H
+#define COMMANDTABLE_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+//Compile-time command dispatch shared by both servers. Every SMTP and POP3 verb is four letters, so a verb
+//is packed into a uint32_t with its letters upper-cased. Each protocol lists its commands in one constexpr
+//array; make_command_table() turns that array into a 32-slot table indexed by a multiplicative hash whose
+//multiplier is searched for at compile time so that no two verbs share a slot. A lookup is one multiply,
+//one shift and one compare
+
+//Packs a verb, upper-casing ASCII letters; any word that is not four bytes long gives 0
+constexpr uint32_t command_code(std::string_view word) {
+    if (word.size() != 4) {
+        return 0;
+    }
+    uint32_t code = (uint32_t)(unsigned char)word[0] | (uint32_t)(unsigned char)word[1] << 8 |
+                    (uint32_t)(unsigned char)word[2] << 16 | (uint32_t)(unsigned char)word[3] << 24;
+
+    //Subtracts 0x20 from every byte between 'a' and 'z', four bytes at a time
+    uint32_t low = code & 0x7f7f7f7f;
+    uint32_t lower = ((low + 0x1f1f1f1f) ^ (low + 0x05050505)) & ~code & 0x80808080;
+    return code - (lower >> 2);
+}
+
+//Trims a command line and splits it into its verb and argument at the first space
+inline void split_command(std::string_view line, std::string_view& word, std::string_view& argument) {
+    while (!line.empty() && isspace((unsigned char)line.front())) {
+        line.remove_prefix(1);
+    }
+    while (!line.empty() && isspace((unsigned char)line.back())) {
+        line.remove_suffix(1);
+    }
+    size_t space_pos = line.find(' ');
+    word = line.substr(0, space_pos);
+    argument = (space_pos != std::string_view::npos) ? line.substr(space_pos + 1) : std::string_view();
+}
+
+//Bit for a session state in a command's set of allowed states
+constexpr unsigned state_bit(unsigned state) {
+    return 1u << state;
+}
+
+const unsigned ANY_STATE = ~0u;
+
+const size_t COMMAND_SLOTS = 32;
+
+//Command must be an aggregate with a uint32_t code and a handler pointer that is null in unused slots
+template <typename Command>
+struct CommandTable {
+    Command slots[COMMAND_SLOTS];
+    uint32_t multiplier;
+
+    constexpr size_t slot(uint32_t code) const {
+        return (uint32_t)(code * multiplier) >> 27;
+    }
+
+    constexpr const Command* find(uint32_t code) const {
+        const Command& command = slots[slot(code)];
+        return (command.handler != nullptr && command.code == code) ? &command : nullptr;
+    }
+};
+
+template <typename Command, size_t N>
+constexpr CommandTable<Command> make_command_table(const Command (&commands)[N]) {
+    static_assert(N <= COMMAND_SLOTS / 2, "too many commands for the dispatch table");
+    for (uint32_t multiplier = 0x9e3779b1; ; multiplier += 2) {
+        CommandTable<Command> table{};
+        table.multiplier = multiplier;
+        bool collision = false;
+        for (size_t i = 0; i < N && !collision; i++) {
+            Command& slot = table.slots[table.slot(commands[i].code)];
+            collision = slot.handler != nullptr;
+            slot = commands[i];
+        }
+        if (!collision) {
+            return table;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include <string.h>
+#include "datascanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace std;
+
+#ifdef HAVE_X86_SIMD
+
+//Compares 32 bytes at a time against CR
+__attribute__((target("avx2")))
+static size_t find_cr_avx2(const char* buffer, size_t length) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(buffer + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, cr));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < length; i++) {
+        if (buffer[i] == '\r') {
+            return i;
+        }
+    }
+    return length;
+}
+
+//Compares 16 bytes at a time against CR
+__attribute__((target("sse2")))
+static size_t find_cr_sse2(const char* buffer, size_t length) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(buffer + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < length; i++) {
+        if (buffer[i] == '\r') {
+            return i;
+        }
+    }
+    return length;
+}
+
+size_t find_cr(const char* buffer, size_t length) {
+    //Picks the widest instruction set the CPU supports, once per process
+    static size_t (*const implementation)(const char*, size_t) =
+        __builtin_cpu_supports("avx2") ? find_cr_avx2 : find_cr_sse2;
+    return implementation(buffer, length);
+}
+
+#else
+
+size_t find_cr(const char* buffer, size_t length) {
+    const char* cr = (const char*)memchr(buffer, '\r', length);
+    return cr != nullptr ? cr - buffer : length;
+}
+
+#endif
+
+size_t DataScanner::scan(const char* buffer, size_t length, string& out) {
+    size_t i = 0;
+    while (i < length && state != DONE) {
+        if (state == IN_LINE) {
+            //Copies the rest of the line up to and including its CR in one go
+            size_t run = find_cr(buffer + i, length - i);
+            out.append(buffer + i, run);
+            i += run;
+            if (i == length) {
+                break;
+            }
+            out.push_back('\r');
+            i++;
+            state = CR;
+            continue;
+        }
+
+        char c = buffer[i++];
+        switch (state) {
+            case LINE_START:
+                if (c == '.') {
+                    state = DOT;
+                    break;
+                }
+                out.push_back(c);
+                state = (c == '\r') ? CR : IN_LINE;
+                break;
+            case CR:
+                out.push_back(c);
+                state = (c == '\n') ? LINE_START : (c == '\r') ? CR : IN_LINE;
+                break;
+            case DOT:
+                if (c == '\r') {
+                    state = DOT_CR;
+                    break;
+                }
+                //The leading dot was stuffing; the rest of the line is kept
+                out.push_back(c);
+                state = IN_LINE;
+                break;
+            case DOT_CR:
+                if (c == '\n') {
+                    state = DONE;
+                    break;
+                }
+                //A dot line that is not the terminator; only the dot is dropped
+                out.push_back('\r');
+                out.push_back(c);
+                state = (c == '\r') ? CR : IN_LINE;
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
@@ -0,0 +1,37 @@
+#ifndef DATASCANNER_H
+#define DATASCANNER_H
+
+#include <string>
+
+//Incremental scanner for the message body that follows DATA. Each byte is looked at once: the scanner keeps
+//its place across reads, finds the <CRLF>.<CRLF> terminator and removes dot-stuffing (RFC 5321 4.5.2) as it goes
+class DataScanner {
+public:
+    enum ScanState {
+        LINE_START,     //At the start of a line, where a leading dot is significant
+        IN_LINE,        //Inside a line; only CR can change the state
+        CR,             //Just after a CR inside a line
+        DOT,            //After a dot at the start of a line
+        DOT_CR,         //After ".\r" at the start of a line
+        DONE            //The terminator has been consumed
+    };
+
+private:
+    ScanState state;
+
+public:
+    DataScanner() : state(LINE_START) {}
+
+    //Prepares for a new message body, which starts at the beginning of a line
+    void reset() { state = LINE_START; }
+    bool isDone() const { return state == DONE; }
+
+    //Appends the unstuffed body bytes in buffer to out and returns how many bytes were consumed.
+    //Stops right after the terminator, so any bytes past it belong to the next command
+    size_t scan(const char* buffer, size_t length, std::string& out);
+};
+
+//Returns the offset of the first CR in buffer, or length if there is none. Uses AVX2 or SSE2 where available
+size_t find_cr(const char* buffer, size_t length);
+
+#endif
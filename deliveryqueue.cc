@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "deliveryqueue.h"
+#include "mailwriter.h"
+#include "log.h"
+
+using namespace std;
+
+extern bool verbose;
+
+namespace {
+
+const size_t MAX_BATCH = 64;            //Entries one worker takes at a time
+const time_t MAX_RETRY_DELAY = 300;     //Seconds
+const time_t REPORT_INTERVAL = 10;      //Seconds between queue reports in verbose mode
+
+struct QueueEntry {
+    string id;
+    string header;
+    vector<string> mbox_paths;          //Mailboxes that do not have the message yet
+    time_t queued_at;
+    time_t next_attempt;
+    int attempts;
+};
+
+string queue_dir;
+pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+deque<QueueEntry*> ready;
+vector<QueueEntry*> deferred;           //Waiting for next_attempt
+map<string, QueueEntry*> entries;       //Every entry not yet fully delivered, by id
+uint64_t delivered_count = 0;
+uint64_t retry_count = 0;
+time_t last_report = 0;
+atomic<uint64_t> next_sequence(0);
+
+string entry_path(const string& id, const char* suffix) {
+    return queue_dir + "/" + id + suffix;
+}
+
+bool sync_dir() {
+    if (fsync_policy == FSYNC_NONE) {
+        return true;
+    }
+    int fd = open(queue_dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+//Writes the envelope through a temp file so a crash leaves either the old or the new one
+bool write_envelope(const QueueEntry& entry) {
+    string temp_path = entry_path(entry.id, ".tmp");
+    FILE* fp = fopen(temp_path.c_str(), "w");
+    if (fp == nullptr) {
+        LOG(LEVEL_ERROR, "Cannot create %s (%s)\n", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+    fputs(entry.header.c_str(), fp);
+    for (const string& path : entry.mbox_paths) {
+        fprintf(fp, "%s\n", path.c_str());
+    }
+    bool ok = fflush(fp) == 0 && sync_for_policy(fileno(fp));
+    ok = (fclose(fp) == 0) && ok;
+    if (ok && rename(temp_path.c_str(), entry_path(entry.id, ".env").c_str()) < 0) {
+        ok = false;
+    }
+    if (!ok) {
+        LOG(LEVEL_ERROR, "Cannot write envelope %s (%s)\n", temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return sync_dir();
+}
+
+bool read_envelope(const string& id, QueueEntry& entry) {
+    FILE* fp = fopen(entry_path(id, ".env").c_str(), "r");
+    if (fp == nullptr) {
+        return false;
+    }
+    entry.id = id;
+    entry.header.clear();
+    entry.mbox_paths.clear();
+    //getline grows the buffer to fit, so a From line or path of any length is read whole
+    char* buffer = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&buffer, &capacity, fp)) > 0) {
+        if (entry.header.empty()) {
+            entry.header.assign(buffer, length);
+            continue;
+        }
+        if (buffer[length - 1] == '\n') {
+            length--;
+        }
+        if (length > 0) {
+            entry.mbox_paths.emplace_back(buffer, length);
+        }
+    }
+    free(buffer);
+    fclose(fp);
+    return !entry.header.empty();
+}
+
+void remove_entry_files(const string& id) {
+    unlink(entry_path(id, ".env").c_str());
+    unlink(entry_path(id, ".msg").c_str());
+}
+
+//Loads the entries a previous run left behind. Bodies without an envelope were never acknowledged
+void recover_entries() {
+    DIR* dir = opendir(queue_dir.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    vector<string> orphans;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != nullptr) {
+        string name = dirent->d_name;
+        if (name.size() < 5) {
+            continue;
+        }
+        string id = name.substr(0, name.size() - 4);
+        string suffix = name.substr(name.size() - 4);
+        if (suffix == ".tmp") {
+            orphans.push_back(name);
+        } else if (suffix == ".msg" && access(entry_path(id, ".env").c_str(), F_OK) < 0) {
+            orphans.push_back(name);
+        } else if (suffix == ".env") {
+            QueueEntry* entry = new QueueEntry();
+            struct stat st;
+            if (!read_envelope(id, *entry) || stat(entry_path(id, ".env").c_str(), &st) < 0) {
+                LOG(LEVEL_ERROR, "Cannot read queue entry %s\n", id.c_str());
+                delete entry;
+                continue;
+            }
+            entry->queued_at = st.st_mtime;
+            entry->next_attempt = 0;
+            entry->attempts = 0;
+            entries[id] = entry;
+            ready.push_back(entry);
+        }
+    }
+    closedir(dir);
+    for (const string& name : orphans) {
+        unlink((queue_dir + "/" + name).c_str());
+    }
+    if (!entries.empty()) {
+        LOG(LEVEL_INFO, "Resuming delivery of %zu queued messages\n", entries.size());
+    }
+}
+
+//Appends every entry of the batch, with one append per mailbox for all the messages bound for it
+void deliver_batch(vector<QueueEntry*>& batch) {
+    vector<int> fds(batch.size());
+    vector<bool> lost(batch.size());
+    map<string, vector<size_t>> by_mailbox;
+    for (size_t i = 0; i < batch.size(); i++) {
+        fds[i] = open(entry_path(batch[i]->id, ".msg").c_str(), O_RDONLY);
+        if (fds[i] < 0) {
+            //A body that is gone can never be delivered; any other failure is retried like a failed append
+            lost[i] = errno == ENOENT;
+            LOG(LEVEL_ERROR, "Cannot open queued message %s (%s)%s\n", batch[i]->id.c_str(), strerror(errno),
+                lost[i] ? ", dropping it as undeliverable" : "");
+            continue;
+        }
+        for (const string& path : batch[i]->mbox_paths) {
+            by_mailbox[path].push_back(i);
+        }
+    }
+
+    vector<vector<string>> failed(batch.size());
+    for (const auto& [path, members] : by_mailbox) {
+        vector<MailboxAppend> messages;
+        for (size_t i : members) {
+            messages.push_back({ &batch[i]->header, fds[i], nullptr });
+        }
+        if (!append_batch_to_mailbox(path, messages)) {
+            for (size_t i : members) {
+                failed[i].push_back(path);
+            }
+        }
+    }
+
+    //Only the mailboxes that failed are tried again
+    time_t now = time(nullptr);
+    vector<bool> done(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        QueueEntry* entry = batch[i];
+        if (fds[i] < 0) {
+            if (lost[i]) {
+                remove_entry_files(entry->id);
+            }
+            continue;
+        }
+        close(fds[i]);
+        done[i] = failed[i].empty();
+        if (done[i]) {
+            remove_entry_files(entry->id);
+        } else if (failed[i].size() < entry->mbox_paths.size()) {
+            entry->mbox_paths = failed[i];
+            write_envelope(*entry);
+        }
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    for (size_t i = 0; i < batch.size(); i++) {
+        QueueEntry* entry = batch[i];
+        if (done[i] || lost[i]) {
+            entries.erase(entry->id);
+            if (done[i]) {
+                delivered_count++;
+            }
+            delete entry;
+            continue;
+        }
+        entry->attempts++;
+        entry->next_attempt = now + min(MAX_RETRY_DELAY, (time_t)1 << min(entry->attempts, 9));
+        retry_count++;
+        deferred.push_back(entry);
+        LOG(LEVEL_WARNING, "Delivery of %s deferred for %ld seconds after attempt %d\n", entry->id.c_str(),
+                (long)(entry->next_attempt - now), entry->attempts);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+void *delivery_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_mutex);
+    while (true) {
+        time_t now = time(nullptr);
+        for (size_t i = 0; i < deferred.size(); ) {
+            if (deferred[i]->next_attempt <= now) {
+                ready.push_back(deferred[i]);
+                deferred[i] = deferred.back();
+                deferred.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (verbose && !entries.empty() && now - last_report >= REPORT_INTERVAL) {
+            last_report = now;
+            pthread_mutex_unlock(&queue_mutex);
+            print_queue_stats(stderr);
+            pthread_mutex_lock(&queue_mutex);
+        }
+
+        if (ready.empty()) {
+            //Deferred entries are checked again every second
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&queue_ready, &queue_mutex, &deadline);
+            continue;
+        }
+
+        vector<QueueEntry*> batch;
+        while (!ready.empty() && batch.size() < MAX_BATCH) {
+            batch.push_back(ready.front());
+            ready.pop_front();
+        }
+        pthread_mutex_unlock(&queue_mutex);
+        deliver_batch(batch);
+        pthread_mutex_lock(&queue_mutex);
+    }
+    return NULL;
+}
+
+}
+
+bool start_delivery_queue(const string& mail_dir, int workers) {
+    queue_dir = mail_dir + "/queue";
+    if (mkdir(queue_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        LOG(LEVEL_ERROR, "Cannot create delivery queue %s (%s)\n", queue_dir.c_str(), strerror(errno));
+        return false;
+    }
+    recover_entries();
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, delivery_worker, NULL) != 0) {
+            LOG(LEVEL_ERROR, "Cannot start delivery worker\n");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    return true;
+}
+
+int open_queue_entry(string& id) {
+    char name[64];
+    snprintf(name, sizeof(name), "%ld.%d.%llu", (long)time(nullptr), (int)getpid(),
+             (unsigned long long)next_sequence.fetch_add(1, memory_order_relaxed));
+    id = name;
+    int fd = open(entry_path(id, ".msg").c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        LOG(LEVEL_ERROR, "Cannot create queue entry in %s (%s)\n", queue_dir.c_str(), strerror(errno));
+    }
+    return fd;
+}
+
+bool commit_queue_entry(const string& id, const string& header, const vector<string>& mbox_paths) {
+    QueueEntry* entry = new QueueEntry();
+    entry->id = id;
+    entry->header = header;
+    entry->mbox_paths = mbox_paths;
+    entry->queued_at = time(nullptr);
+    entry->next_attempt = 0;
+    entry->attempts = 0;
+    if (!write_envelope(*entry)) {
+        delete entry;
+        return false;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    entries[id] = entry;
+    ready.push_back(entry);
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_mutex);
+    return true;
+}
+
+void abandon_queue_entry(const string& id) {
+    remove_entry_files(id);
+}
+
+QueueStats queue_stats() {
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&queue_mutex);
+    QueueStats stats = { entries.size(), 0, delivered_count, retry_count };
+    for (const auto& [id, entry] : entries) {
+        stats.oldest_age = max(stats.oldest_age, now - entry->queued_at);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return stats;
+}
+
+void print_queue_stats(FILE* out) {
+    //The rate is measured between two calls
+    static pthread_mutex_t rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static uint64_t last_delivered = 0;
+    static struct timespec last_time = { 0, 0 };
+
+    QueueStats stats = queue_stats();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&rate_mutex);
+    double elapsed = (now.tv_sec - last_time.tv_sec) + (now.tv_nsec - last_time.tv_nsec) / 1e9;
+    double rate = (last_time.tv_sec == 0 || elapsed <= 0) ? 0 : (stats.delivered - last_delivered) / elapsed;
+    last_delivered = stats.delivered;
+    last_time = now;
+    pthread_mutex_unlock(&rate_mutex);
+
+    fprintf(out, "Delivery queue: %zu queued, oldest %lds, %llu delivered (%.1f/s), %llu retries\n",
+            stats.depth, (long)stats.oldest_age, (unsigned long long)stats.delivered, rate,
+            (unsigned long long)stats.retries);
+}
@@ -0,0 +1,39 @@
+#ifndef DELIVERYQUEUE_H
+#define DELIVERYQUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+//Durable queue between SMTP acceptance and the mailbox appends (see smtp -q). A message is accepted once
+//it is in mail_dir/queue, as <id>.msg holding the body and <id>.env holding its From line and the
+//mailboxes it still has to reach. Delivery workers append it, batching messages bound for one mailbox,
+//and retry mailboxes that fail with a growing delay. Entries left over from a previous run are resumed
+
+extern int delivery_workers;    //0 delivers inline from the SMTP session
+
+struct QueueStats {
+    size_t depth;               //Messages not yet in every mailbox
+    time_t oldest_age;          //Seconds the oldest of them has waited
+    uint64_t delivered;
+    uint64_t retries;           //Delivery attempts that left a mailbox for later
+};
+
+//Creates the queue directory, loads entries left over from a previous run and starts the workers
+bool start_delivery_queue(const std::string& mail_dir, int workers);
+
+//Creates the body file of a new entry and sets id; returns its fd, or -1
+int open_queue_entry(std::string& id);
+
+//Hands an entry whose body has been written and closed to the workers
+bool commit_queue_entry(const std::string& id, const std::string& header, const std::vector<std::string>& mbox_paths);
+
+//Removes an entry that was opened but will not be committed
+void abandon_queue_entry(const std::string& id);
+
+QueueStats queue_stats();
+void print_queue_stats(FILE* out);
+
+#endif
@@ -1,32 +1,36 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <strings.h>
 #include <algorithm>
 #include <unistd.h>
 #include <cstring> 
 #include <sys/socket.h>
 #include "email.h"
-#include <map>
+#include "netio.h"
+#include "mailwriter.h"
+#include "lockmanager.h"
+#include "deliveryqueue.h"
+#include "blobstore.h"
+#include "userdirectory.h"
+#include "fromline.h"
+#include "log.h"
+#include "timeouts.h"
 #include <fstream>      
 #include <pthread.h>    
 #include <ctime>     
-#include <iomanip>      
-#include <sstream>  
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <charconv>
 
 using namespace std;
 
 //Declares verbose as extern so it can access the definition from smtp.cc
 extern bool verbose;
 
-//Global map for file mutexes
-map<string, pthread_mutex_t> fileMutexMap;
-
-//Checks if file path exists
-bool fileExists(const string& filePath) {
-    ifstream file(filePath);
-    return file.good();
-}
-
 //Email constructor
 Email::Email(string sender, string recipient, string emailData) {
     mailFrom = sender;
@@ -35,6 +39,175 @@ Email::Email(string sender, string recipient, string emailData) {
     }
     data = emailData;
     previousState = EmailState::INIT;
+    receivingData = false;
+    spoolFd = -1;
+    spoolFailed = false;
+    messageSize = 0;
+    sizeExceeded = false;
+    chunking = false;
+    chunkRemaining = 0;
+    chunkSize = 0;
+    chunkLast = false;
+    chunkDiscard = false;
+    splicePipe[0] = splicePipe[1] = -1;
+    spliceUnsupported = false;
+}
+
+Email::~Email() {
+    closeSpool();
+    if (splicePipe[0] >= 0) {
+        close(splicePipe[0]);
+        close(splicePipe[1]);
+    }
+}
+
+//Moves the body received so far out of memory into the spool file, creating it on first use
+bool Email::spoolPendingData(const string& mail_dir) {
+    if (spoolFd < 0) {
+        string spool_path = mail_dir + "/.spool-XXXXXX";
+        spoolFd = mkstemp(&spool_path[0]);
+        if (spoolFd < 0) {
+            LOG(LEVEL_ERROR, "Cannot create spool file in %s (%s)\n", mail_dir.c_str(), strerror(errno));
+            return false;
+        }
+        //Unlinked straight away so the file disappears with the session, even if it ends mid-message
+        unlink(spool_path.c_str());
+    }
+
+    size_t written = 0;
+    while (written < pendingData.size()) {
+        ssize_t n = write(spoolFd, pendingData.data() + written, pendingData.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(LEVEL_ERROR, "Cannot write spool file (%s)\n", strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+    pendingData.clear();
+    return true;
+}
+
+//Writes all of buffer to fd, retrying short writes
+static bool write_all(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+//Writes the message body to fd: the spooled part first, then whatever is still in memory.
+//With digest, the same bytes are also fed into it
+bool Email::writeBody(int fd, EVP_MD_CTX* digest) {
+    if (spoolFd >= 0) {
+        char buffer[65536];
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(spoolFd, buffer, sizeof(buffer), offset)) > 0) {
+            if (!write_all(fd, buffer, n)) {
+                return false;
+            }
+            if (digest != nullptr) {
+                EVP_DigestUpdate(digest, buffer, n);
+            }
+            offset += n;
+        }
+        if (n < 0) {
+            LOG(LEVEL_ERROR, "Cannot read spool file (%s)\n", strerror(errno));
+            return false;
+        }
+    }
+    if (digest != nullptr) {
+        EVP_DigestUpdate(digest, data.data(), data.size());
+    }
+    return write_all(fd, data.data(), data.size());
+}
+
+//Stores the body once under mail_dir/blobs, named by its SHA-256. An identical body that is already
+//stored is reused. Sets blob_name to the hex digest
+bool Email::storeBlob(const string& mail_dir, string& blob_name) {
+    string blob_dir = mail_dir + "/blobs";
+    if (mkdir(blob_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        LOG(LEVEL_ERROR, "Cannot create blob store %s (%s)\n", blob_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    //The body is written to a temp file and hashed in the same pass, then renamed into place
+    string temp_path = blob_dir + "/.tmp-XXXXXX";
+    int temp_fd = mkstemp(&temp_path[0]);
+    if (temp_fd < 0) {
+        LOG(LEVEL_ERROR, "Cannot create blob in %s (%s)\n", blob_dir.c_str(), strerror(errno));
+        return false;
+    }
+    EVP_MD_CTX* digest = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(digest, EVP_sha256(), nullptr);
+    bool written = writeBody(temp_fd, digest) && sync_for_policy(temp_fd);
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_length = 0;
+    EVP_DigestFinal_ex(digest, hash, &hash_length);
+    EVP_MD_CTX_free(digest);
+    close(temp_fd);
+    if (!written) {
+        LOG(LEVEL_ERROR, "Cannot write blob %s (%s)\n", temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    static const char hex_digits[] = "0123456789abcdef";
+    blob_name.clear();
+    for (unsigned int i = 0; i < hash_length; i++) {
+        blob_name += hex_digits[hash[i] >> 4];
+        blob_name += hex_digits[hash[i] & 0xf];
+    }
+
+    //A blob that is already stored is reused, and made new again so the POP3 sweeper keeps it
+    string blob_path = blob_dir + "/" + blob_name;
+    if (reuse_blob(blob_path)) {
+        unlink(temp_path.c_str());
+    } else if (rename(temp_path.c_str(), blob_path.c_str()) < 0) {
+        LOG(LEVEL_ERROR, "Cannot store blob %s (%s)\n", blob_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+//Writes the message to the delivery queue. A message stored as a blob only needs its From line queued
+bool Email::queueMessage(const string& header, bool use_blob, const vector<string>& mbox_paths) {
+    string id;
+    int fd = open_queue_entry(id);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = (use_blob || writeBody(fd, nullptr)) && sync_for_policy(fd);
+    close(fd);
+    if (!written) {
+        LOG(LEVEL_ERROR, "Cannot write queue entry %s (%s)\n", id.c_str(), strerror(errno));
+    }
+    if (!written || !commit_queue_entry(id, header, mbox_paths)) {
+        abandon_queue_entry(id);
+        return false;
+    }
+    LOG(LEVEL_INFO, "Queued %s for %zu recipients\n", id.c_str(), mbox_paths.size());
+    return true;
+}
+
+void Email::closeSpool() {
+    if (spoolFd >= 0) {
+        close(spoolFd);
+        spoolFd = -1;
+    }
+    spoolFailed = false;
 }
 
 //Setter and Getter for mailFrom
@@ -83,537 +256,706 @@ void Email::displayEmailInfo() {
     cout << "Previous State: " << previousState << endl;
 }
 
-void Email::process_HELO(const string& domain, int client_fd) {
+void Email::process_HELO(string_view domain, int client_fd) {
     //Prints error if domain is missing
     if (domain.empty()) {
         string message = "501: Syntax error - missing domain\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  // Verbose: Server ready message
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }           
-    else if (previousState == INIT || previousState == HELO) {
-        //If previous state is INIT or HELO, set to HELO
-        previousState = HELO;
-        string message = "250 localhost\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-            // return;
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 250 localhost\n", client_fd);  // Verbose: Server ready message
-        }
-        return;
-    } else {
-        string message = "503 Bad sequence of commands\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 bad sequence of commands\n", client_fd);  // Verbose: Server ready message
+    //The dispatch table only accepts HELO in the INIT and HELO states
+    previousState = HELO;
+    string message = "250 localhost\r\n";
+    if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+        // return;
+    }
+    LOG(LEVEL_DEBUG, "[%d] S: 250 localhost\n", client_fd);
+    return;
+}
+
+void Email::process_EHLO(string_view domain, int client_fd) {
+    //Prints error if domain is missing
+    if (domain.empty()) {
+        string message = "501: Syntax error - missing domain\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
+    //EHLO starts the session like HELO and also lists the supported ESMTP extensions; SIZE 0 means no limit
+    previousState = HELO;
+    char message[128];
+    int length = snprintf(message, sizeof(message), "250-localhost\r\n"
+                                                    "250-PIPELINING\r\n"
+                                                    "250-SIZE %zu\r\n"
+                                                    "250 CHUNKING\r\n", max_message_size);
+    if (send_reply(client_fd, message, length) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+    }
+    LOG(LEVEL_DEBUG, "[%d] S: 250-localhost\n[%d] S: 250-PIPELINING\n[%d] S: 250-SIZE %zu\n[%d] S: 250 CHUNKING\n", client_fd,
+        client_fd, client_fd, max_message_size, client_fd);
+    return;
 }
 
-void Email::process_MAILFROM(const string& sender, int client_fd) {
-    if (previousState == HELO) {
-        size_t colonPos = sender.find(':');
-        if (colonPos != string::npos) {
-            //Splits the string on ':'
-            string command = sender.substr(0, colonPos);
-            string addressPart = sender.substr(colonPos + 1);
-            // cout << "command " << command << endl;
-            // cout << "addressPart " << addressPart << endl;
-
-            //Trims leading and trailing whitespace from command
-            size_t cmdStart = command.find_first_not_of(" \t");
-            size_t cmdEnd = command.find_last_not_of(" \t");
-            if (cmdStart == string::npos || cmdEnd == string::npos) {
-                string message = "501 Syntax error\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd); 
-                }
-                return;
+void Email::process_MAILFROM(string_view sender, int client_fd) {
+    size_t colonPos = sender.find(':');
+    if (colonPos != string::npos) {
+        //Splits the string on ':'
+        string_view command = sender.substr(0, colonPos);
+        string_view addressPart = sender.substr(colonPos + 1);
+        // cout << "command " << command << endl;
+        // cout << "addressPart " << addressPart << endl;
+
+        //Trims leading and trailing whitespace from command
+        size_t cmdStart = command.find_first_not_of(" \t");
+        size_t cmdEnd = command.find_last_not_of(" \t");
+        if (cmdStart == string::npos || cmdEnd == string::npos) {
+            string message = "501 Syntax error\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
-            command = command.substr(cmdStart, cmdEnd - cmdStart + 1);
-
-            //Converts command to uppercase for case-insensitive comparison
-            transform(command.begin(), command.end(), command.begin(), ::toupper);
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
+        command = command.substr(cmdStart, cmdEnd - cmdStart + 1);
 
-            //Validates that the command is 'FROM'
-            if (command != "FROM") {
-                string message = "501 Syntax error\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
+        //Validates that the command is 'FROM' (case-insensitive)
+        if (command.size() != 4 || strncasecmp(command.data(), "FROM", 4) != 0) {
+            string message = "501 Syntax error\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
 
-            //Trims leading and trailing whitespace from addressPart
-            size_t addrStart = addressPart.find_first_not_of(" \t");
-            size_t addrEnd = addressPart.find_last_not_of(" \t");
+        //Trims leading and trailing whitespace from addressPart
+        size_t addrStart = addressPart.find_first_not_of(" \t");
+        size_t addrEnd = addressPart.find_last_not_of(" \t");
 
-            if (addrStart == string::npos || addrEnd == string::npos) {
-                string message = "501 Syntax error\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
-            }
-            string address = addressPart.substr(addrStart, addrEnd - addrStart + 1);
-
-            //Checks if address is enclosed in '<' and '>'
-            if (address.front() != '<' || address.back() != '>') {
-                string message = "501 Syntax error\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
+        if (addrStart == string::npos || addrEnd == string::npos) {
+            string message = "501 Syntax error\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
+        string_view address = addressPart.substr(addrStart, addrEnd - addrStart + 1);
 
-            //Extracts the email address between '<' and '>'
-            string email = address.substr(1, address.size() - 2);
+        //ESMTP parameters such as SIZE=n follow the address
+        string_view parameters;
+        size_t addrClose = address.find('>');
+        if (addrClose != string_view::npos) {
+            parameters = address.substr(addrClose + 1);
+            address = address.substr(0, addrClose + 1);
+        }
 
-            //Validates the email format (basic validation)
-            if (!isValidEmail(email)) {
-                string message = "501 Syntax error: invalid email\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error-invalid email\n", client_fd);  
-                }
-                return;
+        //Checks if address is enclosed in '<' and '>'
+        if (address.front() != '<' || address.back() != '>') {
+            string message = "501 Syntax error\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
 
-            //Sets mailFrom and updates the state
-            mailFrom = email;
-            previousState = MAIL;
+        //Extracts the email address between '<' and '>'
+        string_view email = address.substr(1, address.size() - 2);
 
-            string message = "250 OK\r\n";
-            if (write(client_fd, message.c_str(), message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: 250 OK\n", client_fd);  
-            }
-        } else {
-            //':' not found in sender string
-            string message = "501 Syntax error: missing :\r\n";
-            if (write(client_fd, message.c_str(), message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-                // exit(1);
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
+        //Validates the email format (basic validation)
+        if (!isValidEmail(email)) {
+            string message = "501 Syntax error: invalid email\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error-invalid email\n", client_fd);
+            return;
+        }
+
+        if (!parseMailParameters(parameters, client_fd)) {
+            return;
+        }
+
+        //Sets mailFrom and updates the state
+        mailFrom = email;
+        previousState = MAIL;
+
+        string message = "250 OK\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: 250 OK\n", client_fd);
     } else {
-        string message = "503 Bad sequence of commands\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        //':' not found in sender string
+        string message = "501 Syntax error: missing :\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 Bad sequence of commands\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
     }
 }
 
-void Email::process_RCPTTO(const string& recipient, int client_fd, string mail_dir) {
-    if (previousState == MAIL || previousState == RCPT) {
-        //Checks if recipient contains ':'
-        size_t colonPos = recipient.find(':');
-        if (colonPos != string::npos) {
-            string command = recipient.substr(0, colonPos);
-            string addressPart = recipient.substr(colonPos + 1);
-
-            //Trims leading and trailing whitespace from command
-            size_t cmdStart = command.find_first_not_of(" \t");
-            size_t cmdEnd = command.find_last_not_of(" \t");
-            if (cmdStart == string::npos || cmdEnd == string::npos) {
-                string message = "501 Syntax error - wrong command format\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
-            }
-            command = command.substr(cmdStart, cmdEnd - cmdStart + 1);
-
-            //Converts command to uppercase for case-insensitive comparison
-            transform(command.begin(), command.end(), command.begin(), ::toupper);
-
-            //Validates that the command is 'TO'
-            if (command != "TO") {
-                string message = "501 Syntax error - missing TO\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
+void Email::process_RCPTTO(string_view recipient, int client_fd, const string& mail_dir) {
+    //Checks if recipient contains ':'
+    size_t colonPos = recipient.find(':');
+    if (colonPos != string::npos) {
+        string_view command = recipient.substr(0, colonPos);
+        string_view addressPart = recipient.substr(colonPos + 1);
+
+        //Trims leading and trailing whitespace from command
+        size_t cmdStart = command.find_first_not_of(" \t");
+        size_t cmdEnd = command.find_last_not_of(" \t");
+        if (cmdStart == string::npos || cmdEnd == string::npos) {
+            string message = "501 Syntax error - wrong command format\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
+        command = command.substr(cmdStart, cmdEnd - cmdStart + 1);
 
-            //Trims leading and trailing whitespace from addressPart
-            size_t addrStart = addressPart.find_first_not_of(" \t");
-            size_t addrEnd = addressPart.find_last_not_of(" \t");
-            if (addrStart == string::npos || addrEnd == string::npos) {
-                string message = "501 Syntax error - incorrect address\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
-            }
-            string address = addressPart.substr(addrStart, addrEnd - addrStart + 1);
-
-            //Checks if address is enclosed in '<' and '>'
-            if (address.front() != '<' || address.back() != '>') {
-                string message = "501 Syntax error - malformed email\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
+        //Validates that the command is 'TO' (case-insensitive)
+        if (command.size() != 2 || strncasecmp(command.data(), "TO", 2) != 0) {
+            string message = "501 Syntax error - missing TO\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
 
-            //Extracts the email address between '<' and '>'
-            string email = address.substr(1, address.size() - 2);
-
-            //Checks if the email address ends with @localhost
-            if (email.find("@localhost") == string::npos) {
-                string message = "550 No such user\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 550 No such user\n", client_fd);  
-                }
-                return;
+        //Trims leading and trailing whitespace from addressPart
+        size_t addrStart = addressPart.find_first_not_of(" \t");
+        size_t addrEnd = addressPart.find_last_not_of(" \t");
+        if (addrStart == string::npos || addrEnd == string::npos) {
+            string message = "501 Syntax error - incorrect address\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
+        string_view address = addressPart.substr(addrStart, addrEnd - addrStart + 1);
 
-            if (!isValidEmail(email)) {
-                string message = "501 Syntax error - invalid email\r\n";
-                if (write(client_fd, message.c_str(), message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    // exit(1);
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-                }
-                return;
-            }
-            size_t atPos = email.find('@');
-            string username = email.substr(0, atPos);
-            
-            string mbox_file_path = mail_dir + "/" + username + ".mbox";
-
-            if (!fileExists(mbox_file_path)) {
-                //If recipient file cannot be opened, sends error response
-                string error_message = "550 Requested action not taken: mailbox unavailable\r\n";
-                if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 550 Requested action not taken: mailbox unavailable\n", client_fd);  
-                }
-                return;
+        //Checks if address is enclosed in '<' and '>'
+        if (address.front() != '<' || address.back() != '>') {
+            string message = "501 Syntax error - malformed email\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+                // exit(1);
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
 
-            //Appends recipient to the rcptTo vector and update the state
-            rcptTo.push_back(email);
-            previousState = RCPT;
+        //Extracts the email address between '<' and '>'
+        string_view email = address.substr(1, address.size() - 2);
 
-            // Respond with success
-            // printf("250 OK\n");
-            string message = "250 OK\r\n";
-            if (write(client_fd, message.c_str(), message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
+        //Checks if the email address ends with @localhost
+        if (email.find("@localhost") == string_view::npos) {
+            string message = "550 No such user\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
                 // exit(1);
             }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: 250 OK\n", client_fd);  
-            }
+            LOG(LEVEL_DEBUG, "[%d] S: 550 No such user\n", client_fd);
             return;
         }
-        else {
-            //':' not found in recipient string
-            string message = "501 Syntax error - missing :\r\n";
-            if (write(client_fd, message.c_str(), message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
+
+        if (!isValidEmail(email)) {
+            string message = "501 Syntax error - invalid email\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
                 // exit(1);
             }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+            return;
+        }
+        size_t atPos = email.find('@');
+
+        //A memory lookup; the directory follows mailboxes being created and removed
+        if (!user_exists(string_view(email).substr(0, atPos))) {
+            //If recipient file cannot be opened, sends error response
+            string error_message = "550 Requested action not taken: mailbox unavailable\r\n";
+            if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: 550 Requested action not taken: mailbox unavailable\n", client_fd);
             return;
         }
+
+        //Appends recipient to the rcptTo vector and update the state
+        rcptTo.emplace_back(email);
+        previousState = RCPT;
+
+        // Respond with success
+        // printf("250 OK\n");
+        string message = "250 OK\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            // exit(1);
+        }
+        LOG(LEVEL_DEBUG, "[%d] S: 250 OK\n", client_fd);
+        return;
     }
     else {
-        //Invalid sequence of commands
-        string message = "503 Bad sequence of commands\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        //':' not found in recipient string
+        string message = "501 Syntax error - missing :\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 Bad sequence of commands\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
 }
 
-bool Email::isValidEmail(const string& email) const {
+//Checks the parameters of MAIL FROM; SIZE is the only one supported. Replies and returns false if the
+//transaction cannot go ahead, so a message declared too large is refused before any of it is sent
+bool Email::parseMailParameters(string_view parameters, int client_fd) {
+    while (true) {
+        size_t start = parameters.find_first_not_of(" \t");
+        if (start == string_view::npos) {
+            return true;
+        }
+        parameters.remove_prefix(start);
+        size_t end = parameters.find_first_of(" \t");
+        string_view parameter = parameters.substr(0, end);
+        parameters.remove_prefix(parameter.size());
+
+        if (parameter.size() < 5 || strncasecmp(parameter.data(), "SIZE=", 5) != 0) {
+            string message = "555 MAIL FROM parameters not recognized or not implemented\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: 555 MAIL FROM parameters not recognized or not implemented\n", client_fd);
+            return false;
+        }
+
+        string_view value = parameter.substr(5);
+        size_t declared = 0;
+        from_chars_result parsed = from_chars(value.data(), value.data() + value.size(), declared);
+        if (value.empty() || parsed.ec != errc() || parsed.ptr != value.data() + value.size()) {
+            string message = "501 Syntax error in SIZE parameter\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error in SIZE parameter\n", client_fd);
+            return false;
+        }
+        if (max_message_size > 0 && declared > max_message_size) {
+            string message = "552 Message size exceeds fixed maximum message size\r\n";
+            if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: 552 Message size exceeds fixed maximum message size\n", client_fd);
+            return false;
+        }
+    }
+}
+
+bool Email::isValidEmail(string_view email) const {
     //Basic validation: checks for presence of '@'
     size_t atPos = email.find('@');
     // size_t dotPos = email.find('.', atPos);
     return (atPos != string::npos); //&& (dotPos == string::npos);
 }
 
-void Email::process_DATA(int& client_fd, string argument, string mail_dir) {
+void Email::process_DATA(int& client_fd, string_view argument, const string& mail_dir) {
     //Checks if argument is not empty
     if (!argument.empty()) {
         const char* syntax_error_msg = "501 Syntax error: Remove argument\r\n";
-        if (write(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
 
-    if (previousState == RCPT) {
-        //Prompts the user to start entering email data
-        string message = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-            // exit(1);
+    //Prompts the user to start entering email data
+    string message = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
+    if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+        // exit(1);
+    }
+    LOG(LEVEL_DEBUG, "[%d] S: 354 Start mail input; end with <CRLF>.<CRLF>\n", client_fd);
+
+    //The message body itself arrives through receiveData()
+    pendingData.clear();
+    closeSpool();
+    messageSize = 0;
+    sizeExceeded = false;
+    scanner.reset();
+    receivingData = true;
+}
+
+void Email::process_BDAT(string_view argument, int client_fd, const string& mail_dir) {
+    //Parses BDAT <chunk-size> [LAST]
+    size_t space_pos = argument.find(' ');
+    string_view size_part = argument.substr(0, space_pos);
+    string_view last_part = (space_pos != string_view::npos) ? argument.substr(space_pos + 1) : string_view();
+    size_t size = 0;
+    from_chars_result parsed = from_chars(size_part.data(), size_part.data() + size_part.size(), size);
+    if (size_part.empty() || parsed.ec != errc() || parsed.ptr != size_part.data() + size_part.size() ||
+        (!last_part.empty() && (last_part.size() != 4 || strncasecmp(last_part.data(), "LAST", 4) != 0))) {
+        string message = "501 Syntax error: BDAT <chunk-size> [LAST]\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
+        return;
+    }
+
+    chunking = true;
+    receivingData = true;
+    chunkRemaining = size;
+    chunkSize = size;
+    chunkLast = !last_part.empty();
+    chunkDiscard = false;
+
+    if (previousState != RCPT && previousState != BDAT) {
+        //The chunk follows the command regardless, so it is read and thrown away
+        chunkDiscard = true;
+        string message = "503 Bad sequence of commands\r\n";
+        if (send_reply(client_fd, message.c_str(), message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 354 Start mail input; end with <CRLF>.<CRLF>\n", client_fd);  
+        LOG(LEVEL_DEBUG, "[%d] S: 503 Bad sequence of commands\n", client_fd);
+    } else {
+        if (previousState == RCPT) {
+            //First chunk of a new message
+            pendingData.clear();
+            closeSpool();
+            messageSize = 0;
+            previousState = BDAT;
+        }
+        //The chunk size is known up front, so a chunk that would take the message over the limit is refused
+        //before any of it is stored
+        messageSize += size;
+        if (max_message_size > 0 && messageSize > max_message_size) {
+            chunkDiscard = true;
+            rejectMessage(client_fd, "552 Message size exceeds fixed maximum message size\r\n");
         }
+    }
 
-        string emailData;
-        char recv_buffer[1024];
-        ssize_t bytes_received;
-        bool end_of_data = false;
-        while (true) {
-            //Receives data from the client
-            bytes_received = recv(client_fd, recv_buffer, sizeof(recv_buffer), 0);
-            if (bytes_received == -1) {
-                fprintf(stderr, "read failed\n");
-                return;
-            }
-            else if (bytes_received == 0) {
-                //Connection closed by client
-                fprintf(stderr, "Client disconnected\n");
-                return;
-            }
+    if (chunkRemaining == 0) {
+        finishChunk(client_fd, mail_dir);
+    }
+}
+
+//Takes chunk bytes that were already read into the session's buffer; chunk data is not dot-stuffed
+size_t Email::receiveChunk(int client_fd, const char* buffer, size_t length, const string& mail_dir) {
+    size_t take = min(length, chunkRemaining);
+    if (!chunkDiscard) {
+        pendingData.append(buffer, take);
+        boundPendingData(mail_dir);
+    }
+    chunkRemaining -= take;
+    if (chunkRemaining == 0) {
+        finishChunk(client_fd, mail_dir);
+    }
+    return take;
+}
 
-            //Appends the received data to emailData
-            emailData.append(recv_buffer, bytes_received);
+//Moves the rest of the current chunk from the socket to the spool file with splice(), so it never enters user
+//space. Only for sessions whose thread may block on the socket; returns false when nothing was spliced
+bool Email::spliceChunk(int client_fd, const string& mail_dir) {
+    if (!chunking || chunkDiscard || chunkRemaining == 0 || spliceUnsupported || spoolFailed) {
+        return false;
+    }
+    if (splicePipe[0] < 0 && pipe2(splicePipe, O_CLOEXEC) < 0) {
+        spliceUnsupported = true;
+        return false;
+    }
+    //The bytes received so far go first so the spool file stays in order
+    if (!spoolPendingData(mail_dir)) {
+        spoolFailed = true;
+        return false;
+    }
 
-            //Checks if the termination sequence\r\n.\r\n is present
-            size_t term_pos = emailData.find("\r\n.\r\n");
-            if (term_pos != string::npos) {
-                //Removes the termination sequence from emailData
-                emailData.erase(term_pos);
-                break;
-                // end_of_data = true;
-            }
+    while (chunkRemaining > 0) {
+        ssize_t in_pipe = splice(client_fd, nullptr, splicePipe[1], nullptr, min(chunkRemaining, (size_t)65536),
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0 && errno == EINTR) {
+            continue;
         }
-        if(!emailData.empty() && emailData.back()!='\n'){
-            emailData.append("\r\n");
+        if (in_pipe < 0 && errno == EINVAL) {
+            //This socket cannot be spliced from; the chunk is read the usual way instead
+            spliceUnsupported = true;
+            return false;
         }
-        data = emailData;
-        previousState = DATA;
-        
-        string success_message = "250 OK\r\n";
-        if (write(client_fd, success_message.c_str(), success_message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-            // exit(1);
+        if (in_pipe <= 0) {
+            //The client went away mid-chunk; the next read on the socket reports it
+            return false;
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 250 OK\n", client_fd);  
-        }
-
-        for (const string& recipient : rcptTo) {
-            //Creates the header of the form: From <sender's email> <current timestamp> <LF>
-            time_t now = time(0);
-            struct tm* now_tm = localtime(&now);
-            stringstream ss;
-            ss << put_time(now_tm, "%a %b %d %H:%M:%S %Y");
-            string formatted_time = ss.str();
-            string header = "From <" + mailFrom + "> " + formatted_time + "\n";
-
-            //Acquires the mutex for the recipient's mbox file
-            if (fileMutexMap.find(recipient) == fileMutexMap.end()) {
-                //Initializes the mutex if it does not exist
-                pthread_mutex_t newMutex;
-                pthread_mutex_init(&newMutex, nullptr);
-                fileMutexMap[recipient] = newMutex;
+        chunkRemaining -= in_pipe;
+        update_timeout(client_fd, PHASE_DATA, in_pipe);
+
+        while (in_pipe > 0) {
+            ssize_t out = splice(splicePipe[0], nullptr, spoolFd, nullptr, in_pipe, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
             }
-            pthread_mutex_t& fileMutex = fileMutexMap[recipient];
-
-            //Locks the mutex
-            pthread_mutex_lock(&fileMutex);
-
-            //Opens the recipient's mbox file
-            size_t atPos = recipient.find('@');
-            string username = recipient.substr(0, atPos);
-            
-            string mbox_file_path = mail_dir + "/" + username + ".mbox";
-            int old_fd = open(mbox_file_path.c_str(), O_RDWR);
-            if (old_fd < 0) {
-                string response = "-ERR unable to access mailbox\r\n";
-                // cout<<"[S]: "<<response<<endl;
-                if (write(client_fd, response.c_str(), response.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: -ERR unable to access mailbox\n", client_fd);  
+            if (out <= 0) {
+                //Drains the pipe so it can be reused; the message is answered with 451 once the chunk ends
+                LOG(LEVEL_ERROR, "Cannot splice into spool file (%s)\n", strerror(errno));
+                spoolFailed = true;
+                char drain[4096];
+                while (in_pipe > 0) {
+                    ssize_t n = read(splicePipe[0], drain, min((size_t)in_pipe, sizeof(drain)));
+                    if (n <= 0) {
+                        break;
+                    }
+                    in_pipe -= n;
                 }
-                pthread_mutex_unlock(&fileMutexMap[mbox_file_path]);
-                return;
+                break;
             }
-            flock(old_fd, LOCK_EX | LOCK_NB);
+            in_pipe -= out;
+        }
+    }
 
-            ofstream mboxFile(mbox_file_path, ios::app);
+    finishChunk(client_fd, mail_dir);
+    return true;
+}
 
-            if (mboxFile.is_open()) {
-                mboxFile << header;
-                mboxFile << emailData;
-                mboxFile.close();
-            } else {
-                //If recipient file cannot be opened, sends error response
-                string error_message = "550 Requested action not taken: mailbox unavailable\r\n";
-                if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-                    fprintf(stderr, "Could not communicate with client\r\n");
-                    //Does not exit, process the remaining recipients
-                }
-                if (verbose) {
-                    fprintf(stderr, "[%d] S: 550 Requested action not taken: mailbox unavailable\n", client_fd);  
-                }
-                cerr << "Failed to open mbox file for recipient: " << recipient << "\n";
-            }
+//Acknowledges a complete chunk, and delivers the message once the LAST one is in
+void Email::finishChunk(int client_fd, const string& mail_dir) {
+    chunking = false;
+    receivingData = false;
+    if (chunkDiscard) {
+        return;
+    }
 
-            //Unlocks the file
-            flock(old_fd, LOCK_UN);
-            close(old_fd);
-            // Unlock the mutex
-            pthread_mutex_unlock(&fileMutex);
+    if (!chunkLast) {
+        char message[64];
+        int length = snprintf(message, sizeof(message), "250 OK %zu octets received\r\n", chunkSize);
+        if (send_reply(client_fd, message, length) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+        }
+        LOG(LEVEL_DEBUG, "[%d] S: 250 OK %zu octets received\n", client_fd, chunkSize);
+        return;
+    }
 
+    //Like DATA bodies, the stored message ends with a line break
+    char last_byte = '\n';
+    if (!pendingData.empty()) {
+        last_byte = pendingData.back();
+    } else if (spoolFd >= 0) {
+        off_t spooled = lseek(spoolFd, 0, SEEK_END);
+        if (spooled <= 0 || pread(spoolFd, &last_byte, 1, spooled - 1) != 1) {
+            last_byte = '\n';
+        }
+    }
+    if (last_byte != '\n') {
+        pendingData.append("\r\n");
+    }
+    deliver(client_fd, mail_dir);
+}
+
+bool Email::isReceivingData() const {
+    return receivingData;
+}
+
+//Consumes message bytes read from the client and returns how many belonged to the message
+size_t Email::receiveData(int client_fd, const char* buffer, size_t length, const string& mail_dir) {
+    if (chunking) {
+        return receiveChunk(client_fd, buffer, length, mail_dir);
+    }
+
+    //Only the new bytes are scanned; the unstuffed body is appended to pendingData
+    size_t received = pendingData.size();
+    size_t consumed = scanner.scan(buffer, length, pendingData);
+    messageSize += pendingData.size() - received;
+    boundPendingData(mail_dir);
+    if (!scanner.isDone()) {
+        return consumed;
+    }
+
+    //Bytes after the termination sequence belong to the next command.
+    //The body keeps the CRLF that ended its last line; only the terminating ".\r\n" is dropped
+    receivingData = false;
+    deliver(client_fd, mail_dir);
+    return consumed;
+}
+
+//Keeps the memory a session holds bounded, whatever the size of the message
+void Email::boundPendingData(const string& mail_dir) {
+    if (max_message_size > 0 && messageSize > max_message_size && !sizeExceeded) {
+        //The message is refused once it ends; what was spooled so far is released now
+        sizeExceeded = true;
+        closeSpool();
+    }
+    if (!sizeExceeded && pendingData.size() > spool_threshold && !spoolFailed && !spoolPendingData(mail_dir)) {
+        spoolFailed = true;
+    }
+    if (spoolFailed || sizeExceeded) {
+        //The rest of the message is still read, but only to find its end
+        pendingData.clear();
+    }
+}
+
+//Replies to the end of the message and appends it to every recipient's mbox
+void Email::deliver(int client_fd, const string& mail_dir) {
+    //data holds the body, or for a spooled message the part that came after the spool file's contents
+    data.swap(pendingData);
+    pendingData.clear();
+    previousState = DATA;
+
+    if (sizeExceeded) {
+        rejectMessage(client_fd, "552 Message size exceeds fixed maximum message size\r\n");
+        return;
+    }
+    if (spoolFailed) {
+        rejectMessage(client_fd, "451 Requested action aborted: local error in processing\r\n");
+        return;
+    }
+
+    //Creates the header of the form: From <sender's email> <current timestamp> <LF>, in a buffer kept
+    //across the session's messages
+    string& header = fromLine;
+    build_from_line(header, mailFrom);
+
+    //In single-instance mode a message for several recipients is written once; each mbox only gets its
+    //From line with a reference to the stored body appended
+    string blob_name;
+    bool use_blob = single_instance && rcptTo.size() > 1 && storeBlob(mail_dir, blob_name);
+    if (use_blob) {
+        header.append(" blob=", 6);
+        header.append(blob_name);
+    }
+    header += '\n';
+
+    vector<string> mbox_paths;
+    for (const string& recipient : rcptTo) {
+        size_t atPos = recipient.find('@');
+        mbox_paths.push_back(mailbox_key(mail_dir, string_view(recipient).substr(0, atPos)));
+    }
+
+    size_t delivered = 0;
+    if (delivery_workers > 0) {
+        //With -q the message is accepted once it is queued; the delivery workers append it
+        if (queueMessage(header, use_blob, mbox_paths)) {
+            delivered = mbox_paths.size();
         }
     } else {
-        //Invalid sequence of commands
-        string message = "503 Bad sequence of commands\r\n";
-        if (write(client_fd, message.c_str(), message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        MailboxAppend message;
+        message.header = &header;
+        message.spool_fd = use_blob ? -1 : spoolFd;
+        message.body = use_blob ? nullptr : &data;
+
+        //Each append returns once it is as durable as the fsync policy asks (see -f)
+        for (size_t i = 0; i < mbox_paths.size(); i++) {
+            if (append_to_mailbox(mbox_paths[i], message)) {
+                delivered++;
+            } else {
+                LOG(LEVEL_ERROR, "Failed to deliver message for recipient: %s\n", rcptTo[i].c_str());
+            }
+        }
+    }
+
+    //The reply is held until the message is stored, so 250 means it survives a crash under -f message or group.
+    //It is only sent once every recipient has the message; after a failed append the client has to try
+    //again, even if that gives the other recipients a second copy, rather than lose mail
+    if (delivered < mbox_paths.size()) {
+        string error_message = "451 Requested action aborted: local error in processing\r\n";
+        if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 Bad sequence of commands\n", client_fd);  
+        LOG(LEVEL_DEBUG, "[%d] S: 451 Requested action aborted: local error in processing\n", client_fd);
+    } else {
+        string success_message = "250 OK\r\n";
+        if (send_reply(client_fd, success_message.c_str(), success_message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: 250 OK\n", client_fd);
+    }
+
+    closeSpool();
+
+    //Ends the mail transaction so the next MAIL FROM can follow without RSET (pipelined bulk senders)
+    mailFrom.clear();
+    rcptTo.clear();
+    previousState = HELO;
+}
+
+//Replies to a message that will not be delivered and ends its mail transaction
+void Email::rejectMessage(int client_fd, const char* reply) {
+    if (send_reply(client_fd, reply, strlen(reply)) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
+    LOG(LEVEL_DEBUG, "[%d] S: %.*s\n", client_fd, (int)strlen(reply) - 2, reply);
+    closeSpool();
+    data.clear();
+    pendingData.clear();
+    mailFrom.clear();
+    rcptTo.clear();
+    sizeExceeded = false;
+    previousState = HELO;
 }
 
-void Email::process_RSET(int& client_fd, string argument) {
+void Email::process_RSET(int& client_fd, string_view argument) {
     //Checks if an argument is provided
     if (!argument.empty()) {
         const char* syntax_error_msg = "501 Syntax error: Remove argument\r\n";
-        if (write(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-            // exit(1);
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-        }
-        return;
-    }
-
-    //Checks if the previous state is INIT
-    if (previousState == INIT) {
-        const char* bad_sequence_msg = "503 Bad sequence of commands\r\n";
-        if(write(client_fd, bad_sequence_msg, strlen(bad_sequence_msg)) < 0){
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 Bad sequence of commands\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
 
-    //Clears all stored sender, recipients, and mail data
+    //Clears all stored sender, recipients, and mail data, including BDAT chunks received so far
     mailFrom.clear();
     rcptTo.clear();
     data.clear();
+    pendingData.clear();
+    closeSpool();
     previousState = INIT;
 
     //Sends 250 OK to the client
     const char* success_msg = "250 OK\r\n";
-    if(write(client_fd, success_msg, strlen(success_msg)) < 0){
-        fprintf(stderr, "Could not communicate with client\r\n");
+    if(send_reply(client_fd, success_msg, strlen(success_msg)) < 0){
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         // exit(1);
     }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: 250 OK\n", client_fd);  
-    }
+    LOG(LEVEL_DEBUG, "[%d] S: 250 OK\n", client_fd);
 }
 
-void Email::process_QUIT(int& client_fd, string argument) {
+void Email::process_QUIT(int& client_fd, string_view argument) {
     //Checks if an argument is provided
     if (!argument.empty()) {
         const char* syntax_error_msg = "501 Syntax error: Remove argument\r\n";
-        if (write(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
 
     // Check if the previous state is not HELO
     // if (previousState != HELO) {
     //     const char* bad_sequence_msg = "503 Bad sequence of commands\r\n";
-    //     if(write(client_fd, bad_sequence_msg, strlen(bad_sequence_msg)) < 0){
-    //         fprintf(stderr, "Could not communicate with client\r\n");
+    //     if(send_reply(client_fd, bad_sequence_msg, strlen(bad_sequence_msg)) < 0){
+    //         LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     //         exit(1);
     //     }
     //     return;
@@ -621,13 +963,11 @@ void Email::process_QUIT(int& client_fd, string argument) {
 
     //Sends 250 OK to the client
     const char* success_msg = "221 localhost closing transmission\r\n";
-    if(write(client_fd, success_msg, strlen(success_msg)) < 0){
-        fprintf(stderr, "Could not communicate with client\r\n");
+    if(send_reply(client_fd, success_msg, strlen(success_msg)) < 0){
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         // exit(1);
     }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: 221 localhost closing transmission\n", client_fd);  
-    }
+    LOG(LEVEL_DEBUG, "[%d] S: 221 localhost closing transmission\n", client_fd);
 
     //Clears all stored sender, recipients, and mail data
     mailFrom.clear();
@@ -635,45 +975,26 @@ void Email::process_QUIT(int& client_fd, string argument) {
     data.clear();
     previousState = INIT;
 
-    //Closes the client connection
-    close(client_fd);
-    pthread_exit(nullptr);
+    //The caller closes the client connection once process_command returns false
 }
 
-void Email::process_NOOP(int& client_fd, string argument) {
+void Email::process_NOOP(int& client_fd, string_view argument) {
     //Checks if an argument is provided
     if (!argument.empty()) {
         const char* syntax_error_msg = "501 Syntax error: Remove argument\r\n";
-        if (write(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, syntax_error_msg, strlen(syntax_error_msg)) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             // exit(1);
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 501 Syntax error\n", client_fd);  
-        }
-        return;
-    }
-
-    //Checks if the previous state is not INIT
-    if (previousState != INIT) {
-        const char* bad_sequence_msg = "503 Bad sequence of commands\r\n";
-        if(write(client_fd, bad_sequence_msg, strlen(bad_sequence_msg)) < 0){
-            fprintf(stderr, "Could not communicate with client\r\n");
-            // exit(1);
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 503 Bad sequence of commands\n", client_fd);  
-        }
+        LOG(LEVEL_DEBUG, "[%d] S: 501 Syntax error\n", client_fd);
         return;
     }
 
     //Sends 250 OK to the client
     const char* success_msg = "250 OK\r\n";
-    if(write(client_fd, success_msg, strlen(success_msg)) < 0){
-        fprintf(stderr, "Could not communicate with client\r\n");
+    if(send_reply(client_fd, success_msg, strlen(success_msg)) < 0){
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         // exit(1);
     }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: 250 OK\n", client_fd);  
-    }
+    LOG(LEVEL_DEBUG, "[%d] S: 250 OK\n", client_fd);
 }
\ No newline at end of file
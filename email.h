@@ -2,12 +2,24 @@
 #define EMAIL_H
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <vector>
+#include <openssl/evp.h>
+#include "datascanner.h"
 
 //Declares verbose as extern so it can access the definition from smtp.cc
 extern bool verbose;
 
+//Message bodies larger than this many bytes are streamed to a spool file instead of kept in memory (see -s)
+extern size_t spool_threshold;
+
+//Largest message accepted, in bytes; advertised with the SIZE extension (see -m)
+extern size_t max_message_size;
+
+//Messages with several recipients are stored once in mail_dir/blobs and referenced from each mbox (see -b)
+extern bool single_instance;
+
 class Email {
 public:
     // Enum to represent different states of the email session
@@ -20,18 +32,49 @@ public:
         RCPT,  
         DATA,  
         NOOP,  
-        DOT    
+        DOT,
+        BDAT    //At least one BDAT chunk of the current message has been received
     };
 
 private:
     std::string mailFrom;                   
     std::vector<std::string> rcptTo;        
     std::string data;                       
+    std::string fromLine;                   //From line of the message being delivered; its buffer is reused
     EmailState previousState;               
+    bool receivingData;                     //True between the 354 reply and the end-of-data marker, or inside a BDAT chunk
+    std::string pendingData;                //Message bytes received so far during DATA or BDAT
+    DataScanner scanner;                    //Finds the end-of-data marker in the bytes received during DATA
+    int spoolFd;                            //Unlinked temp file in mail_dir holding the body once it outgrows memory, or -1
+    bool spoolFailed;                       //A write to the spool file failed, so the message cannot be delivered
+    size_t messageSize;                     //Body bytes received for the current message, including BDAT chunks announced
+    bool sizeExceeded;                      //The message outgrew max_message_size; the rest of it is read past
+
+    //BDAT (RFC 3030) chunk being received
+    bool chunking;
+    size_t chunkRemaining;                  //Declared chunk bytes not received yet
+    size_t chunkSize;
+    bool chunkLast;
+    bool chunkDiscard;                      //The BDAT was rejected, but its chunk still has to be read past
+    int splicePipe[2];                      //Moves chunk bytes from the socket to the spool file; created on first use
+    bool spliceUnsupported;
+
+    void boundPendingData(const std::string& mail_dir);
+    bool parseMailParameters(std::string_view parameters, int client_fd);
+    void rejectMessage(int client_fd, const char* reply);
+    size_t receiveChunk(int client_fd, const char* buffer, size_t length, const std::string& mail_dir);
+    void finishChunk(int client_fd, const std::string& mail_dir);
+    void deliver(int client_fd, const std::string& mail_dir);
+    bool spoolPendingData(const std::string& mail_dir);
+    bool writeBody(int fd, EVP_MD_CTX* digest);
+    bool storeBlob(const std::string& mail_dir, std::string& blob_name);
+    bool queueMessage(const std::string& header, bool use_blob, const std::vector<std::string>& mbox_paths);
+    void closeSpool();
 
 public:
     // Constructor
     Email(std::string sender, std::string recipient, std::string emailData);
+    ~Email();
 
     // Setter and Getter for mailFrom
     void setMailFrom(const std::string& sender);
@@ -52,16 +95,21 @@ public:
     // Method to display the email information
     void displayEmailInfo();
 
-    void process_HELO(const std::string& domain, int client_fd); 
-    void process_MAILFROM(const std::string& sender, int client_fd);
-    void process_RCPTTO(const std::string& recipient, int client_fd, std::string mail_dir);
+    void process_HELO(std::string_view domain, int client_fd); 
+    void process_EHLO(std::string_view domain, int client_fd);
+    void process_MAILFROM(std::string_view sender, int client_fd);
+    void process_RCPTTO(std::string_view recipient, int client_fd, const std::string& mail_dir);
 
-    bool isValidEmail(const std::string& email) const;
+    bool isValidEmail(std::string_view email) const;
 
-    void process_DATA(int& client_fd, std::string argument, std::string mail_dir);
-    void process_RSET(int& client_fd, std::string argument);
-    void process_QUIT(int& client_fd, std::string argument);
-    void process_NOOP(int& client_fd, std::string argument);
+    void process_DATA(int& client_fd, std::string_view argument, const std::string& mail_dir);
+    void process_BDAT(std::string_view argument, int client_fd, const std::string& mail_dir);
+    bool spliceChunk(int client_fd, const std::string& mail_dir);
+    bool isReceivingData() const;
+    size_t receiveData(int client_fd, const char* buffer, size_t length, const std::string& mail_dir);
+    void process_RSET(int& client_fd, std::string_view argument);
+    void process_QUIT(int& client_fd, std::string_view argument);
+    void process_NOOP(int& client_fd, std::string_view argument);
 };
 
 #endif 
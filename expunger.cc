@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "expunger.h"
+#include "mboxcompact.h"
+#include "blobstore.h"
+#include "lockmanager.h"
+#include "log.h"
+
+using namespace std;
+
+extern bool verbose;
+
+namespace {
+
+const time_t REPORT_INTERVAL = 10;      //Seconds between compactor reports in verbose mode
+const time_t RETRY_DELAY = 60;          //Seconds before a mailbox that failed to compact is tried again
+const uint64_t PACE_CHUNK = 1 << 20;    //Bytes copied between checks of the rate limit
+
+//One deleted message in user.dead. A torn last entry from a crash is ignored
+struct Tombstone {
+    uint64_t mbox_inode;        //Of the mbox offset refers to; entries for an mbox since replaced match nothing
+    uint64_t offset;            //Of the message's From line
+    unsigned char uid[16];
+};
+
+static_assert(sizeof(Tombstone) == 32, "tombstones are 32 bytes");
+
+struct MailboxDebt {
+    uint64_t garbage;           //Bytes of tombstoned messages still in the mbox
+    uint64_t mbox_size;
+    time_t next_attempt;        //Set after a compaction failed
+};
+
+ExpungeLimits limits = { 25, 64, 16 };
+bool running = false;
+pthread_mutex_t expunge_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t debt_added = PTHREAD_COND_INITIALIZER;
+map<string, MailboxDebt> debts;         //Mailboxes with tombstones, by mbox path
+uint64_t tombstone_count = 0;
+uint64_t compaction_count = 0;
+uint64_t copied_bytes = 0;
+uint64_t reclaimed_bytes = 0;
+double busy_seconds = 0;
+time_t last_report = 0;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string journal_path(const string& mbox_path) {
+    return sibling_path(mbox_path, ".dead");
+}
+
+//Reads the tombstones of the mbox with inode mbox_inode, sorted by offset
+bool read_tombstones(const string& mbox_path, uint64_t mbox_inode, vector<Tombstone>& tombstones) {
+    tombstones.clear();
+    int fd = open(journal_path(mbox_path).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    vector<Tombstone> entries;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        entries.resize(st.st_size / sizeof(Tombstone));
+        size_t length = entries.size() * sizeof(Tombstone);
+        ok = pread(fd, entries.data(), length, 0) == (ssize_t)length;
+    }
+    close(fd);
+    for (const Tombstone& entry : entries) {
+        if (entry.mbox_inode == mbox_inode) {
+            tombstones.push_back(entry);
+        }
+    }
+    sort(tombstones.begin(), tombstones.end(),
+         [](const Tombstone& a, const Tombstone& b) { return a.offset < b.offset; });
+    return ok;
+}
+
+//Walks the records and the sorted tombstones together, clearing keep for each record with a tombstone
+size_t mark_records(const vector<Tombstone>& tombstones, const vector<IndexRecord>& records, vector<bool>& keep,
+                    uint64_t& garbage) {
+    size_t marked = 0;
+    size_t t = 0;
+    for (size_t i = 0; i < records.size() && t < tombstones.size(); i++) {
+        while (t < tombstones.size() && tombstones[t].offset < records[i].offset) {
+            t++;
+        }
+        if (t < tombstones.size() && tombstones[t].offset == records[i].offset &&
+            memcmp(tombstones[t].uid, records[i].uid, sizeof(records[i].uid)) == 0) {
+            if (keep[i]) {
+                keep[i] = false;
+                garbage += records[i].length;
+                marked++;
+            }
+        }
+    }
+    return marked;
+}
+
+bool write_all(int fd, const void* data, size_t length) {
+    const char* p = (const char*)data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool append_tombstones(const string& mbox_path, const vector<Tombstone>& entries) {
+    int fd = open(journal_path(mbox_path).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    //Drops a torn entry first, so the new ones stay aligned
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size % sizeof(Tombstone) != 0) {
+        ok = ftruncate(fd, st.st_size - st.st_size % sizeof(Tombstone)) == 0;
+    }
+    ok = ok && write_all(fd, entries.data(), entries.size() * sizeof(Tombstone)) && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+//Replaces the journal with entries, through a temp file so a crash leaves the old or the new one
+bool write_tombstones(const string& mbox_path, const vector<Tombstone>& entries) {
+    string path = journal_path(mbox_path);
+    if (entries.empty()) {
+        return unlink(path.c_str()) == 0 || errno == ENOENT;
+    }
+    string temp_path = path + ".XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fchmod(fd, 0644) == 0 && write_all(fd, entries.data(), entries.size() * sizeof(Tombstone)) &&
+              fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_path.c_str(), path.c_str()) < 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+//Sets what is left to compact in a mailbox. Called with the mailbox held, so no QUIT adds to it meanwhile
+void set_debt(const string& mbox_path, uint64_t garbage, uint64_t mbox_size) {
+    pthread_mutex_lock(&expunge_mutex);
+    if (garbage == 0) {
+        debts.erase(mbox_path);
+    } else {
+        MailboxDebt& debt = debts[mbox_path];
+        debt.garbage = garbage;
+        debt.mbox_size = mbox_size;
+    }
+    pthread_mutex_unlock(&expunge_mutex);
+}
+
+bool over_threshold(const MailboxDebt& debt) {
+    if (limits.garbage_percent == 0 && limits.garbage_mb == 0) {
+        return debt.garbage > 0;
+    }
+    return (limits.garbage_percent > 0 && debt.garbage * 100 >= (uint64_t)limits.garbage_percent * debt.mbox_size) ||
+           (limits.garbage_mb > 0 && debt.garbage >= (uint64_t)limits.garbage_mb << 20);
+}
+
+//Copies like copy_range, pausing so that everything copied since start stays within the rate limit
+bool copy_paced(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length, double start,
+                uint64_t& copied) {
+    uint64_t rate = (uint64_t)limits.rate_mb << 20;
+    while (length > 0) {
+        uint64_t chunk = (rate == 0) ? length : min(length, PACE_CHUNK);
+        if (!copy_range(in_fd, in_offset, out_fd, out_offset, chunk)) {
+            return false;
+        }
+        in_offset += chunk;
+        out_offset += chunk;
+        length -= chunk;
+        copied += chunk;
+        if (rate == 0) {
+            continue;
+        }
+        double ahead = start + (double)copied / rate - now_seconds();
+        if (ahead > 0) {
+            struct timespec pause = { (time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9) };
+            nanosleep(&pause, nullptr);
+        }
+    }
+    return true;
+}
+
+//Moves the kept messages of an mbox to a new file that replaces it. The copy runs without holding the
+//mailbox: deliveries only append, and while -x is on nothing but this thread moves messages, so the
+//mbox up to where it ended stays as it was. The mailbox is only held to look at it and, at the end, to
+//copy what was delivered meanwhile and switch to the new mbox; holding it also takes the user.lock
+//flock, so the SMTP server cannot append between the catch-up and the rename, and it opens the mbox
+//again once it gets the lock. Sessions still reading the old mbox keep it open and are not disturbed
+bool compact_aside(const string& mbox_path, uint64_t& copied, uint64_t& reclaimed) {
+    lock_mailbox(mbox_path, LOCK_EXCLUSIVE);
+    recover_compaction(mbox_path);
+    int mbox_fd = open(mbox_path.c_str(), O_RDONLY);
+    struct stat mbox_st;
+    vector<IndexRecord> records;
+    vector<Tombstone> tombstones;
+    bool ok = mbox_fd >= 0 && fstat(mbox_fd, &mbox_st) == 0 && load_index(mbox_path, mbox_fd, records) &&
+              read_tombstones(mbox_path, mbox_st.st_ino, tombstones);
+    vector<bool> keep(records.size(), true);
+    uint64_t garbage = 0;
+    if (ok && mark_records(tombstones, records, keep, garbage) == 0) {
+        //The tombstones were all for an mbox that has since been replaced
+        write_tombstones(mbox_path, {});
+        set_debt(mbox_path, 0, 0);
+    }
+    unlock_mailbox(mbox_path);
+    if (!ok || garbage == 0) {
+        if (mbox_fd >= 0) {
+            close(mbox_fd);
+        }
+        return ok;
+    }
+
+    string temp_path = sibling_path(mbox_path, ".temp");
+    int temp_fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ok = temp_fd >= 0;
+
+    //Runs of kept messages that sit next to each other are copied with one call
+    vector<IndexRecord> kept;
+    vector<uint64_t> old_offsets;
+    uint64_t out = 0;
+    uint64_t run_offset = 0;
+    uint64_t run_length = 0;
+    double start = now_seconds();
+    uint64_t paced = 0;
+    for (size_t i = 0; ok && i < records.size(); i++) {
+        if (!keep[i]) {
+            continue;
+        }
+        if (run_offset + run_length != records[i].offset) {
+            ok = copy_paced(mbox_fd, run_offset, temp_fd, out - run_length, run_length, start, paced);
+            run_offset = records[i].offset;
+            run_length = 0;
+        }
+        IndexRecord record = records[i];
+        old_offsets.push_back(record.offset);
+        record.offset = out;
+        seal_record(record);
+        kept.push_back(record);
+        out += record.length;
+        run_length += record.length;
+    }
+    ok = ok && copy_paced(mbox_fd, run_offset, temp_fd, out - run_length, run_length, start, paced);
+    ok = ok && fdatasync(temp_fd) == 0;
+
+    //From here to the rename no delivery in either server can append to the old mbox
+    lock_mailbox(mbox_path, LOCK_EXCLUSIVE);
+    struct stat current_st;
+    vector<IndexRecord> current;
+    ok = ok && stat(mbox_path.c_str(), &current_st) == 0 && current_st.st_ino == mbox_st.st_ino &&
+         load_index(mbox_path, mbox_fd, current) && read_tombstones(mbox_path, mbox_st.st_ino, tombstones);
+
+    //Messages delivered during the copy go after the others, unpaced since the mailbox is held
+    for (size_t i = 0; ok && i < current.size(); i++) {
+        IndexRecord record = current[i];
+        if (record.offset < (uint64_t)mbox_st.st_size) {
+            continue;
+        }
+        ok = copy_range(mbox_fd, record.offset, temp_fd, out, record.length);
+        old_offsets.push_back(record.offset);
+        record.offset = out;
+        seal_record(record);
+        kept.push_back(record);
+        out += record.length;
+    }
+
+    //Tombstones added during the copy are for kept messages, which carry them over to their new place
+    struct stat temp_st;
+    ok = ok && fdatasync(temp_fd) == 0 && fstat(temp_fd, &temp_st) == 0;
+    vector<Tombstone> carried;
+    uint64_t remaining = 0;
+    for (const Tombstone& tombstone : tombstones) {
+        auto found = lower_bound(old_offsets.begin(), old_offsets.end(), tombstone.offset);
+        if (found == old_offsets.end() || *found != tombstone.offset) {
+            continue;
+        }
+        const IndexRecord& record = kept[found - old_offsets.begin()];
+        if (memcmp(record.uid, tombstone.uid, sizeof(record.uid)) == 0) {
+            Tombstone moved = tombstone;
+            moved.mbox_inode = temp_st.st_ino;
+            moved.offset = record.offset;
+            carried.push_back(moved);
+            remaining += record.length;
+        }
+    }
+
+    //They are in the journal before the rename, so they hold for whichever mbox a crash leaves behind
+    ok = ok && (carried.empty() || append_tombstones(mbox_path, carried)) &&
+         rename(temp_path.c_str(), mbox_path.c_str()) == 0;
+    if (ok) {
+        if (!write_index(mbox_path, kept)) {
+            unlink(index_path(mbox_path).c_str());
+        }
+        write_tombstones(mbox_path, carried);
+        set_debt(mbox_path, remaining, out);
+        if (drops_blob(records, keep)) {
+            request_blob_sweep();
+        }
+        copied = out;
+        reclaimed = current_st.st_size - out;
+    } else {
+        LOG(LEVEL_ERROR, "Cannot compact %s (%s)\n", mbox_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+    }
+    unlock_mailbox(mbox_path);
+    if (temp_fd >= 0) {
+        close(temp_fd);
+    }
+    close(mbox_fd);
+    return ok;
+}
+
+void *compactor(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&expunge_mutex);
+    while (true) {
+        time_t now = time(nullptr);
+        if (verbose && !debts.empty() && now - last_report >= REPORT_INTERVAL) {
+            last_report = now;
+            pthread_mutex_unlock(&expunge_mutex);
+            print_expunge_stats(stderr);
+            pthread_mutex_lock(&expunge_mutex);
+        }
+
+        //The mailbox with the most garbage among those over a threshold goes first
+        string next;
+        uint64_t most = 0;
+        for (const auto& [path, debt] : debts) {
+            if (debt.next_attempt <= now && over_threshold(debt) && debt.garbage > most) {
+                next = path;
+                most = debt.garbage;
+            }
+        }
+        if (next.empty()) {
+            //Mailboxes that failed are looked at again every second
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&debt_added, &expunge_mutex, &deadline);
+            continue;
+        }
+        pthread_mutex_unlock(&expunge_mutex);
+
+        double start = now_seconds();
+        uint64_t copied = 0;
+        uint64_t reclaimed = 0;
+        bool ok = compact_aside(next, copied, reclaimed);
+
+        pthread_mutex_lock(&expunge_mutex);
+        busy_seconds += now_seconds() - start;
+        if (ok && copied + reclaimed > 0) {
+            compaction_count++;
+            copied_bytes += copied;
+            reclaimed_bytes += reclaimed;
+        } else if (!ok) {
+            auto found = debts.find(next);
+            if (found != debts.end()) {
+                found->second.next_attempt = time(nullptr) + RETRY_DELAY;
+            }
+        }
+    }
+    return NULL;
+}
+
+}
+
+bool parse_expunge_limits(const char* text, ExpungeLimits& new_limits) {
+    int* fields[] = { &new_limits.garbage_percent, &new_limits.garbage_mb, &new_limits.rate_mb };
+    const char* p = text;
+    for (int i = 0; i < 3; i++) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < 0) {
+            return false;
+        }
+        *fields[i] = (int)value;
+        if (*end == '\0') {
+            return true;
+        }
+        if (*end != ',') {
+            return false;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+bool start_expunger(const string& mail_dir, const ExpungeLimits& new_limits) {
+    limits = new_limits;
+    running = true;
+
+    //Tombstones left from a previous run are still owed a compaction
+    DIR* dir = opendir(mail_dir.c_str());
+    if (dir == nullptr) {
+        LOG(LEVEL_ERROR, "Cannot read %s (%s)\n", mail_dir.c_str(), strerror(errno));
+        return false;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        string name = entry->d_name;
+        if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".dead") != 0) {
+            continue;
+        }
+        string mbox_path = mailbox_key(mail_dir, name.substr(0, name.size() - 5));
+        lock_mailbox(mbox_path, LOCK_EXCLUSIVE);
+        recover_compaction(mbox_path);
+        int mbox_fd = open(mbox_path.c_str(), O_RDONLY);
+        struct stat st;
+        vector<IndexRecord> records;
+        vector<Tombstone> tombstones;
+        if (mbox_fd >= 0 && fstat(mbox_fd, &st) == 0 && load_index(mbox_path, mbox_fd, records) &&
+            read_tombstones(mbox_path, st.st_ino, tombstones)) {
+            vector<bool> keep(records.size(), true);
+            uint64_t garbage = 0;
+            mark_records(tombstones, records, keep, garbage);
+            if (garbage == 0) {
+                write_tombstones(mbox_path, {});
+            }
+            set_debt(mbox_path, garbage, st.st_size);
+        }
+        if (mbox_fd >= 0) {
+            close(mbox_fd);
+        }
+        unlock_mailbox(mbox_path);
+    }
+    closedir(dir);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compactor, NULL) != 0) {
+        LOG(LEVEL_ERROR, "Cannot start compactor\n");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+size_t mark_tombstoned(const string& mbox_path, int mbox_fd, const vector<IndexRecord>& records, vector<bool>& keep) {
+    struct stat st;
+    vector<Tombstone> tombstones;
+    if (fstat(mbox_fd, &st) < 0 || !read_tombstones(mbox_path, st.st_ino, tombstones)) {
+        LOG(LEVEL_WARNING, "Cannot read %s (%s)\n", journal_path(mbox_path).c_str(), strerror(errno));
+        return 0;
+    }
+    uint64_t garbage = 0;
+    return mark_records(tombstones, records, keep, garbage);
+}
+
+bool add_tombstones(const string& mbox_path, int mbox_fd, const vector<IndexRecord>& records, const vector<bool>& keep) {
+    struct stat st;
+    vector<Tombstone> existing;
+    if (fstat(mbox_fd, &st) < 0 || !read_tombstones(mbox_path, st.st_ino, existing)) {
+        return false;
+    }
+    //A message another session deleted first already has its tombstone
+    vector<bool> alive(records.size(), true);
+    uint64_t garbage = 0;
+    mark_records(existing, records, alive, garbage);
+
+    vector<Tombstone> entries;
+    garbage = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (!keep[i] && alive[i]) {
+            Tombstone tombstone;
+            tombstone.mbox_inode = st.st_ino;
+            tombstone.offset = records[i].offset;
+            memcpy(tombstone.uid, records[i].uid, sizeof(tombstone.uid));
+            entries.push_back(tombstone);
+            garbage += records[i].length;
+        }
+    }
+    if (entries.empty()) {
+        return true;
+    }
+    if (!append_tombstones(mbox_path, entries)) {
+        LOG(LEVEL_ERROR, "Cannot write %s (%s)\n", journal_path(mbox_path).c_str(), strerror(errno));
+        return false;
+    }
+
+    pthread_mutex_lock(&expunge_mutex);
+    tombstone_count += entries.size();
+    if (running) {
+        MailboxDebt& debt = debts[mbox_path];
+        debt.garbage += garbage;
+        debt.mbox_size = st.st_size;
+        pthread_cond_signal(&debt_added);
+    }
+    pthread_mutex_unlock(&expunge_mutex);
+    return true;
+}
+
+void clear_tombstones(const string& mbox_path) {
+    unlink(journal_path(mbox_path).c_str());
+    set_debt(mbox_path, 0, 0);
+}
+
+ExpungeStats expunge_stats() {
+    pthread_mutex_lock(&expunge_mutex);
+    ExpungeStats stats = { tombstone_count, compaction_count, copied_bytes, reclaimed_bytes, busy_seconds,
+                           debts.size(), 0 };
+    for (const auto& [path, debt] : debts) {
+        stats.debt_bytes += debt.garbage;
+    }
+    pthread_mutex_unlock(&expunge_mutex);
+    return stats;
+}
+
+void print_expunge_stats(FILE* out) {
+    ExpungeStats stats = expunge_stats();
+    double throughput = (stats.busy_seconds > 0) ? stats.bytes_copied / stats.busy_seconds / 1e6 : 0;
+    fprintf(out, "Expunge: %llu messages deleted, %llu compactions, %.1f MB copied (%.1f MB/s), %.1f MB reclaimed, "
+            "%.1f MB left in %zu mailboxes\n",
+            (unsigned long long)stats.tombstones, (unsigned long long)stats.compactions, stats.bytes_copied / 1e6,
+            throughput, stats.bytes_reclaimed / 1e6, stats.debt_bytes / 1e6, stats.debt_mailboxes);
+}
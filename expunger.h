@@ -0,0 +1,58 @@
+#ifndef EXPUNGER_H
+#define EXPUNGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "mboxindex.h"
+
+//Deferred expunge for the POP3 server (see pop3 -x). QUIT only appends the messages it deletes to a
+//tombstone journal next to the mbox, user.dead, and replies; a background compactor later removes them
+//from the mbox once enough of it is garbage. Tombstones name a message by the inode of the mbox and the
+//message's offset in it, which deliveries never change, and a tombstone left over from an mbox that has
+//since been replaced matches nothing. The compactor switches to the new mbox while it holds the mailbox
+//exclusively, and that lock takes the same user.lock flock as SMTP delivery, so mail is never appended
+//to an mbox that is being replaced. Every reader of a mailbox skips tombstoned messages, whether or not
+//the compactor runs
+
+struct ExpungeLimits {
+    int garbage_percent;    //Compact a mailbox once this share of its mbox is deleted messages
+    int garbage_mb;         //or once this many MB are
+    int rate_mb;            //MB per second the compactor may copy; 0 for no limit
+};
+
+struct ExpungeStats {
+    uint64_t tombstones;        //Messages deleted at QUIT and left for the compactor
+    uint64_t compactions;
+    uint64_t bytes_copied;
+    uint64_t bytes_reclaimed;
+    double busy_seconds;        //Spent compacting, pauses for the rate limit included
+    size_t debt_mailboxes;      //Mailboxes that still hold deleted messages
+    uint64_t debt_bytes;        //Deleted messages still taking space in them
+};
+
+//Parses percent[,mb[,rate_mb]]; a 0 turns that limit off
+bool parse_expunge_limits(const char* text, ExpungeLimits& limits);
+
+//Finds the tombstones left from a previous run in mail_dir and starts the compactor thread
+bool start_expunger(const std::string& mail_dir, const ExpungeLimits& limits);
+
+//Clears the keep flag of every record of the mbox open on mbox_fd that has a tombstone, and returns how
+//many it cleared. The caller holds the mailbox at least shared
+size_t mark_tombstoned(const std::string& mbox_path, int mbox_fd, const std::vector<IndexRecord>& records,
+                       std::vector<bool>& keep);
+
+//Appends a tombstone for each record whose keep flag is false and that has none yet, and syncs the
+//journal; the messages count as deleted once this returns true. The caller holds the mailbox exclusively
+bool add_tombstones(const std::string& mbox_path, int mbox_fd, const std::vector<IndexRecord>& records,
+                    const std::vector<bool>& keep);
+
+//Removes the journal after the messages it names were compacted away. The caller holds the mailbox
+//exclusively
+void clear_tombstones(const std::string& mbox_path);
+
+ExpungeStats expunge_stats();
+void print_expunge_stats(FILE* out);
+
+#endif
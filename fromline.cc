@@ -0,0 +1,37 @@
+#include <time.h>
+#include <string.h>
+#include "fromline.h"
+
+using namespace std;
+
+namespace {
+
+//The date last formatted by this thread and the second it is for
+struct DateCache {
+    time_t second;
+    char date[FROM_LINE_DATE_LENGTH + 1];
+};
+
+thread_local DateCache date_cache = { -1, "" };
+
+const char* current_date() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != date_cache.second) {
+        struct tm now_tm;
+        localtime_r(&now.tv_sec, &now_tm);
+        strftime(date_cache.date, sizeof(date_cache.date), "%a %b %d %H:%M:%S %Y", &now_tm);
+        date_cache.second = now.tv_sec;
+    }
+    return date_cache.date;
+}
+
+}
+
+void build_from_line(string& line, string_view sender) {
+    const char* date = current_date();
+    line.assign("From <", 6);
+    line.append(sender);
+    line.append("> ", 2);
+    line.append(date, strlen(date));
+}
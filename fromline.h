@@ -0,0 +1,17 @@
+#ifndef FROMLINE_H
+#define FROMLINE_H
+
+#include <string>
+#include <string_view>
+
+//Builds the "From <sender> <date>" line that starts every message in an mbox. The date is formatted at
+//most once per second per thread, from the coarse realtime clock, so building a line is a few copies
+//into a buffer the caller keeps between messages
+
+//Length of the date, e.g. "Sat Oct 17 12:00:00 2026"
+const size_t FROM_LINE_DATE_LENGTH = 24;
+
+//Replaces line with "From <sender> <date>", without the newline
+void build_from_line(std::string& line, std::string_view sender);
+
+#endif
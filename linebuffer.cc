@@ -0,0 +1,54 @@
+#include <string.h>
+#include <algorithm>
+#include "linebuffer.h"
+
+using namespace std;
+
+void LineBuffer::append(const char* data, size_t length) {
+    if (head == tail) {
+        //Everything was consumed, so the next bytes can start at the front for free
+        head = tail = 0;
+        scanned = 0;
+    }
+
+    if (tail + length > storage.size()) {
+        size_t unread_bytes = tail - head;
+        if (head >= unread_bytes && unread_bytes + length <= storage.size()) {
+            //Compacts only when the dead prefix is at least as large as the bytes being moved
+            memmove(storage.data(), storage.data() + head, unread_bytes);
+            head = 0;
+            tail = unread_bytes;
+        } else {
+            storage.resize(max(storage.size() * 2, tail + length));
+        }
+    }
+
+    memcpy(storage.data() + tail, data, length);
+    tail += length;
+}
+
+bool LineBuffer::nextLine(string_view& line) {
+    //Resumes the search where the previous call gave up, so a line arriving in pieces is scanned once
+    const char* start = storage.data() + head;
+    const char* newline = (const char*)memchr(start + scanned, '\n', tail - head - scanned);
+    if (newline == nullptr) {
+        scanned = tail - head;
+        return false;
+    }
+
+    size_t length = newline - start;
+    head += length + 1;
+    scanned = 0;
+
+    //Removes carriage return if present (handles CRLF)
+    if (length > 0 && start[length - 1] == '\r') {
+        length--;
+    }
+    line = string_view(start, length);
+    return true;
+}
+
+void LineBuffer::consume(size_t length) {
+    head += length;
+    scanned = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+#include <string_view>
+#include <vector>
+
+//Per-connection input buffer. Reads advance a cursor instead of erasing from the front, and the unread
+//bytes are only moved back to the start once the consumed prefix is at least as large as what is left
+class LineBuffer {
+private:
+    std::vector<char> storage;
+    size_t head;        //First unread byte
+    size_t tail;        //One past the last received byte
+    size_t scanned;     //Unread bytes already searched for a newline without finding one
+
+public:
+    LineBuffer() : head(0), tail(0), scanned(0) {}
+
+    //Adds bytes read from the client
+    void append(const char* data, size_t length);
+
+    //Hands out the next complete line without its LF or CRLF. The view stays valid until the next append()
+    bool nextLine(std::string_view& line);
+
+    //Bytes received but not consumed yet, for callers that read raw data such as a message body
+    std::string_view unread() const { return std::string_view(storage.data() + head, tail - head); }
+    void consume(size_t length);
+
+    bool empty() const { return head == tail; }
+};
+
+#endif
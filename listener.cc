@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include "listener.h"
+
+using namespace std;
+
+struct AcceptorArgs {
+    int listen_fd;
+    int cpu;
+    void (*accept_loop)(int listen_fd);
+};
+
+int open_listener(int port, bool reuse_port) {
+    //Sets up listening socket
+    int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Cannot open socket (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
+        fprintf(stderr, "Cannot set socket options (%s)\n", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    struct sockaddr_in servaddr; //Declares a structure to hold the server's address information, including IP address and port number
+    bzero(&servaddr, sizeof(servaddr)); //Clears the memory allocated for servaddr by setting all bytes to zero
+
+    servaddr.sin_family = AF_INET; //Specifies the address family as IPv4
+    servaddr.sin_addr.s_addr = htons(INADDR_ANY);  //Sets the server's IP address
+    servaddr.sin_port = htons(port); //Specifies the port number on which the server will listen for incoming connections
+
+    // Associates the socket (listen_fd) with the specified address (servaddr) and port
+    if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+        fprintf(stderr, "Cannot bind socket (%s)\n", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    // Marks the socket as a passive socket that will be used to accept incoming connection requests
+    // 100 is the backlog parameter that specifies the maximum number of pending connections that can be queued
+    if (listen(listen_fd, 100) < 0) {
+        fprintf(stderr, "Cannot listen for incoming connections (%s)\n", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+static void *acceptor(void *arg) {
+    AcceptorArgs* args = (AcceptorArgs*)arg;
+
+    //Keeps this accept loop (and the sessions it runs inline) on its own core
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(args->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "Cannot pin acceptor to CPU %d\n", args->cpu);
+    }
+
+    args->accept_loop(args->listen_fd);
+    delete args;
+    return NULL;
+}
+
+//Makes the kernel pick the listener by the CPU that received the SYN, so each core accepts its own connections
+static bool attach_cpu_steering(int listen_fd, int num_listeners) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)num_listeners },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0) {
+        return true;
+    }
+    fprintf(stderr, "Cannot attach reuseport CPU steering program (%s)\n", strerror(errno));
+#endif
+    return false;
+}
+
+bool start_acceptors(int port, int num_listeners, bool steer, void (*accept_loop)(int listen_fd),
+                     vector<int>& listen_fds) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+
+    //Every socket must join the reuseport group before connections are steered between them
+    for (int i = 0; i < num_listeners; i++) {
+        int listen_fd = open_listener(port, true);
+        if (listen_fd < 0) {
+            return false;
+        }
+#ifdef SO_INCOMING_CPU
+        int cpu = i % num_cpus;
+        if (steer && setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+            fprintf(stderr, "Cannot set SO_INCOMING_CPU (%s)\n", strerror(errno));
+        }
+#endif
+        listen_fds.push_back(listen_fd);
+    }
+    if (steer) {
+        attach_cpu_steering(listen_fds[0], num_listeners);
+    }
+
+    for (int i = 0; i < num_listeners; i++) {
+        AcceptorArgs* args = new AcceptorArgs();
+        args->listen_fd = listen_fds[i];
+        args->cpu = i % num_cpus;
+        args->accept_loop = accept_loop;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, acceptor, args) != 0) {
+            fprintf(stderr, "Failed to create acceptor thread \n");
+            delete args;
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    return true;
+}
@@ -0,0 +1,14 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <vector>
+
+//Opens a TCP socket listening on port; with reuse_port several sockets can share the port
+int open_listener(int port, bool reuse_port);
+
+//Opens num_listeners SO_REUSEPORT sockets on port and runs accept_loop on each from its own thread,
+//pinned to its own core. With steer, connections are spread across the listeners by receiving CPU
+bool start_acceptors(int port, int num_listeners, bool steer, void (*accept_loop)(int listen_fd),
+                     std::vector<int>& listen_fds);
+
+#endif
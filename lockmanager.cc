@@ -0,0 +1,134 @@
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "lockmanager.h"
+
+using namespace std;
+
+namespace {
+
+//Each shard sits on its own cache line so threads locking different shards do not contend on the memory
+struct alignas(64) LockShard {
+    pthread_rwlock_t lock;
+    atomic<uint64_t> acquisitions;
+    atomic<uint64_t> contended;
+    atomic<uint64_t> wait_ns;
+
+    LockShard() : acquisitions(0), contended(0), wait_ns(0) {
+        pthread_rwlock_init(&lock, nullptr);
+    }
+};
+
+LockShard shards[NUM_LOCK_SHARDS];
+
+//The lock files this thread holds flocks on, by key; a lock is always released by the thread that took it
+thread_local vector<pair<string, int>> held_files;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//user.lock next to user.mbox. The mbox itself is not locked because it is replaced by a rename when it
+//is compacted, and a lock on the old file would exclude no one
+string lock_file_path(const string& key) {
+    size_t dot = key.rfind(".mbox");
+    if (dot != string::npos && dot + 5 == key.size()) {
+        return key.substr(0, dot) + ".lock";
+    }
+    return key + ".lock";
+}
+
+//Takes the flock that excludes the other server; returns how long it had to wait, 0 if it did not
+uint64_t lock_file(const string& key, LockMode mode) {
+    int fd = open(lock_file_path(key).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    uint64_t waited = 0;
+    if (fd >= 0) {
+        int operation = (mode == LOCK_SHARED) ? LOCK_SH : LOCK_EX;
+        if (flock(fd, operation | LOCK_NB) < 0) {
+            uint64_t start = now_ns();
+            while (flock(fd, operation) < 0 && errno == EINTR) {
+            }
+            waited = max(now_ns() - start, (uint64_t)1);
+        }
+    }
+    held_files.emplace_back(key, fd);
+    return waited;
+}
+
+}
+
+string mailbox_key(const string& mail_dir, string_view user) {
+    string key = mail_dir + "/";
+    key.append(user);
+    key += ".mbox";
+    return key;
+}
+
+size_t mailbox_shard(const string& key) {
+    return hash<string>()(key) % NUM_LOCK_SHARDS;
+}
+
+void lock_mailbox(const string& key, LockMode mode) {
+    LockShard& shard = shards[mailbox_shard(key)];
+    shard.acquisitions.fetch_add(1, memory_order_relaxed);
+
+    //Only an acquisition that has to wait is timed
+    int busy = (mode == LOCK_SHARED) ? pthread_rwlock_tryrdlock(&shard.lock) : pthread_rwlock_trywrlock(&shard.lock);
+    uint64_t waited = 0;
+    if (busy != 0) {
+        uint64_t start = now_ns();
+        if (mode == LOCK_SHARED) {
+            pthread_rwlock_rdlock(&shard.lock);
+        } else {
+            pthread_rwlock_wrlock(&shard.lock);
+        }
+        waited = now_ns() - start;
+    }
+
+    //Threads of this process are sorted out by the shard first, so the flock only ever waits for the
+    //other server
+    uint64_t file_wait = lock_file(key, mode);
+    if (busy != 0 || file_wait > 0) {
+        shard.contended.fetch_add(1, memory_order_relaxed);
+        shard.wait_ns.fetch_add(waited + file_wait, memory_order_relaxed);
+    }
+}
+
+void unlock_mailbox(const string& key) {
+    for (size_t i = held_files.size(); i-- > 0; ) {
+        if (held_files[i].first == key) {
+            if (held_files[i].second >= 0) {
+                close(held_files[i].second);
+            }
+            held_files.erase(held_files.begin() + i);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&shards[mailbox_shard(key)].lock);
+}
+
+LockStats lock_stats() {
+    LockStats stats = { 0, 0, 0 };
+    for (const LockShard& shard : shards) {
+        stats.acquisitions += shard.acquisitions.load(memory_order_relaxed);
+        stats.contended += shard.contended.load(memory_order_relaxed);
+        stats.wait_ns += shard.wait_ns.load(memory_order_relaxed);
+    }
+    return stats;
+}
+
+void print_lock_stats(FILE* out) {
+    LockStats stats = lock_stats();
+    fprintf(out, "Mailbox locks: %llu acquisitions, %llu waited, %.3f ms total wait\n",
+            (unsigned long long)stats.acquisitions, (unsigned long long)stats.contended, stats.wait_ns / 1e6);
+}
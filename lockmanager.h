@@ -0,0 +1,39 @@
+#ifndef LOCKMANAGER_H
+#define LOCKMANAGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+//Striped lock table for mailboxes, shared by both servers. Mailboxes hash onto a fixed number of shards,
+//so taking a lock costs the same however many mailboxes exist. Two mailboxes may share a shard.
+//The shard only excludes threads of one process, so a lock also takes a blocking flock on a lock file
+//next to the mbox (user.lock for user.mbox), which keeps the SMTP and POP3 servers apart. A lock is
+//released by the thread that took it
+
+const size_t NUM_LOCK_SHARDS = 256;
+
+enum LockMode {
+    LOCK_SHARED,        //Readers such as POP3 PASS and RETR
+    LOCK_EXCLUSIVE      //Writers such as SMTP delivery and POP3 QUIT
+};
+
+struct LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;     //Acquisitions that had to wait
+    uint64_t wait_ns;       //Total time spent waiting
+};
+
+//Canonical key for a user's mailbox, so every code path locks the same entry for it
+std::string mailbox_key(const std::string& mail_dir, std::string_view user);
+
+size_t mailbox_shard(const std::string& key);
+
+void lock_mailbox(const std::string& key, LockMode mode);
+void unlock_mailbox(const std::string& key);
+
+LockStats lock_stats();
+void print_lock_stats(FILE* out);
+
+#endif
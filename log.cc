@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+#include "log.h"
+
+using namespace std;
+
+LogLevel log_level = LEVEL_WARNING;
+
+namespace {
+
+const size_t RING_SLOTS = 256;
+const size_t MESSAGE_SIZE = 240;            //Longer messages are cut short
+
+struct LogRecord {
+    uint64_t time_ns;
+    uint32_t length;
+    uint32_t level;
+    char text[MESSAGE_SIZE];
+};
+
+//Single-producer single-consumer ring: only the owning thread advances head, only the flusher advances
+//tail. A thread that exits gives its ring up for the next new thread to take over
+struct LogRing {
+    alignas(64) atomic<uint64_t> head;
+    alignas(64) atomic<uint64_t> tail;
+    atomic<uint64_t> dropped;
+    atomic<bool> owned;
+    LogRing* next;
+    LogRecord records[RING_SLOTS];
+
+    LogRing() : head(0), tail(0), dropped(0), owned(true), next(nullptr) {}
+};
+
+struct RingOwner {
+    LogRing* ring;
+
+    ~RingOwner() {
+        if (ring != nullptr) {
+            ring->owned.store(false, memory_order_release);
+        }
+    }
+};
+
+atomic<LogRing*> rings(nullptr);            //Every ring ever created; they are reused, never freed
+atomic<bool> flusher_running(false);
+pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t reported_dropped = 0;
+thread_local RingOwner owner = { nullptr };
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+LogRing* thread_ring() {
+    if (owner.ring != nullptr) {
+        return owner.ring;
+    }
+    for (LogRing* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        bool owned = false;
+        if (ring->owned.compare_exchange_strong(owned, true, memory_order_acq_rel)) {
+            owner.ring = ring;
+            return ring;
+        }
+    }
+    LogRing* ring = new LogRing();
+    ring->next = rings.load(memory_order_relaxed);
+    while (!rings.compare_exchange_weak(ring->next, ring, memory_order_release, memory_order_relaxed)) {
+    }
+    owner.ring = ring;
+    return ring;
+}
+
+//Writes out every record in every ring, oldest first; returns how many there were
+size_t drain() {
+    pthread_mutex_lock(&drain_mutex);
+    vector<pair<LogRing*, uint64_t>> heads;
+    vector<LogRecord*> records;
+    uint64_t dropped = 0;
+    for (LogRing* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for (uint64_t i = tail; i < head; i++) {
+            records.push_back(&ring->records[i % RING_SLOTS]);
+        }
+        heads.push_back(make_pair(ring, head));
+        dropped += ring->dropped.load(memory_order_relaxed);
+    }
+
+    stable_sort(records.begin(), records.end(), [](const LogRecord* a, const LogRecord* b) {
+        return a->time_ns < b->time_ns;
+    });
+    string out;
+    for (const LogRecord* record : records) {
+        out.append(record->text, record->length);
+    }
+    if (dropped > reported_dropped) {
+        out += "Log: " + to_string(dropped - reported_dropped) + " messages dropped\n";
+        reported_dropped = dropped;
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stderr);
+        fflush(stderr);
+    }
+
+    for (const auto& [ring, head] : heads) {
+        ring->tail.store(head, memory_order_release);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+    return records.size();
+}
+
+void *flusher(void *arg) {
+    (void)arg;
+    while (true) {
+        if (drain() == 0) {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+}
+
+void log_write(LogLevel level, const char* format, ...) {
+    va_list args;
+    if (!flusher_running.load(memory_order_acquire)) {
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+
+    LogRing* ring = thread_ring();
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= RING_SLOTS) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    //The text is formatted here because the arguments (views into the session's buffers) do not outlive
+    //the call; the timestamp and level stay binary
+    LogRecord& record = ring->records[head % RING_SLOTS];
+    va_start(args, format);
+    int length = vsnprintf(record.text, sizeof(record.text), format, args);
+    va_end(args);
+    if (length < 0) {
+        length = 0;
+    } else if ((size_t)length >= sizeof(record.text)) {
+        length = sizeof(record.text) - 1;
+        memcpy(record.text + length - 4, "...\n", 4);
+    }
+    record.length = length;
+    record.level = level;
+    record.time_ns = now_ns();
+    ring->head.store(head + 1, memory_order_release);
+}
+
+void start_logger() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, flusher, NULL) != 0) {
+        fprintf(stderr, "Cannot start the log thread; logging synchronously\n");
+        return;
+    }
+    pthread_detach(thread);
+    flusher_running.store(true, memory_order_release);
+}
+
+void flush_log() {
+    if (flusher_running.load(memory_order_acquire)) {
+        drain();
+    }
+}
+
+uint64_t log_dropped() {
+    uint64_t dropped = 0;
+    for (LogRing* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        dropped += ring->dropped.load(memory_order_relaxed);
+    }
+    return dropped;
+}
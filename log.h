@@ -0,0 +1,33 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+//Asynchronous logging for both servers. Each thread formats its messages into its own lock-free ring and
+//a background thread writes them to stderr in the order they were logged. A message that finds its ring
+//full is dropped and counted rather than making the session wait
+
+enum LogLevel {
+    LEVEL_DEBUG,        //Every command and reply
+    LEVEL_INFO,         //Connections opening and closing, messages queued
+    LEVEL_WARNING,      //Failures confined to one session, such as a client that went away
+    LEVEL_ERROR         //Failures of the server itself, such as a mailbox that cannot be written
+};
+
+//Messages below this level are skipped before they are formatted. -v lowers it to LEVEL_DEBUG
+extern LogLevel log_level;
+
+#define LOG(level, ...) do { if ((level) >= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+void log_write(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+//Starts the thread that writes the rings out; until then messages go straight to stderr
+void start_logger();
+
+//Writes out everything logged so far, e.g. before the process exits
+void flush_log();
+
+//Messages dropped because their ring was full
+uint64_t log_dropped();
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <vector>
+#include "mailwriter.h"
+#include "log.h"
+#include "lockmanager.h"
+#include "mboxindex.h"
+#include "mboxcompact.h"
+
+using namespace std;
+
+namespace {
+
+struct PendingAppend {
+    const string* mbox_path;
+    const MailboxAppend* message;
+    bool done;
+    bool ok;
+};
+
+//Appends waiting for the mailboxes of one lock shard. The first session to arrive leads the batch; the others
+//wait for its commit. A fixed array keyed like the lock table, so finding the queue never needs a lookup
+struct alignas(64) CommitQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t committed;
+    vector<PendingAppend*> pending;
+    bool leader_active;
+
+    CommitQueue() : leader_active(false) {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&committed, nullptr);
+    }
+};
+
+CommitQueue queues[NUM_LOCK_SHARDS];
+
+bool write_all(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+//Writes every queued iovec with as few writev calls as IOV_MAX allows, then empties the list
+bool writev_all(int fd, vector<struct iovec>& iov) {
+    size_t index = 0;
+    while (index < iov.size()) {
+        int count = (int)min(iov.size() - index, (size_t)IOV_MAX);
+        ssize_t n = writev(fd, &iov[index], count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            iov.clear();
+            return false;
+        }
+        //Skips the entries written completely and trims one that was written in part
+        while (index < iov.size() && (size_t)n >= iov[index].iov_len) {
+            n -= iov[index].iov_len;
+            index++;
+        }
+        if (n > 0) {
+            iov[index].iov_base = (char*)iov[index].iov_base + n;
+            iov[index].iov_len -= n;
+        }
+    }
+    iov.clear();
+    return true;
+}
+
+//Appends a batch of messages to one mbox with a single open, (mostly) a single writev and, if the policy
+//asks for it, a single fdatasync
+bool write_batch(const string& mbox_path, const vector<const MailboxAppend*>& batch) {
+    lock_mailbox(mbox_path, LOCK_EXCLUSIVE);
+    //Mail must not land behind a POP3 compaction that a crash cut short
+    recover_compaction(mbox_path);
+    //The mbox is opened only once the lock is held, since the POP3 compactor may have renamed a new one
+    //into place while this thread waited; it is checked against the path all the same, as mail appended
+    //to a replaced mbox would be lost without an error
+    int fd;
+    while (true) {
+        fd = open(mbox_path.c_str(), O_WRONLY | O_APPEND);
+        if (fd < 0) {
+            LOG(LEVEL_ERROR, "Cannot open %s (%s)\n", mbox_path.c_str(), strerror(errno));
+            unlock_mailbox(mbox_path);
+            return false;
+        }
+        //An mbox that can no longer be found at its path may have been removed, so nothing is appended
+        struct stat fd_st;
+        struct stat path_st;
+        if (fstat(fd, &fd_st) < 0 || stat(mbox_path.c_str(), &path_st) < 0) {
+            LOG(LEVEL_ERROR, "Cannot check %s (%s)\n", mbox_path.c_str(), strerror(errno));
+            close(fd);
+            unlock_mailbox(mbox_path);
+            return false;
+        }
+        if (fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino) {
+            break;
+        }
+        close(fd);
+    }
+    //Where the batch starts; nothing else can append while the mailbox is held exclusively
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    bool have_end = ok;
+    uint64_t mbox_end = ok ? st.st_size : 0;
+
+    vector<struct iovec> iov;
+    vector<IndexRecord> records(batch.size());
+    uint64_t offset = mbox_end;
+    for (size_t i = 0; ok && i < batch.size(); i++) {
+        const MailboxAppend* message = batch[i];
+        IndexRecord& record = records[i];
+        MessageDigest digest;
+        memset(&record, 0, sizeof(record));
+        record.offset = offset;
+        record.header_length = message->header->size();
+        iov.push_back({ (void*)message->header->data(), message->header->size() });
+
+        //The index identifies a message by the octets POP3 serves, which for a reference are the blob's
+        string blob = blob_path(mbox_path, *message->header);
+        if (!blob.empty()) {
+            record.flags = INDEX_BLOB;
+            digest.updateFromFile(blob);
+        }
+        size_t body_length = 0;
+        if (message->spool_fd >= 0) {
+            //A spooled body is copied through a bounded buffer after everything queued before it
+            ok = writev_all(fd, iov);
+            char buffer[65536];
+            off_t spool_offset = 0;
+            ssize_t n;
+            while (ok && (n = pread(message->spool_fd, buffer, sizeof(buffer), spool_offset)) > 0) {
+                ok = write_all(fd, buffer, n);
+                digest.update(buffer, n);
+                spool_offset += n;
+            }
+            ok = ok && n == 0;
+            body_length += spool_offset;
+        }
+        if (message->body != nullptr && !message->body->empty()) {
+            iov.push_back({ (void*)message->body->data(), message->body->size() });
+            digest.update(message->body->data(), message->body->size());
+            body_length += message->body->size();
+        }
+        record.length = record.header_length + body_length;
+        digest.finish(record);
+        seal_record(record);
+        offset += record.length;
+    }
+    ok = ok && writev_all(fd, iov);
+    if (ok && fsync_policy != FSYNC_NONE && fdatasync(fd) < 0) {
+        ok = false;
+    }
+
+    //The index is only a cache of the mbox, so it is not synced; a reader that finds it behind rebuilds it
+    if (ok) {
+        append_index(mbox_path, mbox_end, records);
+    } else {
+        LOG(LEVEL_ERROR, "Cannot append to %s (%s)\n", mbox_path.c_str(), strerror(errno));
+        //A partly written batch is cut off, so the index still ends where the mbox does and the next
+        //message does not run into a broken one
+        if (have_end && ftruncate(fd, mbox_end) < 0) {
+            LOG(LEVEL_ERROR, "Cannot truncate %s (%s)\n", mbox_path.c_str(), strerror(errno));
+        }
+    }
+
+    close(fd);
+    unlock_mailbox(mbox_path);
+    return ok;
+}
+
+}
+
+bool parse_fsync_policy(const char* name, FsyncPolicy& policy) {
+    if (strcmp(name, "none") == 0) {
+        policy = FSYNC_NONE;
+    } else if (strcmp(name, "message") == 0) {
+        policy = FSYNC_MESSAGE;
+    } else if (strcmp(name, "group") == 0) {
+        policy = FSYNC_GROUP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool append_to_mailbox(const string& mbox_path, const MailboxAppend& message) {
+    if (fsync_policy != FSYNC_GROUP) {
+        vector<const MailboxAppend*> batch(1, &message);
+        return write_batch(mbox_path, batch);
+    }
+
+    CommitQueue* queue = &queues[mailbox_shard(mbox_path)];
+    PendingAppend self = { &mbox_path, &message, false, false };
+    pthread_mutex_lock(&queue->mutex);
+    queue->pending.push_back(&self);
+    while (!self.done) {
+        if (queue->leader_active) {
+            pthread_cond_wait(&queue->committed, &queue->mutex);
+            continue;
+        }
+
+        //Leads the next batch: waits out the window so appends from other sessions can join it
+        queue->leader_active = true;
+        if (group_commit_window_us > 0) {
+            pthread_mutex_unlock(&queue->mutex);
+            usleep(group_commit_window_us);
+            pthread_mutex_lock(&queue->mutex);
+        }
+        vector<PendingAppend*> batch;
+        batch.swap(queue->pending);
+        pthread_mutex_unlock(&queue->mutex);
+
+        //The shard's batch may hold several mailboxes; each gets one write and one fdatasync
+        vector<bool> results(batch.size());
+        vector<bool> written(batch.size(), false);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (written[i]) {
+                continue;
+            }
+            vector<size_t> members;
+            vector<const MailboxAppend*> messages;
+            for (size_t j = i; j < batch.size(); j++) {
+                if (!written[j] && *batch[j]->mbox_path == *batch[i]->mbox_path) {
+                    members.push_back(j);
+                    messages.push_back(batch[j]->message);
+                    written[j] = true;
+                }
+            }
+            bool ok = write_batch(*batch[i]->mbox_path, messages);
+            for (size_t member : members) {
+                results[member] = ok;
+            }
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i]->ok = results[i];
+            batch[i]->done = true;
+        }
+        queue->leader_active = false;
+        pthread_cond_broadcast(&queue->committed);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return self.ok;
+}
+
+bool append_batch_to_mailbox(const string& mbox_path, const vector<MailboxAppend>& messages) {
+    vector<const MailboxAppend*> batch;
+    for (const MailboxAppend& message : messages) {
+        batch.push_back(&message);
+    }
+    return write_batch(mbox_path, batch);
+}
+
+bool sync_for_policy(int fd) {
+    return fsync_policy == FSYNC_NONE || fdatasync(fd) == 0;
+}
@@ -0,0 +1,38 @@
+#ifndef MAILWRITER_H
+#define MAILWRITER_H
+
+#include <string>
+#include <vector>
+
+//How appended mail is made durable before the client is told it was accepted (see smtp -f)
+enum FsyncPolicy {
+    FSYNC_NONE,         //Left to the page cache
+    FSYNC_MESSAGE,      //One fdatasync per mailbox append
+    FSYNC_GROUP         //Appends to the same mailbox from concurrent sessions share one write and fdatasync
+};
+
+extern FsyncPolicy fsync_policy;
+extern int group_commit_window_us;     //How long a group leader waits for other appends to join its batch
+
+//One message to append to an mbox: its From line, then the body, read from spool_fd (when >= 0)
+//followed by body (when not null)
+struct MailboxAppend {
+    const std::string* header;
+    int spool_fd;
+    const std::string* body;
+};
+
+//Parses none, message or group
+bool parse_fsync_policy(const char* name, FsyncPolicy& policy);
+
+//Appends message to the mbox at mbox_path and returns once it is as durable as fsync_policy asks
+bool append_to_mailbox(const std::string& mbox_path, const MailboxAppend& message);
+
+//Appends several messages to the mbox at mbox_path with one write and, unless the policy is none, one
+//fdatasync. Used by the delivery workers, which batch by mailbox themselves
+bool append_batch_to_mailbox(const std::string& mbox_path, const std::vector<MailboxAppend>& messages);
+
+//Syncs a file other than a mailbox, such as a stored blob, when the policy asks for durability
+bool sync_for_policy(int fd);
+
+#endif
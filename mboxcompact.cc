@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "mboxcompact.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+//Ends the journal once the tail in front of it is complete; a journal without it is discarded
+struct TailTrailer {
+    char magic[8];
+    uint64_t prefix_end;        //Where the tail goes back into the mbox
+};
+
+const char TAIL_MAGIC[8] = { 'M', 'B', 'O', 'X', 'T', 'A', 'I', 'L' };
+
+//A run of kept messages that sit next to each other in the old mbox
+struct Range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+//Puts the tail saved in the journal back at prefix_end and cuts the mbox off after it. Running it again
+//after it was interrupted gives the same mbox
+bool apply_journal(int mbox_fd, int journal_fd, uint64_t tail_length, uint64_t prefix_end) {
+    return copy_range(journal_fd, 0, mbox_fd, prefix_end, tail_length) &&
+           ftruncate(mbox_fd, prefix_end + tail_length) == 0 && fdatasync(mbox_fd) == 0;
+}
+
+//Makes a file just created next to the mbox survive a crash
+bool sync_directory(const string& mbox_path) {
+    size_t slash = mbox_path.rfind('/');
+    string directory = (slash == string::npos) ? string(".") : mbox_path.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool compact_tail(const string& mbox_path, int mbox_fd, uint64_t prefix_end, const vector<Range>& tail,
+                  uint64_t tail_length) {
+    //Only the last messages were deleted, which truncating takes care of at once
+    if (tail_length == 0) {
+        return ftruncate(mbox_fd, prefix_end) == 0 && fdatasync(mbox_fd) == 0;
+    }
+
+    string journal_path = sibling_path(mbox_path, ".tail");
+    int journal_fd = open(journal_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (journal_fd < 0) {
+        return false;
+    }
+    uint64_t offset = 0;
+    bool ok = true;
+    for (const Range& range : tail) {
+        ok = ok && copy_range(mbox_fd, range.offset, journal_fd, offset, range.length);
+        offset += range.length;
+    }
+    TailTrailer trailer;
+    memcpy(trailer.magic, TAIL_MAGIC, sizeof(TAIL_MAGIC));
+    trailer.prefix_end = prefix_end;
+    ok = ok && pwrite(journal_fd, &trailer, sizeof(trailer), offset) == sizeof(trailer) && fdatasync(journal_fd) == 0;
+    //The journal's directory entry has to be on disk too before the mbox is overwritten, or a crash
+    //could leave a half-applied mbox with nothing to recover it from
+    ok = ok && sync_directory(mbox_path);
+    if (!ok) {
+        //The mbox has not been touched yet
+        close(journal_fd);
+        unlink(journal_path.c_str());
+        return false;
+    }
+
+    ok = apply_journal(mbox_fd, journal_fd, tail_length, prefix_end);
+    close(journal_fd);
+    if (ok) {
+        unlink(journal_path.c_str());
+    }
+    return ok;
+}
+
+bool rewrite_mbox(const string& mbox_path, int mbox_fd, uint64_t prefix_end, const vector<Range>& tail) {
+    string temp_path = sibling_path(mbox_path, ".temp");
+    int temp_fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (temp_fd < 0) {
+        return false;
+    }
+    bool ok = copy_range(mbox_fd, 0, temp_fd, 0, prefix_end);
+    uint64_t offset = prefix_end;
+    for (const Range& range : tail) {
+        ok = ok && copy_range(mbox_fd, range.offset, temp_fd, offset, range.length);
+        offset += range.length;
+    }
+    ok = ok && fdatasync(temp_fd) == 0;
+    ok = close(temp_fd) == 0 && ok;
+    if (!ok || rename(temp_path.c_str(), mbox_path.c_str()) < 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+string sibling_path(const string& mbox_path, const char* extension) {
+    size_t dot = mbox_path.rfind(".mbox");
+    if (dot != string::npos && dot + 5 == mbox_path.size()) {
+        return mbox_path.substr(0, dot) + extension;
+    }
+    return mbox_path + extension;
+}
+
+bool copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length) {
+    bool use_buffer = false;
+    while (length > 0) {
+        ssize_t n;
+        if (!use_buffer) {
+            loff_t in_position = in_offset;
+            loff_t out_position = out_offset;
+            n = copy_file_range(in_fd, &in_position, out_fd, &out_position, length, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                use_buffer = true;
+                continue;
+            }
+        } else {
+            char buffer[65536];
+            n = pread(in_fd, buffer, min(length, (uint64_t)sizeof(buffer)), in_offset);
+            if (n > 0 && pwrite(out_fd, buffer, n, out_offset) != n) {
+                n = -1;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool recover_compaction(const string& mbox_path) {
+    string journal_path = sibling_path(mbox_path, ".tail");
+    int journal_fd = open(journal_path.c_str(), O_RDONLY);
+    if (journal_fd < 0) {
+        return errno == ENOENT;
+    }
+
+    struct stat st;
+    TailTrailer trailer;
+    bool complete = fstat(journal_fd, &st) == 0 && st.st_size >= (off_t)sizeof(trailer) &&
+                    pread(journal_fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+                    memcmp(trailer.magic, TAIL_MAGIC, sizeof(TAIL_MAGIC)) == 0;
+    bool ok = true;
+    if (complete) {
+        //The index no longer matches what the mbox becomes and is rebuilt by the next reader
+        int mbox_fd = open(mbox_path.c_str(), O_RDWR);
+        ok = mbox_fd >= 0 && apply_journal(mbox_fd, journal_fd, st.st_size - sizeof(trailer), trailer.prefix_end);
+        if (mbox_fd >= 0) {
+            close(mbox_fd);
+        }
+        LOG(ok ? LEVEL_INFO : LEVEL_ERROR, "%s interrupted compaction of %s\n", ok ? "Finished" : "Cannot finish",
+            mbox_path.c_str());
+    }
+    close(journal_fd);
+    if (ok) {
+        unlink(journal_path.c_str());
+    }
+    return ok;
+}
+
+bool compact_mailbox(const string& mbox_path, int mbox_fd, const vector<IndexRecord>& records,
+                     const vector<bool>& keep, bool in_place) {
+    size_t first = 0;
+    while (first < records.size() && keep[first]) {
+        first++;
+    }
+    if (first == records.size()) {
+        return true;
+    }
+
+    //Everything before the first deleted message stays where it is, and so do its records
+    uint64_t prefix_end = records[first].offset;
+    vector<IndexRecord> kept(records.begin(), records.begin() + first);
+    vector<Range> tail;
+    uint64_t tail_length = 0;
+    for (size_t i = first + 1; i < records.size(); i++) {
+        if (!keep[i]) {
+            continue;
+        }
+        IndexRecord record = records[i];
+        if (!tail.empty() && tail.back().offset + tail.back().length == record.offset) {
+            tail.back().length += record.length;
+        } else {
+            tail.push_back({ record.offset, record.length });
+        }
+        record.offset = prefix_end + tail_length;
+        seal_record(record);
+        kept.push_back(record);
+        tail_length += record.length;
+    }
+
+    //Saving the tail and copying it back writes it twice, which only pays while it is the smaller part
+    bool ok = (in_place && tail_length <= prefix_end)
+              ? compact_tail(mbox_path, mbox_fd, prefix_end, tail, tail_length)
+              : rewrite_mbox(mbox_path, mbox_fd, prefix_end, tail);
+    if (!ok) {
+        LOG(LEVEL_ERROR, "Cannot compact %s (%s)\n", mbox_path.c_str(), strerror(errno));
+        return false;
+    }
+    if (!write_index(mbox_path, kept)) {
+        unlink(index_path(mbox_path).c_str());
+    }
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef MBOXCOMPACT_H
+#define MBOXCOMPACT_H
+
+#include <string>
+#include <vector>
+#include "mboxindex.h"
+
+//Removing deleted messages from an mbox. Messages before the first deleted one are never touched. The
+//messages kept after it (the tail) are first saved to a journal next to the mbox, user.tail, and then
+//copied back over the gap with copy_file_range before the mbox is truncated, so an interrupted
+//compaction is finished from the journal the next time the mailbox is opened. When other sessions
+//still read from the mbox, or the tail is larger than what precedes it, the kept messages are copied
+//to a new file that is renamed over the mbox instead
+
+//A file kept next to the mbox, such as user.tail for user.mbox
+std::string sibling_path(const std::string& mbox_path, const char* extension);
+
+//Copies length bytes from one file to another within the kernel, and through a buffer where
+//copy_file_range does not work between the two files
+bool copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length);
+
+//Finishes a compaction that was interrupted, if there is one. The caller holds the mailbox exclusively,
+//which also locks out the other server (see lock_mailbox), so a journal is never applied or removed
+//while a compaction is still writing it. Called before the mbox is read or appended to
+bool recover_compaction(const std::string& mbox_path);
+
+//Removes the messages whose keep flag is false from the mbox open read-write on mbox_fd, whose messages
+//are records, and replaces the index. in_place allows the mbox file itself to be rewritten; only
+//allowed when no one else is reading from it. The caller holds the mailbox exclusively
+bool compact_mailbox(const std::string& mbox_path, int mbox_fd, const std::vector<IndexRecord>& records,
+                     const std::vector<bool>& keep, bool in_place);
+
+#endif
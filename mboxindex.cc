@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "mboxindex.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    char reserved[48];
+};
+
+static_assert(sizeof(IndexHeader) == 64, "the index header is 64 bytes");
+
+const char INDEX_MAGIC[8] = { 'M', 'B', 'O', 'X', 'I', 'D', 'X', '\n' };
+const uint32_t INDEX_VERSION = 2;     //2 added INDEX_DOT_LINES; older indexes are rebuilt
+
+IndexHeader make_header() {
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.record_size = sizeof(IndexRecord);
+    return header;
+}
+
+//FNV-1a; enough to catch torn or stale records, which is all the checksum is for
+uint32_t record_checksum(const IndexRecord& record) {
+    const unsigned char* bytes = (const unsigned char*)&record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(IndexRecord, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool write_all(int fd, const void* data, size_t length) {
+    const char* buffer = (const char*)data;
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+//Checks a mapped index against an mbox of mbox_size bytes: a known header, every record intact, and
+//records that follow each other without gaps up to the end of the mbox
+bool valid_index(const char* data, size_t length, uint64_t mbox_size) {
+    IndexHeader expected = make_header();
+    if (length < sizeof(IndexHeader) || (length - sizeof(IndexHeader)) % sizeof(IndexRecord) != 0 ||
+        memcmp(data, &expected, offsetof(IndexHeader, reserved)) != 0) {
+        return false;
+    }
+    const IndexRecord* records = (const IndexRecord*)(data + sizeof(IndexHeader));
+    size_t count = (length - sizeof(IndexHeader)) / sizeof(IndexRecord);
+    if (count == 0) {
+        return mbox_size == 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].checksum != record_checksum(records[i]) ||
+            records[i].header_length > records[i].length ||
+            (i > 0 && records[i].offset != records[i - 1].offset + records[i - 1].length)) {
+            return false;
+        }
+    }
+    return records[count - 1].offset + records[count - 1].length == mbox_size;
+}
+
+//Rebuilds the records by reading the whole mbox, the way POP3 listed a mailbox before there was an index
+bool scan_mbox(const string& mbox_path, int mbox_fd, vector<IndexRecord>& records) {
+    MappedMbox mbox;
+    if (!mbox.map(mbox_fd)) {
+        return false;
+    }
+    vector<MboxSpan> spans;
+    find_messages(mbox.data(), mbox.size(), spans);
+
+    records.clear();
+    records.reserve(spans.size());
+    for (const MboxSpan& span : spans) {
+        records.push_back(index_span(mbox_path, mbox.data(), span));
+        seal_record(records.back());
+    }
+    return true;
+}
+
+}
+
+string index_path(const string& mbox_path) {
+    size_t dot = mbox_path.rfind(".mbox");
+    if (dot != string::npos && dot + 5 == mbox_path.size()) {
+        return mbox_path.substr(0, dot) + ".idx";
+    }
+    return mbox_path + ".idx";
+}
+
+string_view blob_name(string_view from_line) {
+    size_t end = from_line.find_last_not_of("\r\n");
+    size_t pos = from_line.rfind(" blob=");
+    if (end == string_view::npos || pos == string_view::npos || end + 1 - (pos + 6) != 64) {
+        return string_view();
+    }
+    string_view name = from_line.substr(pos + 6, 64);
+    if (name.find_first_not_of("0123456789abcdef") != string_view::npos) {
+        return string_view();
+    }
+    return name;
+}
+
+string blob_path(const string& mbox_path, string_view from_line) {
+    string_view name = blob_name(from_line);
+    if (name.empty()) {
+        return string();
+    }
+    size_t slash = mbox_path.rfind('/');
+    string directory = (slash == string::npos) ? string(".") : mbox_path.substr(0, slash);
+    return directory + "/blobs/" + string(name);
+}
+
+MessageDigest::MessageDigest() : context(EVP_MD_CTX_new()), octets(0), line_start(true), dot_lines(false) {
+    EVP_DigestInit_ex((EVP_MD_CTX*)context, EVP_md5(), nullptr);
+}
+
+MessageDigest::~MessageDigest() {
+    EVP_MD_CTX_free((EVP_MD_CTX*)context);
+}
+
+void MessageDigest::update(const void* data, size_t length) {
+    EVP_DigestUpdate((EVP_MD_CTX*)context, data, length);
+    octets += length;
+    if (length == 0) {
+        return;
+    }
+
+    //Looks for a dot after every newline; a line can span updates, so line_start carries over
+    const char* bytes = (const char*)data;
+    const char* end = bytes + length;
+    dot_lines = dot_lines || (line_start && bytes[0] == '.');
+    for (const char* p = bytes; !dot_lines && (p = (const char*)memchr(p, '\n', end - p)) != nullptr && ++p < end;) {
+        dot_lines = *p == '.';
+    }
+    line_start = end[-1] == '\n';
+}
+
+bool MessageDigest::updateFromFile(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        update(buffer, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+void MessageDigest::finish(IndexRecord& record) {
+    unsigned int length = 0;
+    EVP_DigestFinal_ex((EVP_MD_CTX*)context, record.uid, &length);
+    record.size = octets;
+    if (dot_lines) {
+        record.flags |= INDEX_DOT_LINES;
+    }
+}
+
+IndexRecord index_span(const string& mbox_path, const char* mbox_data, const MboxSpan& span) {
+    IndexRecord record;
+    memset(&record, 0, sizeof(record));
+    record.offset = span.offset;
+    record.length = span.length;
+    record.header_length = span.header_length;
+
+    MessageDigest digest;
+    string blob = blob_path(mbox_path, string_view(mbox_data + span.offset, span.header_length));
+    if (!blob.empty()) {
+        record.flags = INDEX_BLOB;
+        if (!digest.updateFromFile(blob)) {
+            LOG(LEVEL_ERROR, "Missing message blob %s\n", blob.c_str());
+        }
+    }
+    digest.update(mbox_data + span.offset + span.header_length, span.length - span.header_length);
+    digest.finish(record);
+    return record;
+}
+
+void seal_record(IndexRecord& record) {
+    record.checksum = record_checksum(record);
+}
+
+bool append_index(const string& mbox_path, uint64_t mbox_end, const vector<IndexRecord>& records) {
+    string path = index_path(mbox_path);
+    int fd = open(path.c_str(), O_RDWR | ((mbox_end == 0) ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+
+    //Only an index that ends exactly where the mbox did can be extended
+    off_t end = ok ? st.st_size : 0;
+    if (ok && end < (off_t)sizeof(IndexHeader)) {
+        ok = mbox_end == 0 && ftruncate(fd, 0) == 0;
+        IndexHeader header = make_header();
+        ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+        end = sizeof(IndexHeader);
+    } else if (ok) {
+        IndexRecord last;
+        uint64_t covered = 0;
+        if (end > (off_t)sizeof(IndexHeader) &&
+            pread(fd, &last, sizeof(last), end - sizeof(last)) == sizeof(last)) {
+            covered = last.offset + last.length;
+        }
+        ok = covered == mbox_end && (end - sizeof(IndexHeader)) % sizeof(IndexRecord) == 0;
+    }
+
+    ok = ok && lseek(fd, end, SEEK_SET) == end &&
+         write_all(fd, records.data(), records.size() * sizeof(IndexRecord));
+    close(fd);
+    return ok;
+}
+
+bool load_index(const string& mbox_path, int mbox_fd, vector<IndexRecord>& records) {
+    struct stat mbox_st;
+    if (fstat(mbox_fd, &mbox_st) < 0) {
+        return false;
+    }
+
+    string path = index_path(mbox_path);
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            bool valid = valid_index((const char*)data, st.st_size, mbox_st.st_size);
+            if (valid) {
+                const IndexRecord* first = (const IndexRecord*)((const char*)data + sizeof(IndexHeader));
+                records.assign(first, first + (st.st_size - sizeof(IndexHeader)) / sizeof(IndexRecord));
+            }
+            munmap(data, st.st_size);
+            if (valid) {
+                close(fd);
+                return true;
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    LOG(LEVEL_INFO, "Rebuilding index %s\n", path.c_str());
+    if (!scan_mbox(mbox_path, mbox_fd, records)) {
+        return false;
+    }
+    if (!write_index(mbox_path, records)) {
+        LOG(LEVEL_WARNING, "Cannot write index %s (%s)\n", path.c_str(), strerror(errno));
+    }
+    return true;
+}
+
+bool write_index(const string& mbox_path, const vector<IndexRecord>& records) {
+    //Written aside and renamed over the old index, so readers never map a half-written one
+    string path = index_path(mbox_path);
+    string temp_path = path + ".XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        return false;
+    }
+    IndexHeader header = make_header();
+    bool ok = fchmod(fd, 0644) == 0 && write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, records.data(), records.size() * sizeof(IndexRecord));
+    close(fd);
+    if (!ok || rename(temp_path.c_str(), path.c_str()) < 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+string uid_string(const unsigned char uid[16]) {
+    static const char hex_digits[] = "0123456789abcdef";
+    string text(32, '0');
+    for (int i = 0; i < 16; i++) {
+        text[2 * i] = hex_digits[uid[i] >> 4];
+        text[2 * i + 1] = hex_digits[uid[i] & 0xf];
+    }
+    return text;
+}
@@ -0,0 +1,77 @@
+#ifndef MBOXINDEX_H
+#define MBOXINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "mboxparser.h"
+
+//Sidecar index of an mbox, user.idx next to user.mbox, shared by both servers. Delivery appends one
+//fixed-size record per message while it holds the mailbox lock, so POP3 can list a mailbox by mapping
+//the index instead of reading and hashing every message. A reader that finds the index missing or not
+//matching the mbox rebuilds it from the mbox
+
+const uint32_t INDEX_BLOB = 1;      //The message body is a reference to a stored blob (see smtp -b)
+const uint32_t INDEX_DOT_LINES = 2; //Some line of the message starts with a dot, so RETR has to stuff it
+
+struct IndexRecord {
+    uint64_t offset;                //Of the message's From line in the mbox
+    uint64_t length;                //From line and body, as stored in the mbox
+    uint32_t header_length;         //From line, including its newline
+    uint32_t flags;
+    uint64_t size;                  //Octets POP3 serves for the message
+    unsigned char uid[16];          //MD5 of those octets; its hex form is the message's UIDL
+    uint32_t reserved[3];
+    uint32_t checksum;              //Of the bytes before it
+};
+
+static_assert(sizeof(IndexRecord) == 64, "index records are 64 bytes");
+
+std::string index_path(const std::string& mbox_path);
+
+//Name of the blob a From line refers to, or an empty view for a message stored in the mbox
+std::string_view blob_name(std::string_view from_line);
+
+//Path of the blob a From line refers to, or an empty string for a message stored in the mbox
+std::string blob_path(const std::string& mbox_path, std::string_view from_line);
+
+//Fills in a record's UID and dot-lines flag from the octets of a message fed to it in order
+class MessageDigest {
+private:
+    void* context;
+    uint64_t octets;
+    bool line_start;
+    bool dot_lines;
+
+public:
+    MessageDigest();
+    ~MessageDigest();
+    void update(const void* data, size_t length);
+    bool updateFromFile(const std::string& path);
+    void finish(IndexRecord& record);
+};
+
+//Builds the record of a message found in a mapped mbox; the caller seals it once its offset is final
+IndexRecord index_span(const std::string& mbox_path, const char* mbox_data, const MboxSpan& span);
+
+//Sets a record's checksum
+void seal_record(IndexRecord& record);
+
+//Appends the records of messages just written at the end of the mbox, where mbox_end was the mbox size
+//before they were written. The caller holds the mailbox exclusively. An index that is missing for a
+//non-empty mbox or does not end where the mbox did is left alone for the next reader to rebuild
+bool append_index(const std::string& mbox_path, uint64_t mbox_end, const std::vector<IndexRecord>& records);
+
+//Reads the index of the mbox open on mbox_fd, or rebuilds and rewrites it if it is missing, damaged or
+//does not cover the mbox exactly. The caller holds the mailbox at least shared
+bool load_index(const std::string& mbox_path, int mbox_fd, std::vector<IndexRecord>& records);
+
+//Replaces the index with records, for instance after the mbox was rewritten
+bool write_index(const std::string& mbox_path, const std::vector<IndexRecord>& records);
+
+//Hex form of a UID, as UIDL shows it
+std::string uid_string(const unsigned char uid[16]);
+
+#endif
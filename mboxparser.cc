@@ -0,0 +1,143 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mboxparser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace std;
+
+namespace {
+
+bool starts_message(const char* data, size_t length, size_t newline) {
+    return newline + 6 <= length && memcmp(data + newline + 1, "From ", 5) == 0;
+}
+
+#ifdef HAVE_X86_SIMD
+
+//Compares 32 positions at once for a newline followed by 'F', and only checks the rest of "From " at
+//the positions where both match, which in mail text is rare
+__attribute__((target("avx2")))
+size_t find_boundary_avx2(const char* data, size_t length, size_t start) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i capital_f = _mm256_set1_epi8('F');
+    size_t i = start;
+    while (i + 33 <= length) {
+        __m256i here = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i next = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(here, newline),
+                                                               _mm256_cmpeq_epi8(next, capital_f)));
+        while (mask != 0) {
+            size_t position = i + __builtin_ctz(mask);
+            if (starts_message(data, length, position)) {
+                return position;
+            }
+            mask &= mask - 1;
+        }
+        i += 32;
+    }
+    return find_boundary_memchr(data, length, i);
+}
+
+typedef size_t (*BoundarySearch)(const char*, size_t, size_t);
+
+BoundarySearch pick_boundary_search() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? find_boundary_avx2 : find_boundary_memchr;
+}
+
+#endif
+
+}
+
+MappedMbox::MappedMbox() : mapping(nullptr), length(0) {}
+
+MappedMbox::~MappedMbox() {
+    if (mapping != nullptr) {
+        munmap((void*)mapping, length);
+    }
+}
+
+bool MappedMbox::map(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    mapping = (const char*)data;
+    length = st.st_size;
+    return true;
+}
+
+size_t find_boundary_memchr(const char* data, size_t length, size_t start) {
+    size_t i = start;
+    while (i < length) {
+        const char* found = (const char*)memchr(data + i, '\n', length - i);
+        if (found == nullptr) {
+            break;
+        }
+        size_t position = found - data;
+        if (starts_message(data, length, position)) {
+            return position;
+        }
+        i = position + 1;
+    }
+    return length;
+}
+
+#ifdef HAVE_X86_SIMD
+
+size_t find_boundary(const char* data, size_t length, size_t start) {
+    static const BoundarySearch search = pick_boundary_search();
+    return search(data, length, start);
+}
+
+#else
+
+size_t find_boundary(const char* data, size_t length, size_t start) {
+    return find_boundary_memchr(data, length, start);
+}
+
+#endif
+
+void find_messages(const char* data, size_t length, vector<MboxSpan>& spans) {
+    size_t start = 0;
+    if (length < 5 || memcmp(data, "From ", 5) != 0) {
+        size_t boundary = find_boundary(data, length, 0);
+        if (boundary == length) {
+            return;
+        }
+        start = boundary + 1;
+    }
+    size_t prelude = start;
+    bool first = true;
+
+    while (start < length) {
+        size_t boundary = find_boundary(data, length, start);
+        size_t end = (boundary == length) ? length : boundary + 1;
+        const char* newline = (const char*)memchr(data + start, '\n', end - start);
+
+        MboxSpan span;
+        span.offset = start;
+        span.length = end - start;
+        span.header_length = (newline != nullptr) ? newline - (data + start) + 1 : end - start;
+        if (first) {
+            span.offset -= prelude;
+            span.length += prelude;
+            span.header_length += prelude;
+            first = false;
+        }
+        spans.push_back(span);
+        start = end;
+    }
+}
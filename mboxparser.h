@@ -0,0 +1,43 @@
+#ifndef MBOXPARSER_H
+#define MBOXPARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//The one mbox parser both servers use: the mbox is mapped rather than read, and message boundaries are
+//found by scanning for "\nFrom " 32 bytes at a time with AVX2 where the CPU has it (memchr otherwise).
+//Messages come back as byte ranges of the mapping; nothing is copied
+
+//One message: its From line followed by its body
+struct MboxSpan {
+    uint64_t offset;            //Of the From line
+    uint64_t length;            //From line and body
+    uint32_t header_length;     //From line, including its newline
+};
+
+//A read-only mapping of a whole mbox; an empty mbox maps to no data
+class MappedMbox {
+private:
+    const char* mapping;
+    size_t length;
+
+public:
+    MappedMbox();
+    ~MappedMbox();
+    bool map(int fd);
+    const char* data() const { return mapping; }
+    size_t size() const { return length; }
+};
+
+//Appends a span for every message in data, each starting at a line that begins with "From ". Bytes in
+//front of the first From line belong to no message and are counted as part of the first one's From line
+void find_messages(const char* data, size_t length, std::vector<MboxSpan>& spans);
+
+//Position of the newline of the next "\nFrom " at or after start, or length if there is none
+size_t find_boundary(const char* data, size_t length, size_t start);
+
+//The same search with memchr only, for comparison
+size_t find_boundary_memchr(const char* data, size_t length, size_t start);
+
+#endif
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <algorithm>
+#include "netio.h"
+
+using namespace std;
+
+//Replies are captured per thread because a session is only ever driven by one thread at a time
+static thread_local string* reply_capture = nullptr;
+static thread_local vector<CapturedRange>* range_capture = nullptr;
+
+namespace {
+
+//Copies data to out with a dot added in front of every line that starts with one
+void stuff_lines(const char* data, size_t length, bool& line_start, string& out) {
+    for (size_t i = 0; i < length; i++) {
+        if (line_start && data[i] == '.') {
+            out.push_back('.');
+        }
+        out.push_back(data[i]);
+        line_start = data[i] == '\n';
+    }
+}
+
+//Queues a range behind the replies captured so far, with a descriptor of its own since the session may
+//close file_fd before the backend gets to the range
+ssize_t capture_range(int file_fd, off_t offset, size_t length, bool stuff, bool line_start) {
+    int fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    range_capture->push_back({ reply_capture->size(), fd, offset, length, stuff, line_start });
+    return length;
+}
+
+}
+
+ssize_t send_reply(int client_fd, const void* buffer, size_t length) {
+    if (reply_capture != nullptr) {
+        reply_capture->append((const char*)buffer, length);
+        return length;
+    }
+
+    //Large replies such as RETR may need several writes on a blocking socket
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = write(client_fd, (const char*)buffer + sent, length - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t send_file_range(int client_fd, int file_fd, off_t offset, size_t length) {
+    if (range_capture != nullptr) {
+        return capture_range(file_fd, offset, length, false, true);
+    }
+    if (reply_capture != nullptr) {
+        size_t start = reply_capture->size();
+        reply_capture->resize(start + length);
+        size_t copied = 0;
+        while (copied < length) {
+            ssize_t n = pread(file_fd, &(*reply_capture)[start + copied], length - copied, offset + copied);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                reply_capture->resize(start + copied);
+                return -1;
+            }
+            copied += n;
+        }
+        return length;
+    }
+
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = sendfile(client_fd, file_fd, &offset, length - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+ssize_t send_stuffed_range(int client_fd, int file_fd, off_t offset, size_t length, bool& line_start) {
+    if (range_capture != nullptr) {
+        ssize_t queued = capture_range(file_fd, offset, length, true, line_start);
+        //The range after this one starts a line if this one ends with a newline
+        char last;
+        if (queued > 0 && length > 0 && pread(file_fd, &last, 1, offset + length - 1) == 1) {
+            line_start = last == '\n';
+        }
+        return queued;
+    }
+
+    CapturedRange range = { 0, file_fd, offset, length, true, line_start };
+    string out;
+    size_t sent = 0;
+    while (range.length > 0) {
+        out.clear();
+        ssize_t n = read_range_chunk(range, out, 65536);
+        if (n < 0 || send_reply(client_fd, out.data(), out.size()) < 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    line_start = range.line_start;
+    return sent;
+}
+
+ssize_t read_range_chunk(CapturedRange& range, string& out, size_t max) {
+    if (range.length == 0) {
+        return 0;
+    }
+    char buffer[65536];
+    ssize_t n;
+    while ((n = pread(range.file_fd, buffer, min({ range.length, max, sizeof(buffer) }), range.offset)) < 0 &&
+           errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    if (range.stuff) {
+        stuff_lines(buffer, n, range.line_start, out);
+    } else {
+        out.append(buffer, n);
+    }
+    range.offset += n;
+    range.length -= n;
+    return n;
+}
+
+void begin_reply_capture(string* out, vector<CapturedRange>* ranges) {
+    reply_capture = out;
+    range_capture = ranges;
+}
+
+void end_reply_capture() {
+    reply_capture = nullptr;
+    range_capture = nullptr;
+}
+
+bool reply_capture_active() {
+    return reply_capture != nullptr;
+}
@@ -0,0 +1,41 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+//A file range in a captured reply, sent after the bytes captured before it. The I/O backend streams it
+//with read_range_chunk a bounded chunk at a time, so a large RETR is never held in memory whole
+struct CapturedRange {
+    size_t at;          //Offset in the capture buffer that the range follows
+    int file_fd;        //The range's own descriptor, closed by whoever sends or drops the range
+    off_t offset;
+    size_t length;      //Bytes left to send
+    bool stuff;         //Adds a dot in front of every line that starts with one (see send_stuffed_range)
+    bool line_start;    //Whether the next byte starts a line
+};
+
+//Sends a protocol reply to the client, or appends it to this thread's capture buffer if one is active
+ssize_t send_reply(int client_fd, const void* buffer, size_t length);
+
+//Sends length bytes of file_fd starting at offset, with sendfile so they never pass through user space.
+//When replies are being captured the range is queued behind them, or read into the capture buffer if
+//the capture takes no ranges
+ssize_t send_file_range(int client_fd, int file_fd, off_t offset, size_t length);
+
+//Like send_file_range, but adds a dot in front of every line that starts with one, so no line of a
+//message can end a multi-line reply early. line_start carries over between ranges of one message
+ssize_t send_stuffed_range(int client_fd, int file_fd, off_t offset, size_t length, bool& line_start);
+
+//Appends up to max bytes of the range to out, stuffed if the range asks for it, and advances the range.
+//Returns the bytes read from the file, or -1 if it cannot be read
+ssize_t read_range_chunk(CapturedRange& range, std::string& out, size_t max);
+
+//Routes every send_reply() on the calling thread into out until end_reply_capture(). With ranges, file
+//ranges are queued there instead of being read into out
+void begin_reply_capture(std::string* out, std::vector<CapturedRange>* ranges = nullptr);
+void end_reply_capture();
+bool reply_capture_active();
+
+#endif
@@ -1,6 +1,5 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <openssl/md5.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -15,9 +14,26 @@
 #include <fstream>
 #include <map>
 #include <sys/file.h>
-#include <sstream>
-#include <iomanip>
-
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string_view>
+#include <charconv>
+#include "workqueue.h"
+#include "linebuffer.h"
+#include "session.h"
+#include "netio.h"
+#include "uring.h"
+#include "listener.h"
+#include "lockmanager.h"
+#include "userdirectory.h"
+#include "log.h"
+#include "commandtable.h"
+#include "admission.h"
+#include "timeouts.h"
+#include "mboxindex.h"
+#include "mboxcompact.h"
+#include "expunger.h"
+#include "blobstore.h"
 
 using namespace std; 
 
@@ -32,62 +48,82 @@ enum Pop3State {
     UPDATE
 };
 
-bool process_command(int client_fd, string& command, bool& auth, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
-                  map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd);
+bool process_command(int client_fd, string_view command, bool& auth, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+                  map<string, int>& message_sizes, map<int, string>& message_indices, map<string, IndexRecord>& message_records,
+                  int& mbox_fd);
 void *worker(void *arg);
+void accept_loop(int server_fd);
+void *pool_worker(void *arg);
+bool serve_client(int client_fd);
+Session* create_pop3_session(int client_fd);
 void handle_shutdown(int signum);
-string trim(string& str);
-void process_USER(string argument, int client_fd, string mail_dir, bool& auth, Pop3State& previousState, string& user);
-void process_PASS(string argument, int client_fd, string mail_dir, bool& auth, Pop3State& previousState, string user,
-                map<string, bool>& deletion_flags, map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd);
-void process_STAT(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, 
+int parse_index(string_view argument);
+void process_USER(string_view argument, int client_fd, const string& mail_dir, bool& auth, Pop3State& previousState, string& user);
+void process_PASS(string_view argument, int client_fd, const string& mail_dir, bool& auth, Pop3State& previousState, string user,
+                map<string, bool>& deletion_flags, map<string, int>& message_sizes, map<int, string>& message_indices,
+                map<string, IndexRecord>& message_records, int& mbox_fd);
+void process_STAT(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, 
                 map<string, bool>& deletion_flags, map<string, int>& message_sizes, map<int, string>& message_indices);
-void process_LIST(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_LIST(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                 map<string, int>& message_sizes, map<int, string>& message_indices);
-void process_UIDL(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_UIDL(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                 map<string, int>& message_sizes, map<int, string>& message_indices);
-void process_RETR(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
-                map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd);
-void process_DELE(string argument, int client_fd, Pop3State& previousState, map<string, bool>& deletion_flags, 
+void process_RETR(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+                map<int, string>& message_indices, map<string, IndexRecord>& message_records, int mbox_fd);
+void process_DELE(string_view argument, int client_fd, Pop3State& previousState, map<string, bool>& deletion_flags, 
                 map<int, string>& message_indices);
-void process_RSET(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_RSET(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                   map<string, int>& message_sizes);
-void process_NOOP(string argument, int client_fd, Pop3State& previousState);
-void process_QUIT(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags);
+void process_NOOP(string_view argument, int client_fd, Pop3State& previousState);
+void process_QUIT(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags,
+                  int mbox_fd);
+
+//POP3 protocol state for one client connection
+class Pop3Session : public Session {
+    //Variables to store information about transaction
+    bool auth;
+    Pop3State previousState;
+    string user;
+    int mbox_fd;
+
+    //Maps to be used for storing message information
+    map<string, bool> deletion_flags;
+    map<string, int> message_sizes;
+    map<int, string> message_indices;
+    map<string, IndexRecord> message_records;      //Where each message is in the mbox open on mbox_fd
+
+    LineBuffer buffer;
+
+public:
+    explicit Pop3Session(int fd) : Session(fd), auth(false), previousState(INIT), user(""), mbox_fd(-1) {}
+    ~Pop3Session();
+    void onConnect();
+    bool onInput(const char* data, size_t length);
+};
 
 //Vectors to store thread IDs and client socket file descriptors
 vector<pthread_t> thread_ids;
 vector<int> client_fds;
 
-// Global map for file mutexes
-map<string, pthread_mutex_t> fileMutexMap;
-
 pthread_mutex_t vector_mutex = PTHREAD_MUTEX_INITIALIZER; 
 int listen_fd;
 bool verbose = false;
 string mail_dir;
+bool use_uring = false;
+int num_acceptors = 0;
+bool steer_accepts = false;
 
-void computeDigest(char *data, int dataLengthBytes, unsigned char *digestBuffer)
-{
-  /* The digest will be written to digestBuffer, which must be at least MD5_DIGEST_LENGTH bytes long */
+//Pre-spawned worker pool; connections are handed over through a bounded queue of accepted fds
+int pool_size = 0;
+int queue_depth = 64;
+BoundedQueue<int>* accept_queue = nullptr;
 
-  MD5_CTX c;
-  MD5_Init(&c);
-  MD5_Update(&c, data, dataLengthBytes);
-  MD5_Final(digestBuffer, &c);
-}
+AdmissionLimits admission_limits = { 0, 0, 0 };
+TimeoutLimits timeout_limits = { 0, 0, 0, 0 };
 
-//converts hexadecimal representation of hash to string
-string digestToHexString(const unsigned char* digest, size_t length) {
-    ostringstream hexStream;
-    hexStream << hex << setfill('0');
-
-    for (size_t i = 0; i < length; ++i) {
-        hexStream << setw(2) << static_cast<int>(digest[i]);
-    }
-
-    return hexStream.str();
-}
+//With -x, QUIT leaves deleted messages to the background compactor
+bool defer_expunge = false;
+ExpungeLimits expunge_limits = { 25, 64, 16 };
 
 int main(int argc, char *argv[]) {
     //Signal for Ctrl+C
@@ -97,22 +133,70 @@ int main(int argc, char *argv[]) {
     int c;
 
 	// Parse command-line options
-	while ((c = getopt(argc, argv, "ap:v")) != -1) {
+	while ((c = getopt(argc, argv, "acik:n:o:p:q:r:t:uvx:")) != -1) {
 		switch (c) {
 			case 'a':
 				fprintf(stderr, "Mahika Vajpeyi SEAS login: mvajpeyi\n");
 		        return 1;
+            case 'o':
+                // Idle and command timeouts in seconds
+                if (!parse_timeout_limits(optarg, timeout_limits)) {
+                    fprintf(stderr, "Invalid timeouts `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
 			case 'p':
                 p = atoi(optarg);
                 printf("port number p is %d\n", p);
 				break;
+            case 'i':
+                // Maximum number of open sessions from one source address
+                admission_limits.max_per_source = atoi(optarg);
+                break;
+            case 'k':
+                // Maximum number of new connections per second
+                admission_limits.rate = atoi(optarg);
+                break;
+            case 'n':
+                // Maximum number of open sessions
+                admission_limits.max_sessions = atoi(optarg);
+                break;
+            case 't':
+                // Number of pre-spawned worker threads
+                pool_size = atoi(optarg);
+                break;
+            case 'q':
+                // Maximum number of accepted connections waiting for a worker
+                queue_depth = atoi(optarg);
+                break;
+            case 'r':
+                // Number of SO_REUSEPORT listeners, each with its own accept loop
+                num_acceptors = atoi(optarg);
+                break;
+            case 'c':
+                // Steer connections to the listener on the CPU that received them
+                steer_accepts = true;
+                break;
+            case 'u':
+                // Use the io_uring I/O backend when the kernel supports it
+                use_uring = true;
+                break;
             case 'v':
                 // Enable verbose mode
                 verbose = true;
                 break;
+            case 'x':
+                // Deferred expunge: garbage percent, garbage MB and compactor MB per second
+                if (!parse_expunge_limits(optarg, expunge_limits)) {
+                    fprintf(stderr, "Invalid expunge limits `%s'.\n", optarg);
+                    return 1;
+                }
+                defer_expunge = true;
+                break;
             case '?':
                 // Handle missing argument or unknown option
-                if (optopt == 'p')
+                if (optopt == 'p' || optopt == 't' || optopt == 'q' || optopt == 'r' || optopt == 'i' || optopt == 'k' ||
+                    optopt == 'n' || optopt == 'o' || optopt == 'x')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 else if (isprint(optopt))
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -131,57 +215,108 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-  //Sets up listening socket
-  listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (listen_fd < 0) {
-       fprintf(stderr, "Cannot open socket (%s)\n", strerror(errno));
-       exit(1);
-   }
-
-    int opt = 1;
-    int ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR|SO_REUSEPORT, &opt, sizeof(opt));
-    if (ret < 0) {
-        perror("Error in SOCKOPT");
-        exit(1);
-    }
+  if (verbose) {
+      log_level = LEVEL_DEBUG;
+  }
 
-  struct sockaddr_in servaddr; //Declares a structure to hold the server's address information, including IP address and port number
-  bzero(&servaddr, sizeof(servaddr)); //Clears the memory allocated for servaddr by setting all bytes to zero
+  if (!start_user_directory(mail_dir)) {
+      return 1;
+  }
+  if (verbose) {
+      print_user_directory_stats(stderr);
+  }
+  start_admission(admission_limits, "-ERR server busy, too many connections\r\n");
+  if (!start_timeouts(timeout_limits, "-ERR timeout, closing connection\r\n")) {
+      return 1;
+  }
+  start_logger();
+  if (defer_expunge && !start_expunger(mail_dir, expunge_limits)) {
+      return 1;
+  }
+  //Blobs (see smtp -b) are removed once the last message referring to them is
+  if (!start_blob_sweeper(mail_dir)) {
+      return 1;
+  }
 
-  servaddr.sin_family = AF_INET; //Specifies the address family as IPv4
-  servaddr.sin_addr.s_addr = htons(INADDR_ANY);  //Sets the server's IP address
-  servaddr.sin_port = htons(p); //Specifies the port number on which the server will listen for incoming connections
+  if (pool_size > 0) {
+      if (queue_depth <= 0) {
+          fprintf(stderr, "Error: Queue depth must be positive.\n");
+          return 1;
+      }
+      accept_queue = new BoundedQueue<int>(queue_depth, pool_size);
+      for (int i = 0; i < pool_size; i++) {
+          pthread_t thread;
+          if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+              fprintf(stderr, "Failed to create worker thread \n");
+              exit(1);
+          }
+          pthread_detach(thread);
+      }
+  }
 
-  // Associates the socket (listen_fd) with the specified address (servaddr) and port
-  if(bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0){
-      fprintf(stderr, "Cannot bind socket (%s)\n", strerror(errno));
-      close(listen_fd);
-      exit(1);
+  //With -r, several SO_REUSEPORT listeners each run their own accept loop on their own core
+  if (num_acceptors > 0) {
+      vector<int> listen_fds;
+      if (!start_acceptors(p, num_acceptors, steer_accepts, accept_loop, listen_fds)) {
+          exit(1);
+      }
+      listen_fd = listen_fds[0];
+      printf("Server is listening on port %d with %d acceptors...\n", p, num_acceptors);
+      while (true) {
+          pause();
+      }
   }
 
-  // Marks the socket as a passive socket that will be used to accept incoming connection requests
-  // 100 is the backlog parameter that specifies the maximum number of pending connections that can be queued
-  if(listen(listen_fd, 100) < 0){
-      fprintf(stderr, "Cannot listen for incoming connections (%s)\n", strerror(errno));
-      close(listen_fd);
+  listen_fd = open_listener(p, false);
+  if (listen_fd < 0) {
       exit(1);
   }
 
   printf("Server is listening on port %d...\n", p);
+  accept_loop(listen_fd);
+  close(listen_fd);
+  return 0;
+}
+
+void accept_loop(int server_fd) {
+  //The io_uring loop serves every connection from this thread and only returns if io_uring is unavailable
+  if (use_uring) {
+      if (run_uring_server(server_fd, create_pop3_session)) {
+          return;
+      }
+      fprintf(stderr, "Falling back to the default I/O backend\n");
+  }
 
   while(true) {
     struct sockaddr_in clientaddr; //Declares a structure to hold the client's address information upon connection
     socklen_t clientaddrlen = sizeof(clientaddr); //Sets the length of the Client Address Structure
     
     //Accepts an Incoming Connection; Stores the returned client socket file descriptor in the allocated memory pointed to by fd
-    int fd_ptr = accept(listen_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
+    int fd_ptr = accept(server_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
     if (fd_ptr < 0) {
-      fprintf(stderr, "Cannot accept connection \n");
+      LOG(LEVEL_ERROR, "Cannot accept connection \n");
       exit(1);
     }
 
-    if (verbose) {
-        fprintf(stderr, "[%d] New connection\n", fd_ptr);  // Verbose: New connection
+    //Clients over the admission limits are answered and closed here, before a thread or session is made for them
+    if (!admit_connection(fd_ptr, clientaddr)) {
+        continue;
+    }
+
+    LOG(LEVEL_INFO, "[%d] New connection\n", fd_ptr);
+
+    //In pool mode the connection waits in the accept queue; a full queue means the server is busy
+    if (accept_queue != nullptr) {
+        if (!accept_queue->tryPush(fd_ptr)) {
+            const char* busy_message = "-ERR server busy, try again later\r\n";
+            if (write(fd_ptr, busy_message, strlen(busy_message)) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR server busy, try again later\n", fd_ptr);
+            release_connection(fd_ptr);
+            close(fd_ptr);
+        }
+        continue;
     }
     
     pthread_t thread;
@@ -189,11 +324,12 @@ int main(int argc, char *argv[]) {
     &thread: Pointer to the thread identifier
     NULL: Default thread attributes
     worker: The function that the thread will execute; responsible for handling client communication
-    fd: Pointer to the client's socket file descriptor, which is passed as an argument to the worker function  
+    fd: The client's socket file descriptor, passed by value so the next accept cannot overwrite it
     */
-    if(pthread_create(&thread, NULL, worker, (void *)&fd_ptr) != 0){
+    if(pthread_create(&thread, NULL, worker, (void *)(intptr_t)fd_ptr) != 0){
         std::cout << " error calling worker " << endl;
-        fprintf(stderr, "Failed to create thread \n");
+        LOG(LEVEL_ERROR, "Failed to create thread \n");
+        release_connection(fd_ptr);
         close(fd_ptr);
     } else {
         pthread_mutex_lock(&vector_mutex);
@@ -206,422 +342,431 @@ int main(int argc, char *argv[]) {
 
     pthread_detach(thread); // Detach the thread so that resources are freed upon completion
     }
-    close(listen_fd);
-    return 0;
 }
 
 void *worker(void *arg) {
-    int client_fd = *(int*)arg;
+    int client_fd = (int)(intptr_t)arg;
 
-    //Variables to store information about transaction
-    bool auth = false;
-    Pop3State previousState = INIT;
-    string user = "";
-    int mbox_fd;
+    if (!serve_client(client_fd)) {
+        // Locks mutex before modifying the shared vectors
+        pthread_mutex_lock(&vector_mutex);
+        
+        // Removes thread ID and client FD from the vectors
+        auto it = find(client_fds.begin(), client_fds.end(), client_fd);
+        if (it != client_fds.end()) {
+            int index = distance(client_fds.begin(), it);
+            thread_ids.erase(thread_ids.begin() + index);
+            client_fds.erase(it);
+        }
+        
+        // Unlocks mutex after modification
+        pthread_mutex_unlock(&vector_mutex);
+    }
+    pthread_exit(NULL);
+}
 
-    //Maps to be used for storing message information
-    map<string, bool> deletion_flags;
-    map<string, int> message_sizes;
-    map<int, string> message_indices;
+void *pool_worker(void *arg) {
+    //Serves queued connections one at a time for the lifetime of the server
+    while (true) {
+        int client_fd = accept_queue->pop();
+        serve_client(client_fd);
+    }
+    return NULL;
+}
+
+void Pop3Session::onConnect() {
+    arm_timeout(client_fd);
 
     //Sends greeting messsage
     const char* message = "+OK POP3 ready [localhost]\r\n";
     int messageLength = strlen(message);
 
-    if (write(client_fd, message, messageLength) < 0) { //Send bytes
-        fprintf(stderr, "error sending greeting\n");
-        exit(1);
+    if (send_reply(client_fd, message, messageLength) < 0) { //Send bytes
+        LOG(LEVEL_WARNING, "error sending greeting\n");
+        return;
     }
     previousState = AUTH;
 
-    if (verbose) {
-        fprintf(stderr, "[%d] S: +OK POP3 ready [localhost]\n", client_fd);  // Verbose: Server ready message
+    LOG(LEVEL_DEBUG, "[%d] S: +OK POP3 ready [localhost]\n", client_fd);
+}
+
+bool Pop3Session::onInput(const char* data, size_t length) {
+    // Appends the received data to the buffer
+    buffer.append(data, length);
+
+    //Processes all complete lines in the buffer; each line is a view into the buffer, not a copy
+    string_view line;
+    while (buffer.nextLine(line)) {
+        LOG(LEVEL_DEBUG, "[%d] C: %.*s\n", client_fd, (int)line.size(), line.data());
+
+        if (!process_command(client_fd, line, auth, previousState, user, deletion_flags, message_sizes, message_indices,
+                             message_records, mbox_fd)) {
+            return false;
+        }
+    }
+    update_timeout(client_fd, buffer.empty() ? PHASE_IDLE : PHASE_COMMAND, length);
+    return true;
+}
+
+Pop3Session::~Pop3Session() {
+    if (mbox_fd >= 0) {
+        close(mbox_fd);
     }
+}
+
+Session* create_pop3_session(int client_fd) {
+    return new Pop3Session(client_fd);
+}
+
+//Runs one POP3 session and closes the socket; returns false if the client sent QUIT
+bool serve_client(int client_fd) {
+    Pop3Session session(client_fd);
+    session.onConnect();
 
     char read_buffer[2000];
     ssize_t bytes_read;
 
     //Clears the buffer before reading
     memset(read_buffer, 0, sizeof(read_buffer));
-    string buffer;
 
     while (true) {
         //Reads data from the client socket
         bytes_read = read(client_fd, read_buffer, sizeof(read_buffer)-1);
         if (bytes_read < 0) {
-            fprintf(stderr, "read failed");
+            LOG(LEVEL_WARNING, "read failed\n");
             break;
         } else if (bytes_read == 0) {
-            fprintf(stderr, "Client disconnected\n");
+            LOG(LEVEL_INFO, "Client disconnected\n");
             break;
         }
 
-        //Null terminates the buffer
-        read_buffer[bytes_read] = '\0';
-
-        // Appends the received data to the buffer
-        buffer.append(read_buffer, bytes_read);
-
-        //Processes all complete lines in the buffer
-        size_t pos;
-        while ((pos = buffer.find("\n")) != string::npos) {
-            //Extracts the line (excluding the newline character)
-            string line = buffer.substr(0, pos);
-
-            //Removes carriage return if present (handles CRLF)
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
-            }
-
-            if (verbose) {
-                fprintf(stderr, "[%d] C: %s\n", client_fd, line.c_str());  // Verbose: Command received
-            }
-
-            bool result = process_command(client_fd, line, auth, previousState, user, deletion_flags, message_sizes, message_indices, mbox_fd);
-            //Removes the processed line from the buffer
-            buffer.erase(0, pos + 1);
-
-            if(!result){
-                if (verbose) {
-                    fprintf(stderr, "[%d] Closing connection\n", client_fd);  // Verbose: Connection closed
-                }
-
-                // Locks mutex before modifying the shared vectors
-                pthread_mutex_lock(&vector_mutex);
-                
-                // Removes thread ID and client FD from the vectors
-                auto it = find(client_fds.begin(), client_fds.end(), client_fd);
-                if (it != client_fds.end()) {
-                    int index = distance(client_fds.begin(), it);
-                    thread_ids.erase(thread_ids.begin() + index);
-                    client_fds.erase(it);
-                }
-                
-                // Unlocks mutex after modification
-                pthread_mutex_unlock(&vector_mutex);
-
-                close(client_fd);
-                pthread_exit(NULL);
-                break;
-            }
+        if (!session.onInput(read_buffer, bytes_read)) {
+            LOG(LEVEL_INFO, "[%d] Closing connection\n", client_fd);
+            cancel_timeout(client_fd);
+            release_connection(client_fd);
+            close(client_fd);
+            return false;
         }
     }
-    if (verbose) {
-        fprintf(stderr, "[%d] Connection closed\n", client_fd);  // Verbose: Connection closed
-    }
+    LOG(LEVEL_INFO, "[%d] Connection closed\n", client_fd);
+
+    cancel_timeout(client_fd);
 
+    release_connection(client_fd);
     close(client_fd);
-    pthread_exit(NULL);
+    return true;
 }
 
-bool process_command(int client_fd, string& command, bool& auth, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
-                  map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd) {
-    command = trim(command);  //Trims the command
+//Per-connection state a POP3 command handler works on
+struct Pop3Context {
+    int client_fd;
+    bool& auth;
+    Pop3State& previousState;
+    string& user;
+    map<string, bool>& deletion_flags;
+    map<string, int>& message_sizes;
+    map<int, string>& message_indices;
+    map<string, IndexRecord>& message_records;
+    int& mbox_fd;
+};
 
-    //Finds the position of the first space to split the command and its argument
-    size_t space_pos = command.find(' ');
+//POP3 commands with the states each is accepted in and the reply sent when one arrives in any other
+//state. Handlers return false to close the connection
+struct Pop3Command {
+    uint32_t code;
+    unsigned states;
+    const char* refusal;
+    bool (*handler)(Pop3Context& context, string_view argument);
+};
 
-    //Extracts the command (before the space) and the argument (after the space)
-    string cmd = (space_pos != string::npos) ? command.substr(0, space_pos) : command;
-    string argument = (space_pos != string::npos) ? command.substr(space_pos + 1) : "";
+const unsigned AUTHORIZATION_STATES = state_bit(AUTH) | state_bit(USER) | state_bit(PASS);
+
+constexpr Pop3Command pop3_commands[] = {
+    { command_code("USER"), AUTHORIZATION_STATES, "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_USER(argument, c.client_fd, mail_dir, c.auth, c.previousState, c.user);
+          return true;
+      } },
+    { command_code("PASS"), state_bit(USER), "-ERR enter username first\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_PASS(argument, c.client_fd, mail_dir, c.auth, c.previousState, c.user, c.deletion_flags, c.message_sizes,
+                       c.message_indices, c.message_records, c.mbox_fd);
+          return true;
+      } },
+    { command_code("STAT"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_STAT(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.message_sizes,
+                       c.message_indices);
+          return true;
+      } },
+    { command_code("LIST"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_LIST(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.message_sizes,
+                       c.message_indices);
+          return true;
+      } },
+    { command_code("UIDL"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_UIDL(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.message_sizes,
+                       c.message_indices);
+          return true;
+      } },
+    { command_code("RETR"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_RETR(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.message_indices,
+                       c.message_records, c.mbox_fd);
+          return true;
+      } },
+    { command_code("DELE"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_DELE(argument, c.client_fd, c.previousState, c.deletion_flags, c.message_indices);
+          return true;
+      } },
+    { command_code("RSET"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_RSET(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.message_sizes);
+          return true;
+      } },
+    { command_code("NOOP"), state_bit(TRANSACTION), "-ERR command not allowed\r\n",
+      [](Pop3Context& c, string_view argument) {
+          process_NOOP(argument, c.client_fd, c.previousState);
+          return true;
+      } },
+    { command_code("QUIT"), ANY_STATE, nullptr,
+      [](Pop3Context& c, string_view argument) {
+          process_QUIT(argument, c.client_fd, mail_dir, c.previousState, c.user, c.deletion_flags, c.mbox_fd);
+          return false;
+      } },
+};
 
-    //Converts the command part to uppercase for case insensitivity
-    transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+constexpr CommandTable<Pop3Command> pop3_table = make_command_table(pop3_commands);
 
-    if (cmd == "USER") {
-        process_USER(argument, client_fd, mail_dir, auth, previousState, user);
-        return true;
-    } else if (cmd == "PASS") {
-        process_PASS(argument, client_fd, mail_dir, auth, previousState, user, deletion_flags, message_sizes, message_indices, mbox_fd);
-        return true;
-    } else if (cmd == "STAT") {
-        process_STAT(argument, client_fd, mail_dir, previousState, user, deletion_flags, message_sizes, message_indices);
-        return true;
-    } else if (cmd == "LIST") {
-        process_LIST(argument, client_fd, mail_dir, previousState, user, deletion_flags, message_sizes, message_indices);
-        return true;
-    } else if (cmd == "UIDL") {
-        process_UIDL(argument, client_fd, mail_dir, previousState, user, deletion_flags, message_sizes, message_indices);
-        return true;
-    } else if (cmd == "RETR") {
-        process_RETR(argument, client_fd, mail_dir, previousState, user, deletion_flags, message_sizes, message_indices, mbox_fd);
-        return true;
-    } else if (cmd == "DELE") {
-        process_DELE(argument, client_fd, previousState, deletion_flags, message_indices);
-        return true;
-    } else if (cmd == "RSET") {
-        process_RSET(argument, client_fd, mail_dir, previousState, user, deletion_flags, message_sizes);
-        return true;
-    } else if (cmd == "NOOP") {
-        process_NOOP(argument, client_fd, previousState);
-        return true;
-    } else if (cmd == "QUIT" || cmd =="QUIT\r\n") {
-        process_QUIT(argument, client_fd, mail_dir, previousState, user, deletion_flags);
-        return false;
-    } 
-    else {
+bool process_command(int client_fd, string_view command, bool& auth, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+                  map<string, int>& message_sizes, map<int, string>& message_indices, map<string, IndexRecord>& message_records,
+                  int& mbox_fd) {
+    string_view word;
+    string_view argument;
+    split_command(command, word, argument);
+
+    const Pop3Command* entry = pop3_table.find(command_code(word));
+    if (entry == nullptr) {
         //Handles unknown commands
         string response = "-ERR Not supported\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Error sending unknown command response\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Not supported\n", client_fd);  // Verbose: Unknown command response
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Error sending unknown command response\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR Not supported\n", client_fd);
         return true;
     }
-}
 
-void process_USER(string argument, int client_fd, string mail_dir, bool& auth, Pop3State& previousState, string& user){
-    //Checks for correct previous state
-    if (previousState != AUTH && previousState != USER && previousState != PASS) {
-        string response = "-ERR command not allowed\r\n";
-        if(write(client_fd, response.c_str(), response.length()) < 0){
-          fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Command not allowed\n", client_fd);  
+    if ((entry->states & state_bit(previousState)) == 0) {
+        if (send_reply(client_fd, entry->refusal, strlen(entry->refusal)) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        return;
+        LOG(LEVEL_DEBUG, "[%d] S: %.*s\n", client_fd, (int)strlen(entry->refusal) - 2, entry->refusal);
+        return true;
     }
 
+    Pop3Context context{ client_fd, auth, previousState, user, deletion_flags, message_sizes, message_indices, message_records,
+                         mbox_fd };
+    return entry->handler(context, argument);
+}
+
+void process_USER(string_view argument, int client_fd, const string& mail_dir, bool& auth, Pop3State& previousState, string& user){
     if (argument.empty()) {
         string response = "-ERR username missing\r\n";
-        if(write(client_fd, response.c_str(), response.length()) < 0){
-          fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Username missing\n", client_fd);  
+        if(send_reply(client_fd, response.c_str(), response.length()) < 0){
+          LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR Username missing\n", client_fd);
         return;
     }
 
     //Checks if another user is logged in
     if (auth) {
         string response = "-ERR another user logged in\r\n";
-        if(write(client_fd, response.c_str(), response.length()) < 0){
-          fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Another user logged in\n", client_fd);  
+        if(send_reply(client_fd, response.c_str(), response.length()) < 0){
+          LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR Another user logged in\n", client_fd);
         return;
     }
 
     //Removes @localhost from username
     size_t atPos = argument.find('@');
     argument = (atPos != string::npos) ? argument.substr(0, atPos) : argument;
-    string mbox_file_path = mail_dir + "/" + argument + ".mbox";
-    // cout<<mbox_file_path<<endl;
 
     //Checks if mbox file for user exists
-    ifstream file(mbox_file_path);
-    if (file.good()) {
+    if (user_exists(argument)) {
         string response = "+OK user found\r\n";
         user = argument;
         
-        if(write(client_fd, response.c_str(), response.length()) < 0){
-          fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK user found\n", client_fd);  
+        if(send_reply(client_fd, response.c_str(), response.length()) < 0){
+          LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: +OK user found\n", client_fd);
     } else {
         string error_message = "-ERR no such user\r\n";
-        cout<<"[S]: "<<error_message<<endl;
-        if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR No such user\n", client_fd);  
+        if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR No such user\n", client_fd);
     }
 
     previousState = USER;
 }
 
-void process_PASS(string argument, int client_fd, string mail_dir, bool& auth, Pop3State& previousState, string user,
-                map<string, bool>& deletion_flags, map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd) {
-    //Checks if user name has been provided
-    if (previousState != USER) {
-        string response = "-ERR enter username first\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR enter username first\n", client_fd);  
-        }
-        return;
-    }
-
+void process_PASS(string_view argument, int client_fd, const string& mail_dir, bool& auth, Pop3State& previousState, string user,
+                map<string, bool>& deletion_flags, map<string, int>& message_sizes, map<int, string>& message_indices,
+                map<string, IndexRecord>& message_records, int& mbox_fd) {
     //Checks if another user is logged in
     if (auth) {
         string response = "-ERR another user logged in\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Another user logged in\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR Another user logged in\n", client_fd);
         return;
     }
 
     if (argument.empty()) {
         string response = "-ERR password missing\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR password missing\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR password missing\n", client_fd);
         return;
     }
 
     if (argument != "cis505") {
         string response = "-ERR incorrect password\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR incorrect password\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR incorrect password\n", client_fd);
         previousState = USER;
         return;
     }
 
-    // Checks if user's mbox file can be opened
-    string mbox_file_path = mail_dir + "/" + user + ".mbox";
-    mbox_fd = open(mbox_file_path.c_str(), O_RDWR);
-    if (mbox_fd < 0) {
-        string response = "-ERR cannot open user's mbox file\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+    //A compaction cut short by a crash is finished before the mbox is read
+    string mbox_file_path = mailbox_key(mail_dir, user);
+    lock_mailbox(mbox_file_path, LOCK_EXCLUSIVE);
+    recover_compaction(mbox_file_path);
+    unlock_mailbox(mbox_file_path);
+
+    while (true) {
+        // Checks if user's mbox file can be opened
+        mbox_fd = open(mbox_file_path.c_str(), O_RDWR);
+        if (mbox_fd < 0) {
+            string response = "-ERR cannot open user's mbox file\r\n";
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR Cannot open user's mailbox\n", client_fd);
+            return;
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Cannot open user's mailbox\n", client_fd);  
+
+        //Held for the whole session, so QUIT in another session knows the mbox is still being read; it
+        //waits out a QUIT that is compacting the mbox in place
+        int locked;
+        while ((locked = flock(mbox_fd, LOCK_SH)) < 0 && errno == EINTR) {
         }
-        return;
-    }
+        if (locked < 0) {
+            LOG(LEVEL_ERROR, "Cannot lock %s (%s)\n", mbox_file_path.c_str(), strerror(errno));
+            close(mbox_fd);
+            mbox_fd = -1;
+            string response = "-ERR cannot lock user's mbox file\r\n";
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+            }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR cannot lock user's mailbox\n", client_fd);
+            return;
+        }
+        //Reading the mailbox only needs to keep writers out
+        lock_mailbox(mbox_file_path, LOCK_SHARED);
 
-    flock(mbox_fd, LOCK_EX | LOCK_NB);
-    // Acquire the mutex for the recipient's mbox file
-    if (fileMutexMap.find(user) == fileMutexMap.end()) {
-        // Initialize the mutex if it does not exist
-        pthread_mutex_t newMutex;
-        pthread_mutex_init(&newMutex, nullptr);
-        fileMutexMap[user] = newMutex;
+        //The compactor, or a QUIT that could not compact in place, may have renamed a new mbox over the
+        //one opened before the lock was taken; that one is opened again
+        struct stat fd_st;
+        struct stat path_st;
+        if (fstat(mbox_fd, &fd_st) < 0 || stat(mbox_file_path.c_str(), &path_st) < 0 ||
+            (fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)) {
+            break;
+        }
+        unlock_mailbox(mbox_file_path);
+        flock(mbox_fd, LOCK_UN);
+        close(mbox_fd);
     }
-    pthread_mutex_t& fileMutex = fileMutexMap[user];
-
-    // Lock the mutex
-    pthread_mutex_lock(&fileMutex);
-
-    // pthread_mutex_t& file_mutex = file_mutexes[user];
-    // pthread_mutex_lock(&file_mutex);
 
-    FILE* fp = fdopen(mbox_fd, "r");
-    if (fp == nullptr) {
+    //The mailbox is listed from its index, which is rebuilt from the mbox if it is missing or stale
+    vector<IndexRecord> records;
+    if (!load_index(mbox_file_path, mbox_fd, records)) {
         string response = "-ERR cannot open user's mbox file\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR cannot open user's mailbox\n", client_fd);  
-        }
-        pthread_mutex_unlock(&fileMutex);
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR cannot open user's mailbox\n", client_fd);
+        unlock_mailbox(mbox_file_path);
         flock(mbox_fd, LOCK_UN);
-        close(mbox_fd); // Close the file descriptor if opening FILE* fails
+        close(mbox_fd);
+        mbox_fd = -1;
         return;
     }
 
-    // Now, process the mbox file to populate maps that store mailbox information 
-    string line;
-    string message;
+    //Messages deleted in an earlier session that the compactor has not removed yet are not listed
+    vector<bool> keep(records.size(), true);
+    mark_tombstoned(mbox_file_path, mbox_fd, records, keep);
+
     int message_index = 1;
-    int currMsgSize = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        line = string(buffer);
-        if (line.rfind("From ", 0) == 0) {
-            if (!message.empty()) {
-                unsigned char digest[MD5_DIGEST_LENGTH];
-                computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-                string hash = digestToHexString(digest, MD5_DIGEST_LENGTH);
-                deletion_flags[hash] = false;
-                message_sizes[hash] = currMsgSize;
-                message_indices[message_index++] = hash;
-                message.clear();
-                currMsgSize = 0;
-            }
-        } else {
-            currMsgSize += line.length();
-            message += line;
+    for (size_t i = 0; i < records.size(); i++) {
+        const IndexRecord& record = records[i];
+        //A message with no body has never been listed
+        if (record.size == 0 || !keep[i]) {
+            continue;
         }
-    }
-
-    // Handle the last message if present
-    if (!message.empty()) {
-        unsigned char digest[MD5_DIGEST_LENGTH];
-        computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-        string hash = digestToHexString(digest, MD5_DIGEST_LENGTH);
+        string hash = uid_string(record.uid);
         deletion_flags[hash] = false;
-        message_sizes[hash] = currMsgSize;
+        message_sizes[hash] = record.size;
         message_indices[message_index++] = hash;
+        message_records[hash] = record;
     }
 
-    //Cleanup
-    fclose(fp);
-    pthread_mutex_unlock(&fileMutex);
-    flock(mbox_fd, LOCK_UN);
+    //Cleanup. The mbox stays open for RETR: messages are only ever appended to this file, QUIT only
+    //rewrites it in place while no session holds the flock and the compactor replaces it with a new file,
+    //so the byte ranges listed stay valid all session
+    unlock_mailbox(mbox_file_path);
 
     //Confirm user can log in
     auth = true;
     string response = "+OK authenticated\r\n";
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
-    if (verbose) {
-            fprintf(stderr, "[%d] S: +OK authenticated\n", client_fd);  
-        }
+    LOG(LEVEL_DEBUG, "[%d] S: +OK authenticated\n", client_fd);
     previousState = TRANSACTION;
 
 }
 
-void process_STAT(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_STAT(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                   map<string, int>& message_sizes, map<int, string>& message_indices){
-    if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR Command not allowed\n", client_fd);  
-        }
-        return;
-    }
-
     if (!argument.empty()) {
         string response = "-ERR no arguments allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR no arguments allowed\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR no arguments allowed\n", client_fd);
         return;
     }
 
     //Checks if user's mbox file can be opened
-    string mbox_file_path = mail_dir + "/" + user + ".mbox";
+    string mbox_file_path = mailbox_key(mail_dir, user);
     ifstream file(mbox_file_path);
     if (!file.good()) {
         string error_message = "-ERR No such user\r\n";
-        if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR No such user\n", client_fd);  
+        if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR No such user\n", client_fd);
         return;
     }
 
@@ -637,41 +782,25 @@ void process_STAT(string argument, int client_fd, string mail_dir, Pop3State& pr
     }
 
     string response = "+OK " + to_string(num_msgs) + " " + to_string(total_msg_size) + "\r\n";
-    cout<<"[S]: "<<response<<endl;
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: +OK %d %d\r\n", client_fd, num_msgs, total_msg_size);
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
+    LOG(LEVEL_DEBUG, "[%d] S: +OK %d %d\r\n", client_fd, num_msgs, total_msg_size);
 }
 
-void process_LIST(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_LIST(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                   map<string, int>& message_sizes, map<int, string>& message_indices){
-   if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\r\n", client_fd);
-        }
-        return;
-    }
-
     //Checks if user wants information for a specific message
     if (argument.empty()) {
         //Checks if user's mbox file exists
         string buffer;
-        string mbox_file_path = mail_dir + "/" + user + ".mbox";
+        string mbox_file_path = mailbox_key(mail_dir, user);
         if (!ifstream(mbox_file_path).good()) {
             string error_message = "-ERR no such user\r\n";
-            if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR no such user\r\n", client_fd);
+            if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR no such user\r\n", client_fd);
             return;
         }
 
@@ -689,23 +818,19 @@ void process_LIST(string argument, int client_fd, string mail_dir, Pop3State& pr
         }
 
         buffer = "+OK " + to_string(num_msgs) + " messages (" + to_string(total_msg_size) + " octets)\r\n" + buffer + ".\r\n";
-        if (write(client_fd, buffer.c_str(), buffer.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK %d messages (%d octets)\r\n%s.\r\n", client_fd, num_msgs, total_msg_size, buffer.c_str());
+        if (send_reply(client_fd, buffer.c_str(), buffer.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: +OK %d messages (%d octets)\r\n%s.\r\n", client_fd, num_msgs, total_msg_size, buffer.c_str());
     } else {
         //Checks if message index is valid
-        int msg_index = stoi(argument);
+        int msg_index = parse_index(argument);
         if (msg_index > static_cast<int>(message_indices.size()) || msg_index <= 0) {
             string response = "-ERR no such message\r\n";
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
             return;
         }
 
@@ -713,53 +838,36 @@ void process_LIST(string argument, int client_fd, string mail_dir, Pop3State& pr
         string hash = message_indices[msg_index];
         if (deletion_flags[hash]) {
             string response = "-ERR no such message\r\n";
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
             return;
         }
 
         int msg_size = message_sizes[hash];
         string response = "+OK " + to_string(msg_index) + " " + to_string(msg_size) + "\r\n";
 
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK %d %d\r\n", client_fd, msg_index, msg_size);
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: +OK %d %d\r\n", client_fd, msg_index, msg_size);
     }
 }
 
-void process_UIDL(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_UIDL(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                   map<string, int>& message_sizes, map<int, string>& message_indices){
-   if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\r\n", client_fd);
-        }
-        return;
-    }
-
     //Checks if user wants information about a specific message
     if (argument.empty()) {
         string buffer;
         buffer += "+OK\r\n";
-        string mbox_file_path = mail_dir + "/" + user + ".mbox";
+        string mbox_file_path = mailbox_key(mail_dir, user);
         if (!ifstream(mbox_file_path).good()) {
             string error_message = "-ERR could not access mailbox\r\n";
-            if (write(client_fd, error_message.c_str(), error_message.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR could not access mailbox\r\n", client_fd);
+            if (send_reply(client_fd, error_message.c_str(), error_message.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR could not access mailbox\r\n", client_fd);
             return;
         }
 
@@ -772,21 +880,19 @@ void process_UIDL(string argument, int client_fd, string mail_dir, Pop3State& pr
 
         //Response to user
         buffer += ".\r\n";
-        if (write(client_fd, buffer.c_str(), buffer.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, buffer.c_str(), buffer.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             return;
         }
     } else {
-        int msg_index = stoi(argument);
+        int msg_index = parse_index(argument);
         //Checks if message is valid
         if (msg_index > static_cast<int>(message_indices.size()) || msg_index <= 0) {
             string response = "-ERR no such message\r\n";
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
             return;
         }
 
@@ -794,61 +900,42 @@ void process_UIDL(string argument, int client_fd, string mail_dir, Pop3State& pr
         string hash = message_indices[msg_index];
         if (deletion_flags[hash]) {
             string response = "-ERR no such message\r\n";
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
             return;
         }
 
         //Sends response to user
         string response = "+OK " + to_string(msg_index) + " " + hash + "\r\n";
         // cout<<"[S]: "<<response<<endl;
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK %d %s\r\n", client_fd, msg_index, hash.c_str());
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: +OK %d %s\r\n", client_fd, msg_index, hash.c_str());
     }
 }
 
-void process_RETR(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
-                  map<string, int>& message_sizes, map<int, string>& message_indices, int mbox_fd) {
-    if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\r\n", client_fd);
-        }
-        return;
-    }
-
+void process_RETR(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+                  map<int, string>& message_indices, map<string, IndexRecord>& message_records, int mbox_fd) {
     if (argument.empty()) {
         string response = "-ERR argument required\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR argument required\r\n", client_fd);
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR argument required\r\n", client_fd);
         return;
     }
 
     //Checks if message index is valid
-    int msg_index = stoi(argument);
+    int msg_index = parse_index(argument);
     if (msg_index > static_cast<int>(message_indices.size()) || msg_index <= 0) {
         string response = "-ERR no such message\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
         return;
     }
 
@@ -856,162 +943,95 @@ void process_RETR(string argument, int client_fd, string mail_dir, Pop3State& pr
     //Checks if message has been deleted
     if (deletion_flags[hash]) {
         string response = "-ERR no such message\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR no such message\r\n", client_fd);
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR no such message\r\n", client_fd);
         return;
     }
 
-    string mbox_file_path = mail_dir + "/" + user + ".mbox";
-    mbox_fd = open(mbox_file_path.c_str(), O_RDWR);
-
-    //Applies a file-level lock (flock) to the mailbox file
-    if (flock(mbox_fd, LOCK_EX | LOCK_NB) < 0) {
-        string response = "-ERR cannot lock mailbox file\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR cannot lock mailbox file\r\n", client_fd);
-        }
-        return;
-    }
-
-    //Locks the mutex to prevent other threads from accessing the mailbox file concurrently
-    pthread_mutex_lock(&fileMutexMap[user]);
-
-    FILE* fp = fdopen(mbox_fd, "r");
-    if (fp == nullptr) {
-        string response = "-ERR cannot access mailbox\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR cannot access mailbox\r\n", client_fd);
+    auto found = message_records.find(hash);
+    if (found == message_records.end() || mbox_fd < 0) {
+        string response = "-ERR message not found\r\n";
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        pthread_mutex_unlock(&fileMutexMap[user]);
-        // Unlock the file if fdopen fails
-        flock(mbox_fd, LOCK_UN);  
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR message not found\r\n", client_fd);
         return;
     }
-
-    //Reads the mailbox to find the message
-    string line;
-    string message;
-    bool message_found = false;
-    char buffer[1024];
-
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        line = string(buffer);
-        if (line.rfind("From ", 0) == 0) {
-            if (message_found) {
-                break; 
+    const IndexRecord& record = found->second;
+
+    //A message stored as a blob is served from the blob, followed by anything after its From line
+    int blob_fd = -1;
+    uint64_t blob_size = 0;
+    if (record.flags & INDEX_BLOB) {
+        string from_line(record.header_length, '\0');
+        if (pread(mbox_fd, &from_line[0], from_line.size(), record.offset) == (ssize_t)from_line.size()) {
+            blob_fd = open(blob_path(mailbox_key(mail_dir, user), from_line).c_str(), O_RDONLY);
+        }
+        struct stat st;
+        if (blob_fd < 0 || fstat(blob_fd, &st) < 0) {
+            string response = "-ERR message not found\r\n";
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
-            unsigned char digest[MD5_DIGEST_LENGTH];
-            computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-            string hash_string = digestToHexString(digest, MD5_DIGEST_LENGTH);
-
-            if (hash == hash_string) {
-                message_found = true;
-                break;
-            } else {
-                //Clear the current message buffer if it's not the one we need
-                message.clear();
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR message not found\r\n", client_fd);
+            if (blob_fd >= 0) {
+                close(blob_fd);
             }
-        } else {
-            message += line;
+            return;
         }
+        blob_size = st.st_size;
     }
 
-    //Handles the last message if it matches
-    if (!message_found && !message.empty()) {
-        unsigned char digest[MD5_DIGEST_LENGTH];
-        computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-        string hash_string = digestToHexString(digest, MD5_DIGEST_LENGTH);
-        
-        if (hash == hash_string) {
-            message_found = true;
-        }
+    //Sends the message from its byte range in the mbox listed at login; nothing is read or hashed to find
+    //it. Bodies are stored with the SMTP dot-stuffing removed, so a message the index flags as having
+    //dot-leading lines is read and stuffed on the way out; every other one goes out with sendfile
+    bool stuff = record.flags & INDEX_DOT_LINES;
+    auto send_range = [&](int file_fd, off_t offset, size_t length, bool& line_start) {
+        return stuff ? send_stuffed_range(client_fd, file_fd, offset, length, line_start)
+                     : send_file_range(client_fd, file_fd, offset, length);
+    };
+    string response = "+OK " + to_string(record.size) + " octets\r\n";
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
-
-    //Unlocks the mutex now that we're done reading the file
-    pthread_mutex_unlock(&fileMutexMap[user]);
-
-    //If the message was not found, return an error response
-    if (!message_found) {
-        string response = "-ERR message not found\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR message not found\r\n", client_fd);
+    LOG(LEVEL_DEBUG, "[%d] S: +OK %llu octets\r\n", client_fd, (unsigned long long)record.size);
+    bool line_start = true;
+    if (blob_fd >= 0) {
+        if (send_range(blob_fd, 0, blob_size, line_start) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        flock(mbox_fd, LOCK_UN);  
-        return;
+        close(blob_fd);
     }
-
-    //Sends the message to the client
-    string response = "+OK " + to_string(message.size()) + " octets\r\n";
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: +OK %zu octets\r\n", client_fd, message.size());
-    }
-    if (write(client_fd, message.c_str(), message.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: %s\r\n", client_fd, message.c_str());
+    if (send_range(mbox_fd, record.offset + record.header_length, record.length - record.header_length, line_start) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
     string end_marker = ".\r\n";
-    if (write(client_fd, end_marker.c_str(), end_marker.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: %s\r\n", client_fd, end_marker.c_str());
+    if (send_reply(client_fd, end_marker.c_str(), end_marker.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
-
-    //Releases the file lock
-    flock(mbox_fd, LOCK_UN);
+    LOG(LEVEL_DEBUG, "[%d] S: %s\r\n", client_fd, end_marker.c_str());
 }
 
-void process_DELE(string argument, int client_fd, Pop3State& previousState, map<string, bool>& deletion_flags, map<int, string>& message_indices){
-   if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\r\n", client_fd);
-        }
-        return;
-    }
-
+void process_DELE(string_view argument, int client_fd, Pop3State& previousState, map<string, bool>& deletion_flags, map<int, string>& message_indices){
     if (argument.empty()) {
         string response = "-ERR argument missing\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR argument missing\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR argument missing\n", client_fd);
         return;
     }
 
     //Checks for valid message index
-    int msg_index = stoi(argument);
+    int msg_index = parse_index(argument);
     if (msg_index > static_cast<int>(message_indices.size()) || msg_index <= 0) {
         string response = "-ERR no such message\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR No such message\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR No such message\n", client_fd);
         return;
     }
 
@@ -1020,47 +1040,30 @@ void process_DELE(string argument, int client_fd, Pop3State& previousState, map<
     if (deletion_flags[hash]) {
         string response = "-ERR message already deleted\r\n";
     
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR message already deleted\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR message already deleted\n", client_fd);
         return;
     }
 
     //Marks message as deleted and sends response to user
     deletion_flags[hash] = true;
-    string response = "+OK " + argument + " deleted\r\n";
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-        fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if(verbose){
-        fprintf(stderr, "[%d] S: +OK %s deleted\r\n", client_fd, argument.c_str());
+    string response = "+OK " + string(argument) + " deleted\r\n";
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+        LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
+    LOG(LEVEL_DEBUG, "[%d] S: +OK %.*s deleted\r\n", client_fd, (int)argument.size(), argument.data());
 }
 
-void process_RSET(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
+void process_RSET(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags, 
                   map<string, int>& message_sizes){
-     if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\n", client_fd);  
-        }
-        return;
-    }
-
     if (!argument.empty()) {
         string response = "-ERR RSET doesn't take any arguments\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR RSET doesn't take any arguments\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR RSET doesn't take any arguments\n", client_fd);
         return;
     }
 
@@ -1069,16 +1072,14 @@ void process_RSET(string argument, int client_fd, string mail_dir, Pop3State& pr
         entry.second = false;
     }
 
-    string mbox_file_path = mail_dir + "/" + user + ".mbox";
+    string mbox_file_path = mailbox_key(mail_dir, user);
     ifstream mbox_file(mbox_file_path);
     if (!mbox_file.is_open()) {
         string response = "-ERR unable to open mailbox\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR unable to open mailbox\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR unable to open mailbox\n", client_fd);
         return;
     }
 
@@ -1090,60 +1091,40 @@ void process_RSET(string argument, int client_fd, string mail_dir, Pop3State& pr
 
     int num_msgs = message_sizes.size();
     string response = "+OK mailbox has " + to_string(num_msgs) + " messages (" + to_string(total_msg_size) + " octets)\r\n";
-    cout<<"[S]: "<<response<<endl;
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
 
-    if(verbose){
-        fprintf(stderr, "[%d] S: +OK mailbox has %d messages (%d octets)\r\n", client_fd, num_msgs, total_msg_size);
-    }
+    LOG(LEVEL_DEBUG, "[%d] S: +OK mailbox has %d messages (%d octets)\r\n", client_fd, num_msgs, total_msg_size);
 
 }
 
-void process_NOOP(string argument, int client_fd, Pop3State& previousState){
-    if (previousState != TRANSACTION) {
-        string response = "-ERR command not allowed\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR command not allowed\n", client_fd);  
-        }
-        return;
-    }
-
+void process_NOOP(string_view argument, int client_fd, Pop3State& previousState){
     if (!argument.empty()) {
         string response = "-ERR NOOP doesn't take any arguments\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR NOOP doesn't take any arguments\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR NOOP doesn't take any arguments\n", client_fd);
         return;
     }
 
     string response = "+OK\r\n";
-    if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-    }
-    if (verbose) {
-        fprintf(stderr, "[%d] S: +OK\n", client_fd);  
+    if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
     }
+    LOG(LEVEL_DEBUG, "[%d] S: +OK\n", client_fd);
 
 }
 
-void process_QUIT(string argument, int client_fd, string mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags){
+void process_QUIT(string_view argument, int client_fd, const string& mail_dir, Pop3State& previousState, string& user, map<string, bool>& deletion_flags,
+                  int mbox_fd){
     if (!argument.empty()) {
         string response = "-ERR no arguments allowed\r\n";
-        cout<<"[S]: "<<response<<endl;
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: -ERR no arguments allowed\n", client_fd);  
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: -ERR no arguments allowed\n", client_fd);
         return;
     }
 
@@ -1151,116 +1132,79 @@ void process_QUIT(string argument, int client_fd, string mail_dir, Pop3State& pr
     if (previousState == AUTH) {
         string response = "+OK POP3 server signing off\r\n";
         // cout<<"[S]: "<<response<<endl;
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK POP3 server signing off\n", client_fd);  
-        }
-        close(client_fd);
-        pthread_exit(NULL);
+        LOG(LEVEL_DEBUG, "[%d] S: +OK POP3 server signing off\n", client_fd);
+        return;
     }
 
     //If previous state is TRANSACTION, deletes messages
     if (previousState == TRANSACTION) {
         previousState = UPDATE;
 
-        string mbox_file_path = mail_dir + "/" + user + ".mbox";
-        string temp_file_path = mail_dir + "/" + user + ".temp";
+        string mbox_file_path = mailbox_key(mail_dir, user);
 
-        pthread_mutex_lock(&fileMutexMap[mbox_file_path]);
+        lock_mailbox(mbox_file_path, LOCK_EXCLUSIVE);
+        recover_compaction(mbox_file_path);
 
-        //Opens the original file and the temporary file
+        //Opens the current mbox, which another session's QUIT may have replaced since login
         int old_fd = open(mbox_file_path.c_str(), O_RDWR);
-        if (old_fd < 0) {
+        vector<IndexRecord> records;
+        if (old_fd < 0 || !load_index(mbox_file_path, old_fd, records)) {
             string response = "-ERR unable to access mailbox\r\n";
             // cout<<"[S]: "<<response<<endl;
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
+            if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+                LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
             }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR unable to access mailbox\n", client_fd);  
+            LOG(LEVEL_DEBUG, "[%d] S: -ERR unable to access mailbox\n", client_fd);
+            if (old_fd >= 0) {
+                close(old_fd);
             }
-            pthread_mutex_unlock(&fileMutexMap[mbox_file_path]);
+            unlock_mailbox(mbox_file_path);
             return;
         }
-        flock(old_fd, LOCK_EX | LOCK_NB);
 
-        ofstream temp_file(temp_file_path);
-        ifstream old_file(mbox_file_path);
-
-        if (!old_file.is_open() || !temp_file.is_open()) {
-            string response = "-ERR unable to open mailbox\r\n";
-            // cout<<"[S]: "<<response<<endl;
-            if (write(client_fd, response.c_str(), response.length()) < 0) {
-                fprintf(stderr, "Could not communicate with client\r\n");
-            }
-            if (verbose) {
-                fprintf(stderr, "[%d] S: -ERR unable to open mailbox\n", client_fd);  
-            }
-            close(old_fd);
-            pthread_mutex_unlock(&fileMutexMap[mbox_file_path]);
-            return;
+        //Messages are matched to the deletions by their UIDs in the index; nothing is read or hashed
+        vector<bool> keep(records.size());
+        for (size_t i = 0; i < records.size(); i++) {
+            auto flag = deletion_flags.find(uid_string(records[i].uid));
+            keep[i] = flag == deletion_flags.end() || !flag->second;
         }
 
-        //Reads old file message-by-message and writes to temp file if not deleted
-        string line;
-        string message;
-        string copy_msg;
-        // for (auto d: deletion_flags)
-        // {
-        //     cout<<"DEL FLAG: "<<d.first<<" "<<d.second<<endl;
-        // }
-        
-        while (getline(old_file, line)) {
-            if (line.rfind("From ", 0) == 0) {
-                //Processes the previous message
-                unsigned char digest[MD5_DIGEST_LENGTH];
-                computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-                string hash = digestToHexString(digest, MD5_DIGEST_LENGTH);
-                // cout<<"Hash: "<<hash<<endl;
-                if (!deletion_flags[hash]) {
-                    temp_file << copy_msg;
-                }
-                message.clear();
-                copy_msg.clear();
+        bool ok;
+        if (defer_expunge) {
+            //Recording the deletions is all QUIT waits for; the compactor removes them later
+            ok = add_tombstones(mbox_file_path, old_fd, records, keep);
+        } else {
+            //Messages tombstoned while -x was on are removed along with this session's deletions
+            size_t tombstoned = mark_tombstoned(mbox_file_path, old_fd, records, keep);
+
+            //The mbox may only be rewritten in place when no other session still reads messages from it by
+            //offset; each holds a shared flock for as long as it is logged in
+            if (mbox_fd >= 0) {
+                flock(mbox_fd, LOCK_UN);
             }
-            else{
-                message += line + "\n";
+            bool in_place = flock(old_fd, LOCK_EX | LOCK_NB) == 0;
+            ok = compact_mailbox(mbox_file_path, old_fd, records, keep, in_place);
+            if (ok && tombstoned > 0) {
+                clear_tombstones(mbox_file_path);
             }
-            copy_msg  += line + "\n";
-        }
-        //Processes the last message
-        if (!message.empty()) {
-            unsigned char digest[MD5_DIGEST_LENGTH];
-            computeDigest(const_cast<char*>(message.c_str()), message.size(), digest);
-            string hash = digestToHexString(digest, MD5_DIGEST_LENGTH);
-            // cout<<"Hash: "<<hash<<endl;
-            if (!deletion_flags[hash]) {
-                temp_file << copy_msg;
+            if (ok && drops_blob(records, keep)) {
+                request_blob_sweep();
             }
+            flock(old_fd, LOCK_UN);
         }
 
-        old_file.close();
-        temp_file.close();
-
-        //Renames temp file to old file
-        rename(temp_file_path.c_str(), mbox_file_path.c_str());
-
-        flock(old_fd, LOCK_UN);
         close(old_fd);
-        pthread_mutex_unlock(&fileMutexMap[mbox_file_path]);
+        unlock_mailbox(mbox_file_path);
 
-        string response = "+OK POP3 server signing off\r\n";
+        string response = ok ? "+OK POP3 server signing off\r\n" : "-ERR some deleted messages not removed\r\n";
         
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Could not communicate with client\r\n");
-        }
-        if (verbose) {
-            fprintf(stderr, "[%d] S: +OK POP3 server signing off\n", client_fd);  
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
-        close(client_fd);
-        pthread_exit(NULL);
+        LOG(LEVEL_DEBUG, "[%d] S: %.*s\n", client_fd, (int)response.size() - 2, response.c_str());
     }
 }
 
@@ -1289,23 +1233,24 @@ void handle_shutdown(int signum) {
     //Unlocks mutex after modifications
     pthread_mutex_unlock(&vector_mutex);
 
+    flush_log();
+    if (verbose) {
+        print_lock_stats(stderr);
+        print_admission_stats(stderr);
+        print_timeout_stats(stderr);
+        if (defer_expunge) {
+            print_expunge_stats(stderr);
+        }
+        print_blob_stats(stderr);
+    }
+
     printf("Server shutdown complete.\n");
     exit(0);  // Terminates the program
 }
 
-// Function to trim leading and trailing whitespaces
-string trim(string& str) {
-    string result = str;
-
-    // Removes leading whitespaces
-    result.erase(result.begin(), find_if(result.begin(), result.end(), [](unsigned char ch) {
-        return !isspace(ch);
-    }));
-
-    // Removes trailing whitespaces
-    result.erase(find_if(result.rbegin(), result.rend(), [](unsigned char ch) {
-        return !isspace(ch);
-    }).base(), result.end());
-
-    return result;
-}
\ No newline at end of file
+//Parses a message number; anything that does not start with digits gives 0, which is never a valid index
+int parse_index(string_view argument) {
+    int value = 0;
+    from_chars(argument.data(), argument.data() + argument.size(), value);
+    return value;
+}
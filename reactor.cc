@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "reactor.h"
+#include "netio.h"
+#include "admission.h"
+#include "timeouts.h"
+#include "log.h"
+
+using namespace std;
+
+extern bool verbose;
+
+namespace {
+
+const size_t OUTPUT_LIMIT = 256 * 1024;     //Unsent reply bytes at which a connection stops being read
+
+//What an event loop keeps for one client socket. Replies are written without blocking; whatever the
+//socket does not take stays in outgoing and goes out when epoll reports the socket writable
+struct Connection {
+    Session* session;
+    int fd;
+    string outgoing;
+    size_t sent;            //Bytes of outgoing already written
+    uint32_t events;        //What the socket is registered for
+    bool closing;           //The session has ended; the socket is closed once outgoing is drained
+};
+
+//One epoll instance per event-loop thread; each client socket belongs to exactly one loop
+vector<int> epoll_fds;
+SessionFactory session_factory = nullptr;
+atomic<unsigned int> next_loop(0);
+
+void close_connection(int epoll_fd, Connection* conn) {
+    LOG(LEVEL_INFO, "[%d] Connection closed\n", conn->fd);
+    if (epoll_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    cancel_timeout(conn->fd);
+    release_connection(conn->fd);
+    close(conn->fd);
+    delete conn->session;
+    delete conn;
+}
+
+//Writes as much of the pending output as the socket takes. False if the client is gone
+bool flush_output(Connection* conn) {
+    while (conn->sent < conn->outgoing.size()) {
+        ssize_t n = send(conn->fd, conn->outgoing.data() + conn->sent, conn->outgoing.size() - conn->sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->sent += n;
+    }
+    if (conn->sent == conn->outgoing.size()) {
+        conn->outgoing.clear();
+        conn->sent = 0;
+    }
+    return true;
+}
+
+//What the socket should be watched for: writability while output is pending, and input unless the session
+//has ended or the client is not reading its replies. Hangups are only asked for together with input, so a
+//half-closed client that is not being read does not wake the loop over and over
+uint32_t wanted_events(const Connection* conn) {
+    size_t pending = conn->outgoing.size() - conn->sent;
+    uint32_t events = 0;
+    if (pending > 0) {
+        events |= EPOLLOUT;
+    }
+    if (!conn->closing && pending < OUTPUT_LIMIT) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    return events;
+}
+
+bool update_events(int epoll_fd, Connection* conn) {
+    uint32_t events = wanted_events(conn);
+    if (events == conn->events) {
+        return true;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+        LOG(LEVEL_ERROR, "[%d] Cannot update event loop registration (%s)\n", conn->fd, strerror(errno));
+        return false;
+    }
+    conn->events = events;
+    return true;
+}
+
+//Reads what the client sent and runs it through the session, with every reply it makes collected in the
+//connection's output. False if the connection should be closed straight away
+bool read_input(Connection* conn, char* buffer, size_t size) {
+    ssize_t bytes_read = recv(conn->fd, buffer, size, 0);
+    if (bytes_read < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (bytes_read == 0) {
+        return false;
+    }
+    begin_reply_capture(&conn->outgoing);
+    bool open = conn->session->onInput(buffer, bytes_read);
+    end_reply_capture();
+    if (!open) {
+        LOG(LEVEL_INFO, "[%d] Closing connection\n", conn->fd);
+        conn->closing = true;
+    }
+    return true;
+}
+
+void *event_loop(void *arg) {
+    int epoll_fd = (int)(intptr_t)arg;
+    struct epoll_event events[64];
+    char read_buffer[4096];
+
+    while (true) {
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(LEVEL_ERROR, "epoll_wait failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            uint32_t happened = events[i].events;
+
+            bool ok = !(happened & EPOLLERR);
+            if (ok && (happened & EPOLLOUT)) {
+                ok = flush_output(conn);
+            }
+            if (ok && (happened & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && (conn->events & EPOLLIN)) {
+                ok = read_input(conn, read_buffer, sizeof(read_buffer)) && flush_output(conn);
+            } else if (ok && (happened & EPOLLHUP)) {
+                ok = false;
+            }
+            if (ok && conn->closing && conn->outgoing.empty()) {
+                ok = false;
+            }
+            if (!ok || !update_events(epoll_fd, conn)) {
+                close_connection(epoll_fd, conn);
+            }
+        }
+    }
+    return nullptr;
+}
+
+}
+
+bool start_reactor(int num_loops, SessionFactory factory) {
+    session_factory = factory;
+
+    for (int i = 0; i < num_loops; i++) {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            fprintf(stderr, "Cannot create epoll instance (%s)\n", strerror(errno));
+            return false;
+        }
+        epoll_fds.push_back(epoll_fd);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, event_loop, (void *)(intptr_t)epoll_fd) != 0) {
+            fprintf(stderr, "Failed to create event loop thread \n");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    return true;
+}
+
+void reactor_add(int client_fd) {
+    //An event loop must never wait on a client, so its sockets only ever read and write what is ready
+    int flags = fcntl(client_fd, F_GETFL);
+    if (flags < 0 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LOG(LEVEL_ERROR, "[%d] Cannot make connection non-blocking (%s)\n", client_fd, strerror(errno));
+        cancel_timeout(client_fd);
+        release_connection(client_fd);
+        close(client_fd);
+        return;
+    }
+
+    //The connection is fully set up, greeting included, before its loop can observe it
+    Connection* conn = new Connection();
+    conn->session = session_factory(client_fd);
+    conn->fd = client_fd;
+    conn->sent = 0;
+    conn->closing = false;
+    begin_reply_capture(&conn->outgoing);
+    conn->session->onConnect();
+    end_reply_capture();
+    if (!flush_output(conn)) {
+        close_connection(-1, conn);
+        return;
+    }
+    conn->events = wanted_events(conn);
+
+    int epoll_fd = epoll_fds[next_loop.fetch_add(1) % epoll_fds.size()];
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = conn->events;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+        LOG(LEVEL_ERROR, "Cannot register connection with event loop (%s)\n", strerror(errno));
+        close_connection(-1, conn);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "session.h"
+
+//Starts num_loops epoll event-loop threads that serve sessions created by factory
+bool start_reactor(int num_loops, SessionFactory factory);
+
+//Hands an accepted client socket to one of the event loops
+void reactor_add(int client_fd);
+
+#endif
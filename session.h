@@ -0,0 +1,27 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <cstddef>
+
+//Per-connection protocol state, driven by whichever I/O loop owns the client socket
+class Session {
+protected:
+    int client_fd;
+
+public:
+    explicit Session(int fd) : client_fd(fd) {}
+    virtual ~Session() {}
+
+    int getFd() const { return client_fd; }
+
+    //Sends the greeting message
+    virtual void onConnect() = 0;
+
+    //Consumes bytes read from the client; returns false once the connection should be closed
+    virtual bool onInput(const char* data, size_t length) = 0;
+};
+
+//Creates the protocol session for a newly accepted client socket
+typedef Session* (*SessionFactory)(int client_fd);
+
+#endif
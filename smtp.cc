@@ -11,14 +11,49 @@
 #include <iostream>
 #include <vector>
 #include <signal.h>
+#include <stdint.h>
+#include <string_view>
 #include "email.h"
+#include "netio.h"
+#include "mailwriter.h"
+#include "linebuffer.h"
+#include "uring.h"
+#include "listener.h"
+#include "session.h"
+#include "reactor.h"
+#include "lockmanager.h"
+#include "deliveryqueue.h"
+#include "userdirectory.h"
+#include "log.h"
+#include "commandtable.h"
+#include "admission.h"
+#include "timeouts.h"
 
 using namespace std; 
 
-bool process_command(int client_fd, string& command, Email &email);
+bool process_command(int client_fd, string_view command, Email &email);
 void *worker(void *arg);
+void accept_loop(int server_fd);
 void handle_shutdown(int signum);
-string trim(string& str);
+
+//SMTP protocol state for one client connection
+class SmtpSession : public Session {
+    Email email;
+    LineBuffer buffer;
+    string replies;     //Replies to one read's worth of pipelined commands
+    bool owns_socket;   //The session's thread may block on the socket, so BDAT chunks can be spliced from it
+
+    bool processInput(const char* data, size_t length);
+
+public:
+    explicit SmtpSession(int fd, bool owns_socket = false) : Session(fd), email("", "", ""), owns_socket(owns_socket) {}
+    void onConnect();
+    bool onInput(const char* data, size_t length);
+};
+
+Session* create_smtp_session(int client_fd) {
+    return new SmtpSession(client_fd);
+}
 
 //Vectors to store thread IDs and client socket file descriptors
 vector<pthread_t> thread_ids;
@@ -28,6 +63,18 @@ pthread_mutex_t vector_mutex = PTHREAD_MUTEX_INITIALIZER;
 int listen_fd;
 bool verbose = false;
 string mail_dir;
+bool use_uring = false;
+int num_acceptors = 0;
+bool steer_accepts = false;
+int reactor_threads = 0;
+size_t spool_threshold = 1024 * 1024;
+size_t max_message_size = 0;
+bool single_instance = false;
+FsyncPolicy fsync_policy = FSYNC_NONE;
+int group_commit_window_us = 200;
+int delivery_workers = 0;
+AdmissionLimits admission_limits = { 0, 0, 0 };
+TimeoutLimits timeout_limits = { 0, 0, 0, 0 };
 
 int main(int argc, char *argv[]) {
     //Signal for Ctrl+C
@@ -37,22 +84,85 @@ int main(int argc, char *argv[]) {
     int c;
 
 	// Parse command-line options
-	while ((c = getopt(argc, argv, "ap:v")) != -1) {
+	while ((c = getopt(argc, argv, "abce:f:i:k:m:n:o:p:q:r:s:uvw:")) != -1) {
 		switch (c) {
 			case 'a':
 				fprintf(stderr, "Mahika Vajpeyi SEAS login: mvajpeyi\n");
 		        return 1;
+            case 'b':
+                // Store multi-recipient messages once and reference them from each mailbox
+                single_instance = true;
+                break;
+            case 'e':
+                // Serve connections from a fixed number of epoll event loops
+                reactor_threads = atoi(optarg);
+                break;
+            case 'f':
+                // When appended mail is flushed to disk: none, message or group
+                if (!parse_fsync_policy(optarg, fsync_policy)) {
+                    fprintf(stderr, "Unknown fsync policy `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                // Maximum number of open sessions from one source address
+                admission_limits.max_per_source = atoi(optarg);
+                break;
+            case 'k':
+                // Maximum number of new connections per second
+                admission_limits.rate = atoi(optarg);
+                break;
+            case 'n':
+                // Maximum number of open sessions
+                admission_limits.max_sessions = atoi(optarg);
+                break;
+            case 'm':
+                // Messages above this many KB are refused with 552
+                max_message_size = (size_t)atol(optarg) * 1024;
+                break;
+            case 'w':
+                // Microseconds a group commit waits for other appends to join
+                group_commit_window_us = atoi(optarg);
+                break;
+            case 'o':
+                // Idle, command and DATA timeouts in seconds and the minimum DATA rate in bytes per second
+                if (!parse_timeout_limits(optarg, timeout_limits)) {
+                    fprintf(stderr, "Invalid timeouts `%s'.\n", optarg);
+                    return 1;
+                }
+                break;
 			case 'p':
                 p = atoi(optarg);
                 printf("port number p is %d\n", p);
 				break;
+            case 'q':
+                // Acknowledge messages once queued and deliver them from this many worker threads
+                delivery_workers = atoi(optarg);
+                break;
+            case 'r':
+                // Number of SO_REUSEPORT listeners, each with its own accept loop
+                num_acceptors = atoi(optarg);
+                break;
+            case 's':
+                // Message bodies above this many KB are spooled to disk
+                spool_threshold = (size_t)atol(optarg) * 1024;
+                break;
+            case 'c':
+                // Steer connections to the listener on the CPU that received them
+                steer_accepts = true;
+                break;
+            case 'u':
+                // Use the io_uring I/O backend when the kernel supports it
+                use_uring = true;
+                break;
             case 'v':
                 // Enable verbose mode
                 verbose = true;
                 break;
             case '?':
                 // Handle missing argument or unknown option
-                if (optopt == 'p')
+                if (optopt == 'p' || optopt == 'e' || optopt == 'r' || optopt == 's' || optopt == 'f' || optopt == 'w' || optopt == 'q' || optopt == 'm' ||
+                    optopt == 'i' || optopt == 'k' || optopt == 'n' || optopt == 'o')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 else if (isprint(optopt))
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -71,50 +181,92 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-  //Sets up listening socket
-  listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (listen_fd < 0) {
-       fprintf(stderr, "Cannot open socket (%s)\n", strerror(errno));
-       exit(1);
-   }
+  if (verbose) {
+      log_level = LEVEL_DEBUG;
+  }
 
-  struct sockaddr_in servaddr; //Declares a structure to hold the server's address information, including IP address and port number
-  bzero(&servaddr, sizeof(servaddr)); //Clears the memory allocated for servaddr by setting all bytes to zero
+  if (!start_user_directory(mail_dir)) {
+      return 1;
+  }
+  if (verbose) {
+      print_user_directory_stats(stderr);
+  }
 
-  servaddr.sin_family = AF_INET; //Specifies the address family as IPv4
-  servaddr.sin_addr.s_addr = htons(INADDR_ANY);  //Sets the server's IP address
-  servaddr.sin_port = htons(p); //Specifies the port number on which the server will listen for incoming connections
+  start_admission(admission_limits, "421 localhost Too many connections, try again later\r\n");
+  if (!start_timeouts(timeout_limits, "421 localhost Timeout, closing transmission channel\r\n")) {
+      exit(1);
+  }
 
-  // Associates the socket (listen_fd) with the specified address (servaddr) and port
-  if(bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0){
-      fprintf(stderr, "Cannot bind socket (%s)\n", strerror(errno));
-      close(listen_fd);
+  //Event loops only queue messages: the mailbox appends, with their locks and fsyncs, are left to the delivery
+  //threads, one per loop unless -q asks for a number
+  if (reactor_threads > 0 && delivery_workers == 0) {
+      delivery_workers = reactor_threads;
+  }
+  if (delivery_workers > 0 && !start_delivery_queue(mail_dir, delivery_workers)) {
       exit(1);
   }
+  start_logger();
 
-  // Marks the socket as a passive socket that will be used to accept incoming connection requests
-  // 100 is the backlog parameter that specifies the maximum number of pending connections that can be queued
-  if(listen(listen_fd, 100) < 0){
-      fprintf(stderr, "Cannot listen for incoming connections (%s)\n", strerror(errno));
+  if (reactor_threads > 0 && !start_reactor(reactor_threads, create_smtp_session)) {
       close(listen_fd);
       exit(1);
   }
 
+  //With -r, several SO_REUSEPORT listeners each run their own accept loop on their own core
+  if (num_acceptors > 0) {
+      vector<int> listen_fds;
+      if (!start_acceptors(p, num_acceptors, steer_accepts, accept_loop, listen_fds)) {
+          exit(1);
+      }
+      listen_fd = listen_fds[0];
+      printf("Server is listening on port %d with %d acceptors...\n", p, num_acceptors);
+      while (true) {
+          pause();
+      }
+  }
+
+  listen_fd = open_listener(p, false);
+  if (listen_fd < 0) {
+      exit(1);
+  }
+
   printf("Server is listening on port %d...\n", p);
+  accept_loop(listen_fd);
+  close(listen_fd);
+  return 0;
+}
+
+void accept_loop(int server_fd) {
+  //The io_uring loop serves every connection from this thread and only returns if io_uring is unavailable
+  if (use_uring) {
+      if (run_uring_server(server_fd, create_smtp_session)) {
+          return;
+      }
+      fprintf(stderr, "Falling back to the default I/O backend\n");
+  }
 
   while(true) {
     struct sockaddr_in clientaddr; //Declares a structure to hold the client's address information upon connection
     socklen_t clientaddrlen = sizeof(clientaddr); //Sets the length of the Client Address Structure
     
     //Accepts an Incoming Connection; Stores the returned client socket file descriptor in the allocated memory pointed to by fd
-    int fd_ptr = accept(listen_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
+    int fd_ptr = accept(server_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
     if (fd_ptr < 0) {
-      fprintf(stderr, "Cannot accept connection \n");
+      LOG(LEVEL_ERROR, "Cannot accept connection \n");
       exit(1);
     }
 
-    if (verbose) {
-        fprintf(stderr, "[%d] New connection\n", fd_ptr);  // Verbose: New connection
+    //Clients over the admission limits are answered and closed here, before a thread or session is made for them
+    if (!admit_connection(fd_ptr, clientaddr)) {
+        continue;
+    }
+
+    LOG(LEVEL_INFO, "[%d] New connection\n", fd_ptr);
+
+    //In reactor mode the connection becomes per-connection state owned by an event loop
+    if (reactor_threads > 0) {
+        reactor_add(fd_ptr);
+        continue;
     }
     
     pthread_t thread;
@@ -122,11 +274,12 @@ int main(int argc, char *argv[]) {
     &thread: Pointer to the thread identifier
     NULL: Default thread attributes
     worker: The function that the thread will execute; responsible for handling client communication
-    fd: Pointer to the client's socket file descriptor, which is passed as an argument to the worker function  
+    fd: The client's socket file descriptor, passed by value so the next accept cannot overwrite it
     */
-    if(pthread_create(&thread, NULL, worker, (void *)&fd_ptr) != 0){
+    if(pthread_create(&thread, NULL, worker, (void *)(intptr_t)fd_ptr) != 0){
         cout << " error calling worker " << endl;
-        fprintf(stderr, "Failed to create thread \n");
+        LOG(LEVEL_ERROR, "Failed to create thread \n");
+        release_connection(fd_ptr);
         close(fd_ptr);
     } else {
         pthread_mutex_lock(&vector_mutex);
@@ -139,153 +292,196 @@ int main(int argc, char *argv[]) {
 
     pthread_detach(thread); // Detach the thread so that resources are freed upon completion
     }
-    close(listen_fd);
-    return 0;
 }
 
-void *worker(void *arg) {
-    int client_fd = *(int*)arg;
+void SmtpSession::onConnect() {
+    arm_timeout(client_fd);
 
     //Sends greeting messsage
     const char* message = "220 localhost SMTP server is ready\r\n";
     int messageLength = strlen(message);
 
-    if (write(client_fd, message, messageLength) < 0) { //Send bytes
-        fprintf(stderr, "error sending greeting\n");
-        exit(1);
+    if (send_reply(client_fd, message, messageLength) < 0) { //Send bytes
+        LOG(LEVEL_WARNING, "error sending greeting\n");
+        return;
     }
 
-    if (verbose) {
-        fprintf(stderr, "[%d] S: 220 localhost SMTP server is ready\n", client_fd);  // Verbose: Server ready message
+    LOG(LEVEL_DEBUG, "[%d] S: 220 localhost SMTP server is ready\n", client_fd);
+}
+
+bool SmtpSession::onInput(const char* data, size_t length) {
+    //Replies to every command completed by this read are coalesced and sent with one write (PIPELINING).
+    //The io_uring loop already captures replies itself
+    bool batching = !reply_capture_active();
+    if (batching) {
+        replies.clear();
+        begin_reply_capture(&replies);
     }
 
-    //Instantiates the Email object after the verbose log message
-    Email email("", "", "");
+    bool keep_open = processInput(data, length);
 
-    // email.displayEmailInfo();
+    if (batching) {
+        end_reply_capture();
+        if (!replies.empty() && send_reply(client_fd, replies.data(), replies.size()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
+        }
+    }
+
+    //A half-received command line has less time to finish than a session waiting for its next command
+    update_timeout(client_fd, email.isReceivingData() ? PHASE_DATA : (buffer.empty() ? PHASE_IDLE : PHASE_COMMAND),
+                   length);
+    return keep_open;
+}
+
+bool SmtpSession::processInput(const char* data, size_t length) {
+    // Appends the received data to the buffer
+    buffer.append(data, length);
+
+    while (true) {
+        //Message bytes after DATA or BDAT go to the Email object until the end of the message or chunk
+        if (email.isReceivingData()) {
+            if (buffer.empty()) {
+                //Once the buffered bytes are used up, the rest of a BDAT chunk can skip user space
+                if (owns_socket && email.spliceChunk(client_fd, mail_dir)) {
+                    continue;
+                }
+                break;
+            }
+            string_view pending = buffer.unread();
+            buffer.consume(email.receiveData(client_fd, pending.data(), pending.size(), mail_dir));
+            continue;
+        }
+
+        //Processes the next complete line in the buffer; the line is a view into the buffer, not a copy
+        string_view line;
+        if (!buffer.nextLine(line)) {
+            break;
+        }
+
+        LOG(LEVEL_DEBUG, "[%d] C: %.*s\n", client_fd, (int)line.size(), line.data());
+
+        if (!process_command(client_fd, line, email)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void *worker(void *arg) {
+    int client_fd = (int)(intptr_t)arg;
+
+    //Instantiates the session, which sends the greeting and owns the Email object
+    SmtpSession session(client_fd, true);
+    session.onConnect();
 
     char read_buffer[2000];
     ssize_t bytes_read;
 
     //Clears the buffer before reading
     memset(read_buffer, 0, sizeof(read_buffer));
-    string buffer;
 
     while (true) {
         //Reads data from the client socket
         bytes_read = read(client_fd, read_buffer, sizeof(read_buffer)-1);
         if (bytes_read < 0) {
-            fprintf(stderr, "read failed");
+            LOG(LEVEL_WARNING, "read failed\n");
             break;
         } else if (bytes_read == 0) {
-            fprintf(stderr, "Client disconnected\n");
+            LOG(LEVEL_INFO, "Client disconnected\n");
             break;
         }
 
-        //Null terminates the buffer
-        read_buffer[bytes_read] = '\0';
-
-        // Appends the received data to the buffer
-        buffer.append(read_buffer, bytes_read);
-
-        //Processes all complete lines in the buffer
-        size_t pos;
-        while ((pos = buffer.find("\n")) != string::npos) {
-            //Extracts the line (excluding the newline character)
-            string line = buffer.substr(0, pos);
-
-            //Removes carriage return if present (handles CRLF)
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
+        if (!session.onInput(read_buffer, bytes_read)) {
+            LOG(LEVEL_INFO, "[%d] Closing connection\n", client_fd);
+
+            // Locks mutex before modifying the shared vectors
+            pthread_mutex_lock(&vector_mutex);
+            
+            // Removes thread ID and client FD from the vectors
+            auto it = find(client_fds.begin(), client_fds.end(), client_fd);
+            if (it != client_fds.end()) {
+                int index = distance(client_fds.begin(), it);
+                thread_ids.erase(thread_ids.begin() + index);
+                client_fds.erase(it);
             }
+            
+            // Unlocks mutex after modification
+            pthread_mutex_unlock(&vector_mutex);
 
-            if (verbose) {
-                fprintf(stderr, "[%d] C: %s\n", client_fd, line.c_str());  // Verbose: Command received
-            }
+            cancel_timeout(client_fd);
 
-            bool result = process_command(client_fd, line, email);
-            //Removes the processed line from the buffer
-            buffer.erase(0, pos + 1);
-
-            if(!result){
-                if (verbose) {
-                    fprintf(stderr, "[%d] Closing connection\n", client_fd);  // Verbose: Connection closed
-                }
-
-                // Locks mutex before modifying the shared vectors
-                pthread_mutex_lock(&vector_mutex);
-                
-                // Removes thread ID and client FD from the vectors
-                auto it = find(client_fds.begin(), client_fds.end(), client_fd);
-                if (it != client_fds.end()) {
-                    int index = distance(client_fds.begin(), it);
-                    thread_ids.erase(thread_ids.begin() + index);
-                    client_fds.erase(it);
-                }
-                
-                // Unlocks mutex after modification
-                pthread_mutex_unlock(&vector_mutex);
-
-                close(client_fd);
-                pthread_exit(NULL);
-                break;
-            }
+            release_connection(client_fd);
+            close(client_fd);
+            pthread_exit(NULL);
         }
     }
-    if (verbose) {
-        fprintf(stderr, "[%d] Connection closed\n", client_fd);  // Verbose: Connection closed
-    }
+    LOG(LEVEL_INFO, "[%d] Connection closed\n", client_fd);
+
+    cancel_timeout(client_fd);
 
+    release_connection(client_fd);
     close(client_fd);
     pthread_exit(NULL);
 }
 
-bool process_command(int client_fd, string& command, Email& email) {
-    command = trim(command);  //Trims the command
-
-    //Finds the position of the first space to split the command and its argument
-    size_t space_pos = command.find(' ');
-
-    //Extracts the command (before the space) and the argument (after the space)
-    string cmd = (space_pos != string::npos) ? command.substr(0, space_pos) : command;
-    string argument = (space_pos != string::npos) ? command.substr(space_pos + 1) : "";
-
-    //Converts the command part to uppercase for case insensitivity
-    transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-
-    if (cmd == "HELO") {
-        email.process_HELO(argument, client_fd);
-        return true;
-    } else if (cmd == "MAIL") {
-        email.process_MAILFROM(argument, client_fd);
-        return true;
-    } else if (cmd == "RCPT") {
-        email.process_RCPTTO(argument, client_fd, mail_dir);
-        return true;
-    } else if (cmd == "DATA") {
-        email.process_DATA(client_fd, argument, mail_dir);
-        return true;
-    } else if (cmd == "RSET") {
-        email.process_RSET(client_fd, argument);
-        return true;
-    } else if (cmd == "NOOP") {
-        email.process_NOOP(client_fd, argument);
-        return true;
-    } else if (cmd == "QUIT" || cmd =="QUIT\r\n") {
-        email.process_QUIT(client_fd, argument);
-        return false;
-    } else {
+//SMTP commands with the states each is accepted in; a command sent in any other state gets 503. Handlers
+//return false to close the connection. BDAT checks its state itself because a refused chunk still has to
+//be read past
+struct SmtpCommand {
+    uint32_t code;
+    unsigned states;
+    bool (*handler)(int client_fd, string_view argument, Email& email);
+};
+
+constexpr SmtpCommand smtp_commands[] = {
+    { command_code("HELO"), state_bit(Email::INIT) | state_bit(Email::HELO),
+      [](int client_fd, string_view argument, Email& email) { email.process_HELO(argument, client_fd); return true; } },
+    { command_code("EHLO"), state_bit(Email::INIT) | state_bit(Email::HELO),
+      [](int client_fd, string_view argument, Email& email) { email.process_EHLO(argument, client_fd); return true; } },
+    { command_code("MAIL"), state_bit(Email::HELO),
+      [](int client_fd, string_view argument, Email& email) { email.process_MAILFROM(argument, client_fd); return true; } },
+    { command_code("RCPT"), state_bit(Email::MAIL) | state_bit(Email::RCPT),
+      [](int client_fd, string_view argument, Email& email) { email.process_RCPTTO(argument, client_fd, mail_dir); return true; } },
+    { command_code("BDAT"), ANY_STATE,
+      [](int client_fd, string_view argument, Email& email) { email.process_BDAT(argument, client_fd, mail_dir); return true; } },
+    { command_code("DATA"), state_bit(Email::RCPT),
+      [](int client_fd, string_view argument, Email& email) { email.process_DATA(client_fd, argument, mail_dir); return true; } },
+    { command_code("RSET"), ANY_STATE & ~state_bit(Email::INIT),
+      [](int client_fd, string_view argument, Email& email) { email.process_RSET(client_fd, argument); return true; } },
+    { command_code("NOOP"), state_bit(Email::INIT),
+      [](int client_fd, string_view argument, Email& email) { email.process_NOOP(client_fd, argument); return true; } },
+    { command_code("QUIT"), ANY_STATE,
+      [](int client_fd, string_view argument, Email& email) { email.process_QUIT(client_fd, argument); return false; } },
+};
+
+constexpr CommandTable<SmtpCommand> smtp_table = make_command_table(smtp_commands);
+
+bool process_command(int client_fd, string_view command, Email& email) {
+    string_view word;
+    string_view argument;
+    split_command(command, word, argument);
+
+    const SmtpCommand* entry = smtp_table.find(command_code(word));
+    if (entry == nullptr) {
         //Handles unknown commands
         string response = "500 Syntax error, command unrecognized\r\n";
-        if (write(client_fd, response.c_str(), response.length()) < 0) {
-            fprintf(stderr, "Error sending unknown command response\n");
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Error sending unknown command response\n");
         }
 
-        if (verbose) {
-            fprintf(stderr, "[%d] S: 500 Syntax error, command unrecognized\n", client_fd);  // Verbose: Server ready message
+        LOG(LEVEL_DEBUG, "[%d] S: 500 Syntax error, command unrecognized\n", client_fd);
+        return true;
+    }
+
+    if ((entry->states & state_bit(email.getPreviousState())) == 0) {
+        string response = "503 Bad sequence of commands\r\n";
+        if (send_reply(client_fd, response.c_str(), response.length()) < 0) {
+            LOG(LEVEL_WARNING, "Could not communicate with client\r\n");
         }
+        LOG(LEVEL_DEBUG, "[%d] S: 503 Bad sequence of commands\n", client_fd);
         return true;
     }
+    return entry->handler(client_fd, argument, email);
 }
 
 // Signal handler for SIGINT (Ctrl+C)
@@ -312,23 +508,16 @@ void handle_shutdown(int signum) {
     //Unlocks mutex after modifications
     pthread_mutex_unlock(&vector_mutex);
 
+    flush_log();
+    if (verbose) {
+        print_lock_stats(stderr);
+        print_admission_stats(stderr);
+        print_timeout_stats(stderr);
+        if (delivery_workers > 0) {
+            print_queue_stats(stderr);
+        }
+    }
+
     printf("Server shutdown complete.\n");
     exit(0);  // Terminates the program
 }
-
-// Function to trim leading and trailing whitespaces
-string trim(string& str) {
-    string result = str;
-
-    // Removes leading whitespaces
-    result.erase(result.begin(), find_if(result.begin(), result.end(), [](unsigned char ch) {
-        return !isspace(ch);
-    }));
-
-    // Removes trailing whitespaces
-    result.erase(find_if(result.rbegin(), result.rend(), [](unsigned char ch) {
-        return !isspace(ch);
-    }).base(), result.end());
-
-    return result;
-}
\ No newline at end of file
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+#include "timeouts.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+const int64_t TICK_MS = 100;
+const int WHEEL_BITS = 6;
+const size_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+const int WHEEL_LEVELS = 4;                                        //64^4 ticks, about 19 days
+const uint64_t WHEEL_SPAN = (1ull << (WHEEL_BITS * (WHEEL_LEVELS - 1))) * (WHEEL_SLOTS - 1);
+const uint64_t NEVER = UINT64_MAX;
+const int64_t RATE_WINDOW_MS = 30000;                              //Period over which min_rate is averaged
+
+//Why a connection timed out; the phases plus a body arriving below the minimum rate
+const int TOO_SLOW = PHASE_DATA + 1;
+
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;
+    int fd;
+    atomic<uint64_t> deadline;      //Tick the connection times out at, or NEVER
+    atomic<uint64_t> slot_tick;     //Tick of the slot the node is queued in; never later than deadline
+    atomic<bool> queued;
+    atomic<bool> expired;           //Timed out or cancelled; later updates are ignored until it is armed again
+    atomic<int> reason;
+
+    //Rate accounting, only touched by the thread serving the connection
+    int64_t window_start_ms;
+    size_t window_bytes;
+
+    TimerNode() : prev(this), next(this), fd(-1), deadline(NEVER), slot_tick(NEVER), queued(false),
+                  expired(true), reason(PHASE_IDLE), window_start_ms(0), window_bytes(0) {}
+};
+
+TimeoutLimits limits = { 0, 0, 0, 0 };
+const char* timeout_reply = "";
+size_t timeout_reply_length = 0;
+
+//The wheel: level l holds the nodes due within 64^(l+1) ticks, in slots of 64^l ticks. Each time the
+//lower levels wrap around, the next slot of the level above is spread back over them
+pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+TimerNode wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+uint64_t current_tick = 0;
+size_t armed = 0;
+
+//One node per descriptor, created on first use and reused by whichever connection gets that number next
+vector<TimerNode*> nodes;
+
+atomic<uint64_t> timed_out[TOO_SLOW + 1];
+
+int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+uint64_t now_tick() {
+    return now_ms() / TICK_MS;
+}
+
+void unlink_node(TimerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = node;
+    node->queued = false;
+    armed--;
+}
+
+void insert_node(TimerNode* node, uint64_t tick) {
+    if (tick < current_tick) {
+        tick = current_tick;
+    }
+    if (tick - current_tick > WHEEL_SPAN) {
+        //Deadlines this far out come back to the top level and are re-queued when they get there
+        tick = current_tick + WHEEL_SPAN;
+    }
+    uint64_t delta = tick - current_tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    TimerNode* head = &wheel[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+    node->slot_tick = tick;
+    node->queued = true;
+    armed++;
+}
+
+//Requeues a node at its current deadline, under wheel_lock
+void requeue_node(TimerNode* node) {
+    if (node->queued) {
+        unlink_node(node);
+    }
+    uint64_t deadline = node->deadline;
+    if (deadline != NEVER && !node->expired) {
+        insert_node(node, deadline);
+    }
+}
+
+void fire(TimerNode* node) {
+    node->expired = true;
+    int reason = node->reason;
+    timed_out[reason].fetch_add(1, memory_order_relaxed);
+    const char* names[] = { "idle", "command", "data", "below minimum rate" };
+    LOG(LEVEL_INFO, "[%d] Timed out (%s)\n", node->fd, names[reason]);
+
+    //Shutting the socket down wakes the thread or event loop serving it, which then closes the session
+    send(node->fd, timeout_reply, timeout_reply_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(node->fd, SHUT_RDWR);
+}
+
+//Moves the nodes of a slot of an upper level down to where their deadlines now belong
+void cascade(int level, size_t slot) {
+    TimerNode* head = &wheel[level][slot];
+    while (head->next != head) {
+        TimerNode* node = head->next;
+        unlink_node(node);
+        uint64_t deadline = node->deadline;
+        if (!node->expired && deadline != NEVER) {
+            insert_node(node, deadline);
+        }
+    }
+}
+
+void advance_tick() {
+    if ((current_tick & (WHEEL_SLOTS - 1)) == 0) {
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            size_t slot = (current_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            cascade(level, slot);
+            if (slot != 0) {
+                break;
+            }
+        }
+    }
+
+    TimerNode* head = &wheel[0][current_tick & (WHEEL_SLOTS - 1)];
+    while (head->next != head) {
+        TimerNode* node = head->next;
+        unlink_node(node);
+        uint64_t deadline = node->deadline;
+        if (node->expired || deadline == NEVER) {
+            continue;
+        }
+        if (deadline > current_tick) {
+            //The connection received data since it was queued
+            insert_node(node, deadline);
+        } else {
+            fire(node);
+        }
+    }
+    current_tick++;
+}
+
+void *run_wheel(void *arg) {
+    while (true) {
+        usleep(TICK_MS * 1000);
+        uint64_t target = now_tick();
+        pthread_mutex_lock(&wheel_lock);
+        while (current_tick <= target) {
+            advance_tick();
+        }
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+TimerNode* node_for(int client_fd) {
+    if (client_fd < 0 || (size_t)client_fd >= nodes.size()) {
+        return nullptr;
+    }
+    return nodes[client_fd];
+}
+
+uint64_t deadline_after(int64_t now, int seconds) {
+    return (seconds > 0) ? (uint64_t)(now + seconds * 1000LL) / TICK_MS : NEVER;
+}
+
+}
+
+bool parse_timeout_limits(const char* text, TimeoutLimits& limits) {
+    int* fields[] = { &limits.idle, &limits.command, &limits.data, &limits.min_rate };
+    const char* p = text;
+    for (int i = 0; i < 4; i++) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < 0) {
+            return false;
+        }
+        *fields[i] = (int)value;
+        if (*end == '\0') {
+            return true;
+        }
+        if (*end != ',') {
+            return false;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+bool start_timeouts(const TimeoutLimits& new_limits, const char* reply) {
+    limits = new_limits;
+    timeout_reply = reply;
+    timeout_reply_length = strlen(reply);
+
+    //No descriptor can be numbered past the open file limit
+    struct rlimit rl;
+    size_t max_fds = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        max_fds = min((size_t)rl.rlim_cur, (size_t)1 << 20);
+    }
+    nodes.assign(max_fds, nullptr);
+    current_tick = now_tick();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_wheel, NULL) != 0) {
+        fprintf(stderr, "Failed to create timer thread \n");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void arm_timeout(int client_fd) {
+    if (client_fd < 0 || (size_t)client_fd >= nodes.size()) {
+        return;
+    }
+    int64_t now = now_ms();
+    pthread_mutex_lock(&wheel_lock);
+    TimerNode* node = nodes[client_fd];
+    if (node == nullptr) {
+        node = new TimerNode();
+        node->fd = client_fd;
+        nodes[client_fd] = node;
+    }
+    node->expired = false;
+    node->reason = PHASE_IDLE;
+    node->window_start_ms = now;
+    node->window_bytes = 0;
+    node->deadline = deadline_after(now, limits.idle);
+    requeue_node(node);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void update_timeout(int client_fd, ConnectionPhase phase, size_t bytes_received) {
+    TimerNode* node = node_for(client_fd);
+    if (node == nullptr || node->expired) {
+        return;
+    }
+    int64_t now = now_ms();
+    int previous = node->reason;
+
+    uint64_t deadline;
+    if (phase == PHASE_DATA) {
+        if (previous != PHASE_DATA) {
+            node->window_start_ms = now;
+            node->window_bytes = 0;
+        }
+        node->window_bytes += bytes_received;
+        int64_t elapsed = now - node->window_start_ms;
+        bool too_slow = false;
+        if (limits.min_rate > 0 && elapsed >= RATE_WINDOW_MS) {
+            too_slow = node->window_bytes * 1000 < (size_t)limits.min_rate * elapsed;
+            node->window_start_ms = now;
+            node->window_bytes = 0;
+        }
+        node->reason = too_slow ? TOO_SLOW : PHASE_DATA;
+        deadline = too_slow ? now / TICK_MS : deadline_after(now, limits.data);
+    } else {
+        node->reason = phase;
+        deadline = deadline_after(now, (phase == PHASE_COMMAND) ? limits.command : limits.idle);
+    }
+
+    //A later deadline is only stored; the wheel entry is moved once the earlier one comes due
+    node->deadline = deadline;
+    if (deadline != NEVER && (!node->queued || deadline < node->slot_tick)) {
+        pthread_mutex_lock(&wheel_lock);
+        requeue_node(node);
+        pthread_mutex_unlock(&wheel_lock);
+    }
+}
+
+void cancel_timeout(int client_fd) {
+    TimerNode* node = node_for(client_fd);
+    if (node == nullptr) {
+        return;
+    }
+    //Taking the lock also waits out a timeout firing for this descriptor right now
+    pthread_mutex_lock(&wheel_lock);
+    node->expired = true;
+    node->deadline = NEVER;
+    if (node->queued) {
+        unlink_node(node);
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+TimeoutStats timeout_stats() {
+    TimeoutStats stats;
+    stats.idle = timed_out[PHASE_IDLE].load(memory_order_relaxed);
+    stats.command = timed_out[PHASE_COMMAND].load(memory_order_relaxed);
+    stats.data = timed_out[PHASE_DATA].load(memory_order_relaxed);
+    stats.too_slow = timed_out[TOO_SLOW].load(memory_order_relaxed);
+    pthread_mutex_lock(&wheel_lock);
+    stats.armed = armed;
+    pthread_mutex_unlock(&wheel_lock);
+    return stats;
+}
+
+void print_timeout_stats(FILE* out) {
+    TimeoutStats stats = timeout_stats();
+    fprintf(out, "Timeouts: %llu idle, %llu command, %llu data, %llu below the minimum rate; %zu timers armed\n",
+            (unsigned long long)stats.idle, (unsigned long long)stats.command, (unsigned long long)stats.data,
+            (unsigned long long)stats.too_slow, stats.armed);
+}
@@ -0,0 +1,54 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//Per-connection deadlines for both servers, kept in one hierarchical timer wheel with a 100 ms tick.
+//Arming, moving and cancelling a deadline are O(1), and a connection that keeps receiving data only
+//stores its new deadline; its wheel entry is moved lazily when the old one comes due. When a deadline
+//passes, the client gets the timeout reply and its socket is shut down, which wakes whichever I/O
+//backend is waiting on it so the session is closed and reclaimed the usual way
+
+struct TimeoutLimits {
+    int idle;           //Seconds a session may wait for a command with nothing received
+    int command;        //Seconds from the first byte of a command line to its end
+    int data;           //Seconds a message body may go without receiving anything
+    int min_rate;       //Bytes per second a message body must average; 0 for no minimum
+};
+
+//What a session is waiting for, which decides the limit that applies
+enum ConnectionPhase {
+    PHASE_IDLE,
+    PHASE_COMMAND,
+    PHASE_DATA
+};
+
+struct TimeoutStats {
+    uint64_t idle;
+    uint64_t command;
+    uint64_t data;
+    uint64_t too_slow;
+    size_t armed;
+};
+
+//Parses idle[,command[,data[,min_rate]]]; a 0 turns that limit off
+bool parse_timeout_limits(const char* text, TimeoutLimits& limits);
+
+//Sets the limits and the reply sent to timed-out clients, and starts the thread that runs the wheel
+bool start_timeouts(const TimeoutLimits& limits, const char* reply);
+
+//Starts a new session's deadline in the idle phase
+void arm_timeout(int client_fd);
+
+//Moves a session's deadline after it received bytes and is now in phase
+void update_timeout(int client_fd, ConnectionPhase phase, size_t bytes_received);
+
+//Drops a session's deadline; called before its socket is closed so the descriptor can be reused safely
+void cancel_timeout(int client_fd);
+
+TimeoutStats timeout_stats();
+void print_timeout_stats(FILE* out);
+
+#endif
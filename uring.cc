@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "uring.h"
+#include "netio.h"
+#include "admission.h"
+#include "timeouts.h"
+#include "log.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif
+
+//Provided buffers (and with them SEND/RECV) arrived in the same kernel release as IORING_CQE_F_BUFFER
+#if defined(__NR_io_uring_setup) && defined(IORING_CQE_F_BUFFER)
+#define HAVE_IO_URING 1
+#endif
+
+extern bool verbose;
+
+#ifdef HAVE_IO_URING
+
+using namespace std;
+
+namespace {
+
+const unsigned RING_ENTRIES = 256;
+const unsigned BUFFER_GROUP = 1;
+const unsigned NUM_BUFFERS = 512;
+const unsigned BUFFER_SIZE = 4096;
+const size_t STREAM_CHUNK = 65536;      //Bytes of a captured file range read for each SEND
+
+//The low bits of user_data tell which operation completed; the rest is the connection pointer
+enum UringOp { OP_ACCEPT = 0, OP_RECV = 1, OP_SEND = 2, OP_PROVIDE = 3 };
+const uint64_t OP_MASK = 3;
+
+struct UringConnection {
+    Session* session;
+    string outgoing;    //Replies captured from the session, sent with a single SEND up to the next range
+    size_t sent;
+    vector<CapturedRange> ranges;   //File ranges, such as RETR bodies, that go out between parts of outgoing
+    size_t next_range;
+    string chunk;       //The part of ranges[next_range] being sent
+    size_t chunk_sent;
+    bool sending_chunk; //The SEND in flight is from chunk rather than outgoing
+    size_t send_length; //What the SEND in flight was asked to send
+    bool recv_linked;   //The SEND in flight ends the reply and has the next receive linked behind it
+    int pending;        //Submitted operations that have not completed yet
+    bool closing;
+};
+
+//Minimal io_uring wrapper on top of the raw system calls
+class IoUring {
+private:
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned local_tail;
+    unsigned to_submit;
+
+public:
+    IoUring() : ring_fd(-1), local_tail(0), to_submit(0) {}
+
+    bool init(unsigned entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = max(sq_size, cq_size);
+        }
+
+        char* sq_ptr = (char*)mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return false;
+        }
+        char* cq_ptr = sq_ptr;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            cq_ptr = (char*)mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqes = (struct io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+        sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+        cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+        local_tail = *sq_tail;
+        return true;
+    }
+
+    //Checks that the kernel implements every opcode the event loop relies on
+    bool supports(const int* opcodes, int count) {
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+        bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+        for (int i = 0; ok && i < count; i++) {
+            ok = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+        }
+        free(probe);
+        return ok;
+    }
+
+    struct io_uring_sqe* getSqe() {
+        if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            //The submission queue is full; hands the queued entries to the kernel first
+            submitAndWait(0);
+        }
+        unsigned index = local_tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        local_tail++;
+        to_submit++;
+        return sqe;
+    }
+
+    //Submits every queued entry with one io_uring_enter and optionally waits for completions
+    int submitAndWait(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        while (true) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret > 0) {
+                to_submit -= ret;
+            }
+            return ret;
+        }
+    }
+
+    bool peekCqe(struct io_uring_cqe& out) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        out = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+//Each accept loop thread (see -r) runs its own ring
+thread_local IoUring ring;
+thread_local char* buffers = nullptr;
+thread_local bool multishot_accept = false;
+thread_local int server_fd = -1;
+//Connections whose receive found every provided buffer in use; re-armed once buffers are handed back
+thread_local vector<UringConnection*> waiting_for_buffer;
+SessionFactory session_factory = nullptr;
+
+void provide_buffers(unsigned first, unsigned count) {
+    struct io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(buffers + (size_t)first * BUFFER_SIZE);
+    sqe->len = BUFFER_SIZE;
+    sqe->off = first;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = OP_PROVIDE;
+}
+
+void arm_accept() {
+    struct io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+#endif
+    sqe->user_data = OP_ACCEPT;
+}
+
+void arm_recv(UringConnection* conn) {
+    struct io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->session->getFd();
+    sqe->len = BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uint64_t)conn | OP_RECV;
+    conn->pending++;
+}
+
+//Closes the descriptors of the file ranges that were not sent
+void drop_ranges(UringConnection* conn) {
+    for (size_t i = conn->next_range; i < conn->ranges.size(); i++) {
+        close(conn->ranges[i].file_fd);
+    }
+    conn->ranges.clear();
+    conn->next_range = 0;
+}
+
+void destroy_connection(UringConnection* conn) {
+    drop_ranges(conn);
+    int client_fd = conn->session->getFd();
+    LOG(LEVEL_INFO, "[%d] Connection closed\n", client_fd);
+    cancel_timeout(client_fd);
+    release_connection(client_fd);
+    close(client_fd);
+    delete conn->session;
+    delete conn;
+}
+
+//Picks what the next SEND carries: the rest of the chunk being streamed, the captured replies up to the
+//next file range, or a new chunk read from that range. Returns false once the whole reply was sent
+bool next_send(UringConnection* conn, const char*& data, size_t& length) {
+    while (true) {
+        if (conn->chunk_sent < conn->chunk.size()) {
+            conn->sending_chunk = true;
+            data = conn->chunk.data() + conn->chunk_sent;
+            length = conn->chunk.size() - conn->chunk_sent;
+            return true;
+        }
+        bool in_range = conn->next_range < conn->ranges.size();
+        size_t until = in_range ? conn->ranges[conn->next_range].at : conn->outgoing.size();
+        if (conn->sent < until) {
+            conn->sending_chunk = false;
+            data = conn->outgoing.data() + conn->sent;
+            length = until - conn->sent;
+            return true;
+        }
+        if (!in_range) {
+            return false;
+        }
+
+        CapturedRange& range = conn->ranges[conn->next_range];
+        conn->chunk.clear();
+        conn->chunk_sent = 0;
+        if (read_range_chunk(range, conn->chunk, STREAM_CHUNK) < 0) {
+            //The reply cannot be finished, so the client is cut off rather than sent a broken one
+            LOG(LEVEL_ERROR, "[%d] Cannot read reply data (%s)\n", conn->session->getFd(), strerror(errno));
+            drop_ranges(conn);
+            conn->chunk.clear();
+            conn->sent = conn->outgoing.size();
+            conn->closing = true;
+            return false;
+        }
+        if (range.length == 0) {
+            close(range.file_fd);
+            conn->next_range++;
+        }
+    }
+}
+
+//Queues the next part of the captured reply and, once the last part is queued while the session is open,
+//the next receive linked behind it
+void flush_connection(UringConnection* conn) {
+    const char* data = nullptr;
+    size_t length = 0;
+    bool sending = next_send(conn, data, length);
+    bool last = !sending || (conn->next_range == conn->ranges.size() &&
+                             (!conn->sending_chunk || conn->sent == conn->outgoing.size()));
+    conn->recv_linked = sending && last && !conn->closing;
+    if (sending) {
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->session->getFd();
+        sqe->addr = (uint64_t)data;
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (conn->recv_linked) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe->user_data = (uint64_t)conn | OP_SEND;
+        conn->send_length = length;
+        conn->pending++;
+    }
+    if (!conn->closing && last) {
+        arm_recv(conn);
+    } else if (conn->closing && conn->pending == 0) {
+        destroy_connection(conn);
+    }
+}
+
+//Gives every connection that ran out of buffers another receive now that some were handed back
+void rearm_waiting() {
+    vector<UringConnection*> waiting;
+    waiting.swap(waiting_for_buffer);
+    for (UringConnection* conn : waiting) {
+        arm_recv(conn);
+    }
+}
+
+//Sets up a session turn whose replies are captured into the connection
+void begin_turn(UringConnection* conn) {
+    drop_ranges(conn);
+    conn->outgoing.clear();
+    conn->sent = 0;
+    conn->chunk.clear();
+    conn->chunk_sent = 0;
+    begin_reply_capture(&conn->outgoing, &conn->ranges);
+}
+
+void handle_accept(int res, unsigned flags) {
+    if (res >= 0 && !admit_connection(res)) {
+        //Refused by admission control, which has already answered and closed the socket
+    } else if (res >= 0) {
+        LOG(LEVEL_INFO, "[%d] New connection\n", res);
+        UringConnection* conn = new UringConnection();
+        conn->session = session_factory(res);
+        conn->pending = 0;
+        conn->closing = false;
+
+        begin_turn(conn);
+        conn->session->onConnect();
+        end_reply_capture();
+        flush_connection(conn);
+    } else if (res == -EINVAL && multishot_accept) {
+        //Older kernels reject multishot accept; single-shot accepts are re-armed one by one
+        multishot_accept = false;
+    } else {
+        LOG(LEVEL_ERROR, "Cannot accept connection (%s)\n", strerror(-res));
+    }
+
+#ifdef IORING_CQE_F_MORE
+    if (!(flags & IORING_CQE_F_MORE)) {
+        arm_accept();
+    }
+#else
+    (void)flags;
+    arm_accept();
+#endif
+}
+
+void handle_recv(UringConnection* conn, int res, unsigned flags) {
+    conn->pending--;
+    if (res == -ENOBUFS && !conn->closing) {
+        //Every provided buffer is in use. Receiving again at once would spin this thread, which is the one
+        //that has to hand them back, so the connection waits until some are provided again
+        waiting_for_buffer.push_back(conn);
+        return;
+    }
+    if (res == -ECANCELED && !conn->closing) {
+        //The linked send came up short; its completion re-arms the receive
+        return;
+    }
+    if (res <= 0 || conn->closing) {
+        conn->closing = true;
+        if (conn->pending == 0) {
+            destroy_connection(conn);
+        }
+        return;
+    }
+
+    unsigned buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+    const char* data = buffers + (size_t)buffer_id * BUFFER_SIZE;
+
+    //Runs the whole session turn; its replies become one SEND, with any file ranges streamed in chunks
+    begin_turn(conn);
+    bool keep_open = conn->session->onInput(data, res);
+    end_reply_capture();
+
+    provide_buffers(buffer_id, 1);
+    if (!keep_open) {
+        LOG(LEVEL_INFO, "[%d] Closing connection\n", conn->session->getFd());
+        conn->closing = true;
+    }
+    flush_connection(conn);
+}
+
+void handle_send(UringConnection* conn, int res) {
+    conn->pending--;
+    if (res < 0) {
+        conn->closing = true;
+        if (conn->pending == 0) {
+            destroy_connection(conn);
+        }
+        return;
+    }
+
+    if (conn->sending_chunk) {
+        conn->chunk_sent += res;
+    } else {
+        conn->sent += res;
+    }
+    //A short send cancels the linked receive, so the rest of the reply and the receive are queued again;
+    //a part that is not the last is followed by the next one
+    if ((size_t)res < conn->send_length || !conn->recv_linked) {
+        flush_connection(conn);
+    }
+}
+
+}
+
+bool run_uring_server(int listen_fd, SessionFactory factory) {
+    if (!ring.init(RING_ENTRIES)) {
+        fprintf(stderr, "io_uring is unavailable (%s)\n", strerror(errno));
+        return false;
+    }
+    const int required_ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_PROVIDE_BUFFERS };
+    if (!ring.supports(required_ops, 4)) {
+        fprintf(stderr, "io_uring lacks accept/recv/send/provide-buffers support\n");
+        return false;
+    }
+
+    server_fd = listen_fd;
+    session_factory = factory;
+#ifdef IORING_ACCEPT_MULTISHOT
+    multishot_accept = true;
+#endif
+
+    buffers = (char*)malloc((size_t)NUM_BUFFERS * BUFFER_SIZE);
+    provide_buffers(0, NUM_BUFFERS);
+    arm_accept();
+
+    while (true) {
+        if (ring.submitAndWait(1) < 0) {
+            LOG(LEVEL_ERROR, "io_uring_enter failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+
+        struct io_uring_cqe cqe;
+        while (ring.peekCqe(cqe)) {
+            UringConnection* conn = (UringConnection*)(cqe.user_data & ~OP_MASK);
+            switch (cqe.user_data & OP_MASK) {
+                case OP_ACCEPT:
+                    handle_accept(cqe.res, cqe.flags);
+                    break;
+                case OP_RECV:
+                    handle_recv(conn, cqe.res, cqe.flags);
+                    break;
+                case OP_SEND:
+                    handle_send(conn, cqe.res);
+                    break;
+                case OP_PROVIDE:
+                    if (cqe.res < 0) {
+                        LOG(LEVEL_ERROR, "Cannot provide receive buffers (%s)\n", strerror(-cqe.res));
+                    } else {
+                        rearm_waiting();
+                    }
+                    break;
+            }
+        }
+    }
+    return true;
+}
+
+#else
+
+bool run_uring_server(int listen_fd, SessionFactory factory) {
+    (void)listen_fd;
+    (void)factory;
+    fprintf(stderr, "io_uring support was not compiled in\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef URING_H
+#define URING_H
+
+#include "session.h"
+
+//Serves every connection accepted on listen_fd from one io_uring event loop on the calling thread.
+//Returns false straight away when the kernel (or the build) has no usable io_uring, so the caller can fall back
+bool run_uring_server(int listen_fd, SessionFactory factory);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "userdirectory.h"
+#include "log.h"
+
+using namespace std;
+
+namespace {
+
+const uint32_t EMPTY = 0xffffffff;
+const uint32_t DELETED = 0xfffffffe;
+
+//Open-addressing set of names with linear probing. Each slot holds part of the name's hash, so most
+//probes that miss never touch the arena, and the offset of the name in the arena. A removed name leaves a
+//tombstone and its bytes in the arena until the next rebuild
+class UserTable {
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t offset;
+    };
+
+    vector<Slot> slots;         //Power-of-two size
+    string names;               //Every name followed by a NUL
+    size_t live;
+    size_t deleted;
+
+    static uint32_t hashName(string_view name) {
+        //FNV-1a
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : name) {
+            hash = (hash ^ c) * 16777619u;
+        }
+        return hash;
+    }
+
+    bool matches(const Slot& slot, uint32_t hash, string_view name) const {
+        return slot.hash == hash && names.compare(slot.offset, name.size(), name) == 0 &&
+               names[slot.offset + name.size()] == '\0';
+    }
+
+    //Index of the slot holding name, or of the slot it would be inserted into (the first tombstone or
+    //empty slot on its probe sequence)
+    size_t probe(string_view name, uint32_t hash, bool& found) const {
+        size_t mask = slots.size() - 1;
+        size_t insert_at = SIZE_MAX;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (slot.offset == EMPTY) {
+                found = false;
+                return (insert_at != SIZE_MAX) ? insert_at : i;
+            }
+            if (slot.offset == DELETED) {
+                if (insert_at == SIZE_MAX) {
+                    insert_at = i;
+                }
+            } else if (matches(slot, hash, name)) {
+                found = true;
+                return i;
+            }
+        }
+    }
+
+    //Rehashes into a table sized for live names and compacts the arena
+    void rebuild(size_t capacity) {
+        vector<Slot> old_slots(capacity, Slot{ 0, EMPTY });
+        old_slots.swap(slots);
+        string old_names;
+        old_names.swap(names);
+        names.reserve(old_names.size());
+        live = 0;
+        deleted = 0;
+        for (const Slot& slot : old_slots) {
+            if (slot.offset < DELETED) {
+                insert(string_view(old_names.c_str() + slot.offset));
+            }
+        }
+    }
+
+public:
+    UserTable() : slots(1024, Slot{ 0, EMPTY }), live(0), deleted(0) {}
+
+    bool contains(string_view name) const {
+        bool found;
+        probe(name, hashName(name), found);
+        return found;
+    }
+
+    void insert(string_view name) {
+        //Keeps at most 70% of the slots in use, counting tombstones
+        if ((live + deleted + 1) * 10 > slots.size() * 7) {
+            size_t capacity = slots.size();
+            while ((live + 1) * 10 > capacity * 5) {
+                capacity *= 2;
+            }
+            rebuild(capacity);
+        }
+        uint32_t hash = hashName(name);
+        bool found;
+        size_t index = probe(name, hash, found);
+        if (found) {
+            return;
+        }
+        if (slots[index].offset == DELETED) {
+            deleted--;
+        }
+        slots[index].hash = hash;
+        slots[index].offset = (uint32_t)names.size();
+        names.append(name);
+        names += '\0';
+        live++;
+    }
+
+    void erase(string_view name) {
+        bool found;
+        size_t index = probe(name, hashName(name), found);
+        if (found) {
+            slots[index].offset = DELETED;
+            live--;
+            deleted++;
+        }
+    }
+
+    void swap(UserTable& other) {
+        slots.swap(other.slots);
+        names.swap(other.names);
+        std::swap(live, other.live);
+        std::swap(deleted, other.deleted);
+    }
+
+    size_t size() const {
+        return live;
+    }
+
+    size_t memory() const {
+        return slots.capacity() * sizeof(Slot) + names.capacity();
+    }
+};
+
+string directory_path;
+UserTable users;
+pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+atomic<bool> watching(false);
+
+//Returns the user a directory entry is the mailbox of, or an empty view
+string_view mailbox_user(const char* file_name) {
+    string_view name(file_name);
+    if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".mbox") != 0) {
+        return string_view();
+    }
+    return name.substr(0, name.size() - 5);
+}
+
+bool load_users(UserTable& table) {
+    DIR* dir = opendir(directory_path.c_str());
+    if (dir == nullptr) {
+        LOG(LEVEL_ERROR, "Cannot read mail directory %s (%s)\n", directory_path.c_str(), strerror(errno));
+        return false;
+    }
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != nullptr) {
+        string_view user = mailbox_user(dirent->d_name);
+        if (!user.empty() && dirent->d_type != DT_DIR) {
+            table.insert(user);
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+//Rereads the whole directory after inotify dropped events
+void reload_users() {
+    UserTable table;
+    if (!load_users(table)) {
+        return;
+    }
+    pthread_rwlock_wrlock(&users_lock);
+    users.swap(table);
+    pthread_rwlock_unlock(&users_lock);
+}
+
+void *watch_directory(void *arg) {
+    int inotify_fd = (int)(intptr_t)arg;
+    alignas(struct inotify_event) char buffer[65536];
+    while (true) {
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (char* p = buffer; p < buffer + n; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                reload_users();
+                continue;
+            }
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                LOG(LEVEL_ERROR, "Mail directory %s is no longer watched\n", directory_path.c_str());
+                watching = false;
+                close(inotify_fd);
+                return NULL;
+            }
+            string_view user = (event->len > 0) ? mailbox_user(event->name) : string_view();
+            if (user.empty() || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+            pthread_rwlock_wrlock(&users_lock);
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                users.insert(user);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                users.erase(user);
+            }
+            pthread_rwlock_unlock(&users_lock);
+        }
+    }
+    LOG(LEVEL_ERROR, "Cannot read inotify events (%s)\n", strerror(errno));
+    watching = false;
+    close(inotify_fd);
+    return NULL;
+}
+
+}
+
+bool start_user_directory(const string& mail_dir) {
+    directory_path = mail_dir;
+
+    //The watch is set up before the directory is read, so a mailbox created in between is not missed
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, mail_dir.c_str(),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (inotify_fd < 0) {
+        LOG(LEVEL_ERROR, "Cannot watch mail directory %s (%s); checking mailboxes on disk\n", mail_dir.c_str(),
+                strerror(errno));
+    }
+
+    pthread_rwlock_wrlock(&users_lock);
+    bool loaded = load_users(users);
+    pthread_rwlock_unlock(&users_lock);
+    if (!loaded) {
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+        return false;
+    }
+
+    if (inotify_fd >= 0) {
+        pthread_t thread;
+        watching = true;
+        if (pthread_create(&thread, NULL, watch_directory, (void*)(intptr_t)inotify_fd) != 0) {
+            watching = false;
+            close(inotify_fd);
+        } else {
+            pthread_detach(thread);
+        }
+    }
+    return true;
+}
+
+bool user_exists(string_view user) {
+    pthread_rwlock_rdlock(&users_lock);
+    bool found = users.contains(user);
+    pthread_rwlock_unlock(&users_lock);
+    if (found || watching) {
+        return found;
+    }
+    //Without a watch the table may be stale, so a miss is checked on disk
+    string mbox_path = directory_path + "/";
+    mbox_path.append(user);
+    mbox_path += ".mbox";
+    return access(mbox_path.c_str(), F_OK) == 0;
+}
+
+size_t user_directory_size() {
+    pthread_rwlock_rdlock(&users_lock);
+    size_t size = users.size();
+    pthread_rwlock_unlock(&users_lock);
+    return size;
+}
+
+size_t user_directory_memory() {
+    pthread_rwlock_rdlock(&users_lock);
+    size_t memory = users.memory();
+    pthread_rwlock_unlock(&users_lock);
+    return memory;
+}
+
+void print_user_directory_stats(FILE* out) {
+    fprintf(out, "User directory: %zu users in %.1f KB%s\n", user_directory_size(), user_directory_memory() / 1024.0,
+            watching ? "" : " (not watched)");
+}
@@ -0,0 +1,23 @@
+#ifndef USERDIRECTORY_H
+#define USERDIRECTORY_H
+
+#include <stdio.h>
+#include <string>
+#include <string_view>
+
+//In-memory set of the users that have a mailbox, i.e. the names of mail_dir/*.mbox, shared by both servers
+//so RCPT TO and USER do not touch the file system. It is loaded at startup and kept current with inotify.
+//Names are packed into one arena and indexed by an open-addressing table of 8-byte slots, so a few
+//million users take tens of megabytes
+
+//Loads the directory and starts the thread that follows changes to mail_dir
+bool start_user_directory(const std::string& mail_dir);
+
+//True when user has a mailbox. Falls back to the file system if mail_dir cannot be watched
+bool user_exists(std::string_view user);
+
+size_t user_directory_size();
+size_t user_directory_memory();      //Bytes held by the table and the name arena
+void print_user_directory_stats(FILE* out);
+
+#endif
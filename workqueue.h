@@ -0,0 +1,69 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>
+#include <vector>
+
+//Fixed-capacity multi-producer multi-consumer queue; producers never block, consumers wait for work
+template <typename T>
+class BoundedQueue {
+private:
+    std::vector<T> slots;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    size_t waiting;     //Consumers blocked in pop() that have not yet claimed an item
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+
+public:
+    //Room for one extra item per consumer so a burst is not rejected while idle consumers wake up
+    BoundedQueue(size_t capacity, size_t consumers) : slots(capacity + consumers), head(0), count(0),
+                                                     capacity(capacity), waiting(0) {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&notEmpty, nullptr);
+    }
+
+    ~BoundedQueue() {
+        pthread_cond_destroy(&notEmpty);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    //Adds an item unless the queue is full; returns false when it is
+    bool tryPush(const T& item) {
+        pthread_mutex_lock(&mutex);
+        if (count >= capacity + waiting) {
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+        slots[(head + count) % slots.size()] = item;
+        count++;
+        pthread_cond_signal(&notEmpty);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    //Removes the oldest item, waiting until one is available
+    T pop() {
+        pthread_mutex_lock(&mutex);
+        waiting++;
+        while (count == 0) {
+            pthread_cond_wait(&notEmpty, &mutex);
+        }
+        waiting--;
+        T item = slots[head];
+        head = (head + 1) % slots.size();
+        count--;
+        pthread_mutex_unlock(&mutex);
+        return item;
+    }
+
+    size_t size() {
+        pthread_mutex_lock(&mutex);
+        size_t current = count;
+        pthread_mutex_unlock(&mutex);
+        return current;
+    }
+};
+
+#endif